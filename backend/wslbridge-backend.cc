@@ -1,19 +1,26 @@
 #include <arpa/inet.h>
 #include <assert.h>
+#include <dlfcn.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
+#include <poll.h>
 #include <pthread.h>
 #include <pty.h>
 #include <pwd.h>
 #include <signal.h>
+#include <spawn.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
 #include <sys/ioctl.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <termios.h>
@@ -21,37 +28,67 @@
 
 #include <algorithm>
 #include <atomic>
+#include <chrono>
 #include <condition_variable>
+#include <functional>
+#include <map>
 #include <memory>
 #include <mutex>
 #include <string>
-#include <thread>
 #include <vector>
 
+#include "../common/Compress.h"
 #include "../common/SocketIo.h"
 
 namespace {
 
-static int connectSocket(int port, const std::string &key) {
-    const int s = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+// Starts connecting to a frontend port without waiting, so the connections
+// can proceed in parallel with each other and with spawning the child.
+static int startConnect(int port, int bufferSize) {
+    const int s = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    assert(s >= 0);
 
     setSocketNoDelay(s);
+    setSocketBufferSize(s, bufferSize);
 
     sockaddr_in addr = {};
     addr.sin_family = AF_INET;
     addr.sin_port = htons(port);
     addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
     const int connectRet = connect(s, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr));
-    assert(connectRet == 0);
+    if (connectRet != 0 && errno != EINPROGRESS) {
+        fatalPerror("error: connect failed");
+    }
+    return s;
+}
+
+// Waits for a startConnect connection, then makes it blocking and sends the
+// key.
+static void finishConnect(int s, const std::string &key) {
+    pollfd pfd = { s, POLLOUT, 0 };
+    while (poll(&pfd, 1, -1) < 0) {
+        if (errno != EINTR) {
+            fatalPerror("error: poll failed");
+        }
+    }
+    int err = 0;
+    socklen_t errLen = sizeof(err);
+    if (getsockopt(s, SOL_SOCKET, SO_ERROR, &err, &errLen) != 0 || err != 0) {
+        errno = err;
+        fatalPerror("error: connect failed");
+    }
+    const int flags = fcntl(s, F_GETFL);
+    assert(flags >= 0);
+    fcntl(s, F_SETFL, flags & ~O_NONBLOCK);
 
-    size_t i = 0;
-    while (i < key.size()) {
-        const size_t remaining = key.size() - i;
-        const ssize_t actual = write(s, &key[i], remaining);
-        assert(actual > 0 && static_cast<size_t>(actual) <= remaining);
-        i += actual;
+    if (!writeAllRestarting(s, key.data(), key.size())) {
+        fatalPerror("error: could not send the key");
     }
+}
 
+static int connectSocket(int port, const std::string &key, int bufferSize = 0) {
+    const int s = startConnect(port, bufferSize);
+    finishConnect(s, key);
     return s;
 }
 
@@ -63,6 +100,9 @@ static std::string resolveCwd(const std::string &cwd) {
     return cwd;
 }
 
+// Linux's default pipe capacity.
+const int kDefaultPipeSize = 64 * 1024;
+
 struct ChildParams {
     bool usePty = false;
     int cols = -1;
@@ -71,6 +111,12 @@ struct ChildParams {
     std::string prog;
     std::vector<char*> argv;
     std::string cwd;
+    // When set, the forked child runs a built-in benchmark load instead of
+    // exec'ing prog.  See runBenchChild.
+    std::string benchChild;
+    // If non-zero, the capacity to give the child's pipes, so that reads as
+    // large as the buffers aren't cut short by the default 64 KiB.
+    int pipeSize = 0;
 };
 
 struct Child {
@@ -121,21 +167,72 @@ struct ProcessPipes {
     UniqueFd errorPipe;
 };
 
-static PipePair makePipePair(int oflags) {
+static PipePair makePipePair(int oflags, int size = 0) {
     int vals[2];
     if (pipe2(vals, oflags) != 0) {
         fatalPerror("error: pipe2 failed");
     }
+    if (size > 0) {
+        // It's only a hint: unprivileged processes are limited by
+        // /proc/sys/fs/pipe-max-size, and WSL1 may not support it at all.
+        fcntl(vals[0], F_SETPIPE_SZ, size);
+    }
     return PipePair {
         UniqueFd(vals[0]),
         UniqueFd(vals[1])
     };
 }
 
-static pid_t forkPipes(ProcessPipes &out) {
-    auto inputPipe = makePipePair(0);
-    auto outputPipe = makePipePair(0);
-    auto errorPipe = makePipePair(0);
+// The child side of the frontend's --bench mode.  "output:BYTES" writes BYTES
+// of filler to stdout; "echo" copies stdin to stdout until EOF or a ^D byte.
+// A pty is put in raw mode, so the frontend receives exactly the bytes
+// written, and input EOF can't be signaled any other way.
+static void runBenchChild(const std::string &kind) __attribute__((noreturn));
+static void runBenchChild(const std::string &kind) {
+    termios tio = {};
+    if (tcgetattr(STDIN_FILENO, &tio) == 0) {
+        cfmakeraw(&tio);
+        tcsetattr(STDIN_FILENO, TCSANOW, &tio);
+    }
+    std::vector<char> buf(64 * 1024);
+    if (kind.substr(0, 7) == "output:") {
+        for (size_t i = 0; i < buf.size(); ++i) {
+            buf[i] = 'a' + i % 26;
+        }
+        long long remaining = atoll(kind.c_str() + 7);
+        while (remaining > 0) {
+            const size_t amt = std::min<long long>(remaining, buf.size());
+            if (!writeAllRestarting(STDOUT_FILENO, buf.data(), amt)) {
+                _exit(1);
+            }
+            remaining -= amt;
+        }
+        _exit(0);
+    } else if (kind == "echo") {
+        while (true) {
+            const ssize_t amt = readRestarting(STDIN_FILENO, buf.data(), buf.size());
+            if (amt <= 0) {
+                _exit(0);
+            }
+            const char *const quit =
+                static_cast<const char*>(memchr(buf.data(), '\x04', amt));
+            const size_t echoSize = quit ? quit - buf.data() : amt;
+            if (!writeAllRestarting(STDOUT_FILENO, buf.data(), echoSize)) {
+                _exit(1);
+            }
+            if (quit) {
+                _exit(0);
+            }
+        }
+    }
+    fprintf(stderr, "error: unknown --bench-child '%s'\n", kind.c_str());
+    _exit(1);
+}
+
+static pid_t forkPipes(ProcessPipes &out, int pipeSize) {
+    auto inputPipe = makePipePair(0, pipeSize);
+    auto outputPipe = makePipePair(0, pipeSize);
+    auto errorPipe = makePipePair(0, pipeSize);
     const pid_t child = fork();
     if (child == static_cast<pid_t>(-1)) {
         // Do nothing.
@@ -157,22 +254,415 @@ static pid_t forkPipes(ProcessPipes &out) {
     return child;
 }
 
-static Child spawnChild(const ChildParams &params) {
+typedef int AddFchdirFunc(posix_spawn_file_actions_t *actions, int fd);
+
+// posix_spawn avoids copying the backend's address space, which fork does
+// slowly on WSL1: glibc implements it with clone(CLONE_VM | CLONE_VFORK).
+// Starting in a directory needs posix_spawn_file_actions_addfchdir_np, from
+// glibc 2.29, so look it up at runtime and keep using fork on older
+// distributions.  A glibc that new also reports exec failures from
+// posix_spawn and supports POSIX_SPAWN_SETSID.
+static AddFchdirFunc *spawnAddFchdir() {
+    static AddFchdirFunc *const func = reinterpret_cast<AddFchdirFunc*>(
+        dlsym(RTLD_DEFAULT, "posix_spawn_file_actions_addfchdir_np"));
+    return func;
+}
+
+static size_t envNameLength(const char *setting) {
+    const char *eq = strchr(setting, '=');
+    return eq != nullptr ? eq - setting : strlen(setting);
+}
+
+static bool canPosixSpawn(const ChildParams &params) {
+    if (!params.benchChild.empty() || spawnAddFchdir() == nullptr) {
+        return false;
+    }
+    // posix_spawnp searches the backend's PATH rather than the child's.
+    for (const char *setting : params.env) {
+        if (envNameLength(setting) == 4 && !strncmp(setting, "PATH", 4)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// The backend's environment with the -e settings applied: they replace
+// inherited variables, and a setting without '=' removes one, as with putenv.
+static std::vector<char*> childEnvironment(const ChildParams &params) {
+    const auto settingIndex = [&](const char *var) -> int {
+        const size_t len = envNameLength(var);
+        for (int i = params.env.size() - 1; i >= 0; --i) {
+            if (envNameLength(params.env[i]) == len &&
+                    !strncmp(params.env[i], var, len)) {
+                return i;
+            }
+        }
+        return -1;
+    };
+    std::vector<char*> ret;
+    for (char **var = environ; *var != nullptr; ++var) {
+        if (settingIndex(*var) == -1) {
+            ret.push_back(*var);
+        }
+    }
+    for (size_t i = 0; i < params.env.size(); ++i) {
+        // Only the last setting of each variable counts.
+        if (settingIndex(params.env[i]) == static_cast<int>(i) &&
+                strchr(params.env[i], '=') != nullptr) {
+            ret.push_back(params.env[i]);
+        }
+    }
+    ret.push_back(nullptr);
+    return ret;
+}
+
+// Spawns the child with posix_spawn.  Returns false, having started nothing,
+// if the child must be forked instead.
+static bool posixSpawnChild(const ChildParams &params, StartupTrace *trace, Child &ret) {
+    const auto failed = [&](SpawnError::Type type, int err) {
+        ret.spawnError = SpawnError { type, bridgedError(err) };
+        return true;
+    };
+
+    UniqueFd cwdFd;
+    if (!params.cwd.empty()) {
+        cwdFd = UniqueFd(open(resolveCwd(params.cwd).c_str(),
+                              O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+        if (cwdFd.fd() < 0) {
+            // chdir only needs search permission on the directory.
+            return errno == EACCES ? false : failed(SpawnError::Type::ChdirFailed, errno);
+        }
+    }
+
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawnattr_init(&attr);
+    struct Cleanup {
+        posix_spawn_file_actions_t &actions;
+        posix_spawnattr_t &attr;
+        ~Cleanup() {
+            posix_spawn_file_actions_destroy(&actions);
+            posix_spawnattr_destroy(&attr);
+        }
+    } cleanup { actions, attr };
+    short flags = POSIX_SPAWN_SETSIGDEF;
+    sigset_t defaultSignals;
+    sigemptyset(&defaultSignals);
+    sigaddset(&defaultSignals, SIGPIPE);
+    posix_spawnattr_setsigdefault(&attr, &defaultSignals);
+
+    UniqueFd masterFd;
+    PipePair inputPipe, outputPipe, errorPipe;
+    if (params.usePty) {
+        masterFd = UniqueFd(posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC));
+        char slaveName[64] = {};
+        if (masterFd.fd() < 0 ||
+                grantpt(masterFd.fd()) != 0 ||
+                unlockpt(masterFd.fd()) != 0 ||
+                ptsname_r(masterFd.fd(), slaveName, sizeof(slaveName)) != 0) {
+            return failed(SpawnError::Type::ForkPtyFailed, errno);
+        }
+        winsize ws = {};
+        ws.ws_col = params.cols;
+        ws.ws_row = params.rows;
+        ioctl(masterFd.fd(), TIOCSWINSZ, &ws);
+        // The child starts a new session before the file actions run, so
+        // opening the slave makes it the controlling terminal, as login_tty
+        // would.
+        flags |= POSIX_SPAWN_SETSID;
+        posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, slaveName, O_RDWR, 0);
+        posix_spawn_file_actions_adddup2(&actions, STDIN_FILENO, STDOUT_FILENO);
+        posix_spawn_file_actions_adddup2(&actions, STDIN_FILENO, STDERR_FILENO);
+    } else {
+        inputPipe = makePipePair(O_CLOEXEC, params.pipeSize);
+        outputPipe = makePipePair(O_CLOEXEC, params.pipeSize);
+        errorPipe = makePipePair(O_CLOEXEC, params.pipeSize);
+        posix_spawn_file_actions_adddup2(&actions, inputPipe.read.fd(), STDIN_FILENO);
+        posix_spawn_file_actions_adddup2(&actions, outputPipe.write.fd(), STDOUT_FILENO);
+        posix_spawn_file_actions_adddup2(&actions, errorPipe.write.fd(), STDERR_FILENO);
+    }
+    if (cwdFd.fd() != -1) {
+        spawnAddFchdir()(&actions, cwdFd.fd());
+    }
+    if (posix_spawnattr_setflags(&attr, flags) != 0) {
+        return false;
+    }
+
+    auto envp = childEnvironment(params);
+    const int64_t spawnStart = trace ? traceClockMicros() : 0;
+    pid_t pid = -1;
+    const int err = posix_spawnp(&pid, params.prog.c_str(), &actions, &attr,
+                                 params.argv.data(), envp.data());
+    if (trace) {
+        trace->add("posix_spawn", spawnStart, traceClockMicros());
+    }
+    if (err == ENOEXEC) {
+        // execvp runs such a file with /bin/sh, and posix_spawnp doesn't.
+        return false;
+    } else if (err != 0) {
+        return failed(SpawnError::Type::ExecFailed, err);
+    }
+
+    ret.spawnError = SpawnError { SpawnError::Type::Success, bridgedError(0) };
+    ret.pid = pid;
+    if (params.usePty) {
+        ret.masterFd = masterFd.release();
+        ret.inputFd = ret.masterFd;
+        ret.outputFd = ret.masterFd;
+        ret.errorFd = -1;
+    } else {
+        ret.inputFd = inputPipe.write.release();
+        ret.outputFd = outputPipe.read.release();
+        ret.errorFd = errorPipe.read.release();
+    }
+    return true;
+}
+
+// With --pool, an idle daemon session forks its child before any frontend
+// connects.  The child holds both a pty and a set of pipes and waits on a
+// socket for its parameters; launching it then costs only the chdir and
+// exec, and the unused stdio is closed.  If the session ends first, the
+// child reads EOF and exits.
+class WarmChild {
+public:
+    // Returns false if the child could not be forked.
+    bool start();
+    // Returns false, having started nothing, if the child has gone away.
+    bool spawn(const ChildParams &params, StartupTrace *trace, Child &ret);
+
+private:
+    // What spawn sends: the header, then the cwd, the program, envCount
+    // environment strings, and argCount arguments, each NUL-terminated.
+    struct Request {
+        uint32_t size;
+        uint32_t usePty;
+        uint32_t envCount;
+        uint32_t argCount;
+    };
+
+    static void runChild(int requestFd, int errorFd, int slaveFd,
+                         int inputFd, int outputFd, int errFd) __attribute__((noreturn));
+
+    pid_t pid_ = -1;
+    UniqueFd request_;
+    UniqueFd spawnErr_;
+    UniqueFd master_;
+    UniqueFd input_;
+    UniqueFd output_;
+    UniqueFd error_;
+};
+
+static WarmChild *g_warmChild = nullptr;
+
+bool WarmChild::start() {
+    UniqueFd master(posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC));
+    char slaveName[64] = {};
+    if (master.fd() < 0 ||
+            grantpt(master.fd()) != 0 ||
+            unlockpt(master.fd()) != 0 ||
+            ptsname_r(master.fd(), slaveName, sizeof(slaveName)) != 0) {
+        return false;
+    }
+    UniqueFd slave(open(slaveName, O_RDWR | O_NOCTTY | O_CLOEXEC));
+    int requestFds[2];
+    if (slave.fd() < 0 ||
+            socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, requestFds) != 0) {
+        return false;
+    }
+    UniqueFd request(requestFds[0]);
+    UniqueFd childRequest(requestFds[1]);
+    PipePair spawnErr = makePipePair(O_CLOEXEC);
+    PipePair input = makePipePair(O_CLOEXEC);
+    PipePair output = makePipePair(O_CLOEXEC);
+    PipePair error = makePipePair(O_CLOEXEC);
+    const pid_t pid = fork();
+    if (pid < 0) {
+        return false;
+    } else if (pid == 0) {
+        // The session's ends must close, so a dying session is noticed.
+        request.close();
+        spawnErr.read.close();
+        master.close();
+        input.write.close();
+        output.read.close();
+        error.read.close();
+        runChild(childRequest.fd(), spawnErr.write.fd(), slave.fd(),
+                 input.read.fd(), output.write.fd(), error.write.fd());
+    }
+    pid_ = pid;
+    request_ = std::move(request);
+    spawnErr_ = std::move(spawnErr.read);
+    master_ = std::move(master);
+    input_ = std::move(input.write);
+    output_ = std::move(output.read);
+    error_ = std::move(error.read);
+    return true;
+}
+
+void WarmChild::runChild(int requestFd, int errorFd, int slaveFd,
+                         int inputFd, int outputFd, int errFd) {
+    Request request = {};
+    if (!readAllRestarting(requestFd, &request, sizeof(request)) ||
+            request.size < sizeof(request) ||
+            request.size - sizeof(request) > kMaxSpawnRequestSize) {
+        _exit(0);
+    }
+    std::vector<char> buf(request.size - sizeof(request));
+    if (!readAllRestarting(requestFd, buf.data(), buf.size()) ||
+            buf.empty() || buf.back() != '\0') {
+        _exit(1);
+    }
+    std::vector<char*> strings;
+    for (size_t i = 0; i < buf.size(); i += strlen(&buf[i]) + 1) {
+        strings.push_back(&buf[i]);
+    }
+    if (strings.size() != 2 + request.envCount + request.argCount) {
+        _exit(1);
+    }
+    std::vector<char*> envp(strings.begin() + 2, strings.begin() + 2 + request.envCount);
+    std::vector<char*> argv(strings.begin() + 2 + request.envCount, strings.end());
+    envp.push_back(nullptr);
+    argv.push_back(nullptr);
+
+    const auto childFailed = [&](SpawnError::Type type, int savedErrno) {
+        const SpawnError err = { type, bridgedError(savedErrno) };
+        writeAllRestarting(errorFd, &err, sizeof(err));
+        _exit(1);
+    };
+    if (request.usePty) {
+        // As login_tty does.
+        setsid();
+        if (ioctl(slaveFd, TIOCSCTTY, 0) != 0) {
+            childFailed(SpawnError::Type::ForkPtyFailed, errno);
+        }
+        dup2(slaveFd, STDIN_FILENO);
+        dup2(slaveFd, STDOUT_FILENO);
+        dup2(slaveFd, STDERR_FILENO);
+    } else {
+        dup2(inputFd, STDIN_FILENO);
+        dup2(outputFd, STDOUT_FILENO);
+        dup2(errFd, STDERR_FILENO);
+    }
+    signal(SIGPIPE, SIG_DFL);
+    if (strings[0][0] != '\0' && chdir(resolveCwd(strings[0]).c_str()) != 0) {
+        childFailed(SpawnError::Type::ChdirFailed, errno);
+    }
+    environ = envp.data();
+    execvp(strings[1], argv.data());
+    childFailed(SpawnError::Type::ExecFailed, errno);
+    _exit(1);
+}
+
+bool WarmChild::spawn(const ChildParams &params, StartupTrace *trace, Child &ret) {
+    const int64_t execStart = trace ? traceClockMicros() : 0;
+    if (params.usePty) {
+        winsize ws = {};
+        ws.ws_col = params.cols;
+        ws.ws_row = params.rows;
+        ioctl(master_.fd(), TIOCSWINSZ, &ws);
+        input_.close();
+        output_.close();
+        error_.close();
+    } else {
+        master_.close();
+        if (params.pipeSize > 0) {
+            for (const int fd : { input_.fd(), output_.fd(), error_.fd() }) {
+                fcntl(fd, F_SETPIPE_SZ, params.pipeSize);
+            }
+        }
+    }
+
+    const auto envp = childEnvironment(params);
+    Request request = {};
+    request.usePty = params.usePty;
+    request.envCount = envp.size() - 1;
+    request.argCount = params.argv.size() - 1;
+    std::string payload(sizeof(request), '\0');
+    payload.append(params.cwd.c_str(), params.cwd.size() + 1);
+    payload.append(params.prog.c_str(), params.prog.size() + 1);
+    for (const auto &strs : { &envp, &params.argv }) {
+        for (const char *str : *strs) {
+            if (str != nullptr) {
+                payload.append(str, strlen(str) + 1);
+            }
+        }
+    }
+    request.size = payload.size();
+    memcpy(&payload[0], &request, sizeof(request));
+
+    SpawnError err = {};
+    if (payload.size() - sizeof(request) > kMaxSpawnRequestSize) {
+        return false;
+    } else if (send(request_.fd(), payload.data(), payload.size(), MSG_NOSIGNAL) !=
+               static_cast<ssize_t>(payload.size())) {
+        int dummy = 0;
+        waitpid(pid_, &dummy, 0);
+        return false;
+    } else if (!readAllRestarting(spawnErr_.fd(), &err, sizeof(err))) {
+        // The pipe reached EOF, so the child has exec'ed.
+        err = SpawnError { SpawnError::Type::Success, bridgedError(0) };
+    }
+    request_.close();
+    if (trace) {
+        trace->add("warm exec", execStart, traceClockMicros());
+    }
+    ret.spawnError = err;
+    if (err.type != SpawnError::Type::Success) {
+        int dummy = 0;
+        waitpid(pid_, &dummy, 0);
+        return true;
+    }
+    ret.pid = pid_;
+    if (params.usePty) {
+        ret.masterFd = master_.release();
+        ret.inputFd = ret.masterFd;
+        ret.outputFd = ret.masterFd;
+        ret.errorFd = -1;
+    } else {
+        ret.inputFd = input_.release();
+        ret.outputFd = output_.release();
+        ret.errorFd = error_.release();
+    }
+    return true;
+}
+
+static Child spawnChild(const ChildParams &params, StartupTrace *trace) {
     assert(params.argv.size() >= 2);
     assert(params.argv.back() == nullptr);
 
+    if (g_warmChild != nullptr && params.benchChild.empty()) {
+        // Only a session's first child is ready ahead of time.
+        WarmChild *const warm = g_warmChild;
+        g_warmChild = nullptr;
+        Child ret;
+        if (warm->spawn(params, trace, ret)) {
+            return ret;
+        }
+    }
+
+    {
+        Child ret;
+        if (canPosixSpawn(params) && posixSpawnChild(params, trace, ret)) {
+            return ret;
+        }
+    }
+
     winsize ws = {};
     ws.ws_col = params.cols;
     ws.ws_row = params.rows;
 
+    // Built before forking, so the child only has to point environ at it.
+    auto envp = childEnvironment(params);
     PipePair spawnErrPipe = makePipePair(O_CLOEXEC);
     ProcessPipes processPipes;
 
     int masterFdRaw = -1;
+    const int64_t forkStart = trace ? traceClockMicros() : 0;
     const pid_t pid =
         params.usePty
             ? forkpty(&masterFdRaw, nullptr, nullptr, &ws)
-            : forkPipes(processPipes);
+            : forkPipes(processPipes, params.pipeSize);
     if (pid == static_cast<pid_t>(-1)) {
         // forkpty failed
         const SpawnError err = {
@@ -194,14 +684,18 @@ static Child spawnChild(const ChildParams &params) {
             _exit(1);
         };
         spawnErrPipe.read.close();
-        for (const auto &setting : params.env) {
-            putenv(setting);
-        }
+        // The backend ignores SIGPIPE once it's running (e.g. with --multi).
+        signal(SIGPIPE, SIG_DFL);
+        environ = envp.data();
         if (!params.cwd.empty()) {
             if (chdir(resolveCwd(params.cwd).c_str()) != 0) {
                 childFailed(SpawnError::Type::ChdirFailed, errno);
             }
         }
+        if (!params.benchChild.empty()) {
+            spawnErrPipe.write.close();
+            runBenchChild(params.benchChild);
+        }
         execvp(params.prog.c_str(), params.argv.data());
         childFailed(SpawnError::Type::ExecFailed, errno);
     }
@@ -210,8 +704,18 @@ static Child spawnChild(const ChildParams &params) {
 
     spawnErrPipe.write.close();
 
+    // The pipe reaches EOF once the child execs.
+    const int64_t execStart = trace ? traceClockMicros() : 0;
+    if (trace) {
+        trace->add("fork", forkStart, execStart);
+    }
     SpawnError err = {};
-    if (readAllRestarting(spawnErrPipe.read.fd(), &err, sizeof(err))) {
+    const bool execFailed =
+        readAllRestarting(spawnErrPipe.read.fd(), &err, sizeof(err));
+    if (trace) {
+        trace->add("exec", execStart, traceClockMicros());
+    }
+    if (execFailed) {
         // The child exec call failed.
         int dummy = 0;
         waitpid(pid, &dummy, 0);
@@ -236,24 +740,31 @@ static Child spawnChild(const ChildParams &params) {
     return ret;
 }
 
-struct ChannelWindow {
-    std::mutex mutex;
-    std::condition_variable increaseCV;
-    std::atomic<int32_t> increaseAmt = {0};
-};
-
 struct IoLoop {
     bool usePty = false;
     int controlSocketFd = -1;
     int childFd = -1;
     WindowParams windowParams = {};
+    BufferParams bufferParams = {};
+    // With --compress, stdout and stderr are sent as chunks (see ChunkHeader).
+    bool compress = false;
     ChannelWindow outputWindow;
     ChannelWindow errorWindow;
+    // Set in multiplexed mode, where controlSocketFd carries every channel.
+    std::unique_ptr<MuxSocket> mux;
+    BufferPool pool;
+    ChannelQueue inputQueue { pool };
+    ChannelCounters counters[kDataChannelCount];
     struct {
         pthread_t thread;
         int pipeFd = -1;
         int socketFd = -1;
     } stdoutAutoClose;
+    // Without multiplexing, the control and main threads both write to
+    // controlSocketFd.
+    std::mutex controlMutex;
+    // The signal keys last reported in a SignalKeys packet.
+    uint32_t signalKeys = 0;
 };
 
 static void connectionBrokenAbort() {
@@ -273,24 +784,178 @@ static void revokeFd(int fd) {
     close(nullFd);
 }
 
-static void writePacket(int controlSocketFd, const Packet &p) {
+// Moves up to count bytes from inFd to outFd inside the kernel.  One of the
+// fds must be a pipe.  splice fails with EINVAL (or ENOSYS) when it can't
+// handle the pair, e.g. after revokeFd replaced the pipe with /dev/null, or on
+// a WSL build that doesn't support it; callers then fall back to copying.
+static ssize_t spliceRestarting(int inFd, int outFd, size_t count, unsigned int flags) {
+    ssize_t ret = 0;
+    do {
+        ret = splice(inFd, nullptr, outFd, nullptr, count, SPLICE_F_MOVE | flags);
+    } while (ret < 0 && errno == EINTR);
+    return ret;
+}
+
+static bool spliceUnsupported(int err) {
+    return err == EINVAL || err == ENOSYS;
+}
+
+const size_t kInputSpliceSize = 64 * 1024;
+
+// The capabilities both sides have, from the frontend's --check-version.
+static uint32_t g_capabilities = kCapabilities;
+
+static Packet helloPacket() {
+    Packet p = { sizeof(Packet), Packet::Type::Hello };
+    p.u.hello.protocol = kProtocolVersion;
+    p.u.hello.capabilities = g_capabilities;
+    return p;
+}
+
+static void writePacket(IoLoop &ioloop, const Packet &p) {
     assert(p.size >= sizeof(p));
-    if (!writeAllRestarting(controlSocketFd,
+    if (ioloop.mux) {
+        if (!ioloop.mux->writePacket(p)) {
+            connectionBrokenAbort();
+        }
+        return;
+    }
+    std::lock_guard<std::mutex> lock(ioloop.controlMutex);
+    if (!writeAllRestarting(ioloop.controlSocketFd,
             reinterpret_cast<const char*>(&p), p.size)) {
         connectionBrokenAbort();
     }
 }
 
+// The most child output to read at once.  When multiplexed, the data (and
+// its chunk header, when compressing) must still fit in one frame.
+static size_t outputReadSize(const IoLoop &ioloop) {
+    size_t ret = ioloop.bufferParams.output;
+    if (ioloop.mux) {
+        ret = std::min<size_t>(ret, kMaxFramePayload -
+            (ioloop.compress ? sizeof(ChunkHeader) : 0));
+    }
+    return ret;
+}
+
+static ChannelCounters &channelCounters(IoLoop &ioloop, Channel channel) {
+    return ioloop.counters[dataChannelIndex(channel)];
+}
+
+// The reply to a RequestStats packet.
+static PacketStats statsPacket(IoLoop &ioloop) {
+    PacketStats p = {};
+    p.size = sizeof(p);
+    p.type = Packet::Type::Stats;
+    for (int i = 0; i < kDataChannelCount; ++i) {
+        p.channels[i] = ioloop.counters[i].snapshot();
+    }
+    p.pool = ioloop.pool.stats();
+    return p;
+}
+
+// The line discipline's setting and signal for each TermSignal.
+static const struct { int cc; int signo; } kTermSignalKeys[] = {
+    { VINTR, SIGINT },
+    { VQUIT, SIGQUIT },
+    { VSUSP, SIGTSTP },
+};
+
+const size_t kTermSignalCount = sizeof(kTermSignalKeys) / sizeof(kTermSignalKeys[0]);
+
+// Whether the pty's line discipline sends TermSignal index for its key.
+static bool signalKeyActive(const termios &attr, size_t index) {
+    return (attr.c_lflag & ISIG) &&
+        attr.c_cc[kTermSignalKeys[index].cc] == static_cast<cc_t>(kTermSignalChars[index]);
+}
+
+// Fills in a SignalKeys packet if the keys the line discipline acts on have
+// changed since the last one.  Signal packets only come multiplexed, in order
+// with the input, so the keys are only reported then.
+static bool signalKeysChanged(IoLoop &ioloop, Packet &p) {
+    if (!ioloop.usePty || !ioloop.mux || ioloop.childFd == -1 ||
+            !(g_capabilities & kCapSignalKeys)) {
+        return false;
+    }
+    termios attr = {};
+    uint32_t keys = 0;
+    if (tcgetattr(ioloop.childFd, &attr) == 0) {
+        for (size_t i = 0; i < kTermSignalCount; ++i) {
+            if (signalKeyActive(attr, i)) {
+                keys |= 1u << i;
+            }
+        }
+    }
+    if (keys == ioloop.signalKeys) {
+        return false;
+    }
+    ioloop.signalKeys = keys;
+    p = {};
+    p.size = sizeof(p);
+    p.type = Packet::Type::SignalKeys;
+    p.u.signalKeys = keys;
+    return true;
+}
+
 static void socketToChildThread(IoLoop *ioloop, int socketFd, int outputFd) {
-    std::array<char, 8192> buf;
+    ChannelCounters &counters = channelCounters(*ioloop, Channel::Input);
+    // Allocated on the first copy; spliced or multiplexed input never needs
+    // it.
+    std::vector<char> buf;
+    int32_t unacked = 0;
+    // Without a pty or multiplexing, the socket feeds the child's stdin pipe
+    // as-is, so the bytes needn't pass through user space.
+    bool useSplice = !ioloop->usePty && !ioloop->mux;
     while (true) {
-        const ssize_t amt1 = readRestarting(socketFd, buf.data(), buf.size());
-        if (amt1 <= 0) {
-            break;
+        if (useSplice) {
+            const ssize_t amt1 = spliceRestarting(socketFd, outputFd, kInputSpliceSize, 0);
+            if (amt1 > 0) {
+                counters.countRead(amt1);
+                counters.countWrite();
+                continue;
+            } else if (amt1 < 0 && spliceUnsupported(errno)) {
+                useSplice = false;
+            } else {
+                break;
+            }
+        }
+        const char *data = nullptr;
+        ssize_t amt1 = 0;
+        BufferPool::Chunk chunk;
+        if (ioloop->mux) {
+            // Multiplexed input is written straight from the queue's blocks.
+            if (!ioloop->inputQueue.popChunk(chunk)) {
+                break;
+            }
+            data = chunk.data();
+            amt1 = chunk.size();
+        } else {
+            if (buf.empty()) {
+                buf.resize(ioloop->bufferParams.input);
+            }
+            amt1 = readRestarting(socketFd, buf.data(), buf.size());
+            if (amt1 <= 0) {
+                break;
+            }
+            data = buf.data();
         }
-        if (!writeAllRestarting(outputFd, buf.data(), amt1)) {
+        counters.countRead(amt1);
+        if (!writeAllRestarting(outputFd, data, amt1)) {
             break;
         }
+        counters.countWrite();
+        if (ioloop->mux) {
+            // The frontend's input is flow-controlled only when multiplexed;
+            // otherwise, the socket's own buffering applies backpressure.
+            unacked += amt1;
+            if (unacked >= ioloop->windowParams.size / 2) {
+                Packet p = { sizeof(Packet), Packet::Type::IncreaseWindow };
+                p.u.window.amount = unacked;
+                p.u.window.channel = Channel::Input;
+                writePacket(*ioloop, p);
+                unacked = 0;
+            }
+        }
     }
     // If we're using pipes and the frontend hits EOF on stdin, then we must
     // close our write-end stdin child pipe to propagate EOF.  ssh doesn't seem
@@ -300,49 +965,137 @@ static void socketToChildThread(IoLoop *ioloop, int socketFd, int outputFd) {
     if (!ioloop->usePty) {
         revokeFd(outputFd);
     }
-    revokeFd(socketFd);
+    if (ioloop->mux) {
+        ioloop->inputQueue.discard();
+    } else {
+        revokeFd(socketFd);
+    }
 }
 
-static void childToSocketThread(IoLoop *ioloop, bool isErrorPipe, int inputFd, int socketFd) {
-    ChannelWindow &window = isErrorPipe ? ioloop->errorWindow : ioloop->outputWindow;
-    const auto windowThreshold = ioloop->windowParams.threshold;
-    const auto windowSize = ioloop->windowParams.size;
-    std::array<char, 32 * 1024> buf;
-    int32_t locWindow = windowSize;
-    const auto hasWindow = [&](bool readAtomic = true) -> bool {
-        if (readAtomic) {
-            const int32_t iw = window.increaseAmt.exchange(0);
-            assert(iw <= windowSize - locWindow);
-            locWindow += iw;
-        }
-        return locWindow >= windowThreshold;
-    };
+// Blocks until fd has data or EOF, or a signal (see revokeFd) interrupts the
+// wait.  The read that follows reports any error.
+static void waitReadable(int fd) {
+    pollfd pfd = { fd, POLLIN, 0 };
+    poll(&pfd, 1, -1);
+}
+
+static void childToSocketThread(IoLoop *ioloop, Channel channel, int inputFd, int socketFd) {
+    ChannelWindow &window =
+        channel == Channel::Error ? ioloop->errorWindow : ioloop->outputWindow;
+    ChannelCounters &counters = channelCounters(*ioloop, channel);
+    // Leave room to frame the data in place for the multiplexed connection,
+    // and for a chunk header when compressing.
+    ChunkCompressor compressor;
+    const size_t chunkHeaderSize = ioloop->compress ? sizeof(ChunkHeader) : 0;
+    const size_t dataSize = outputReadSize(*ioloop);
+    // The buffer is allocated once there is something to copy, so a channel
+    // that stays quiet (usually stderr) or is spliced costs no memory.
+    std::vector<char> buf;
+    char *chunk = nullptr;
+    char *data = nullptr;
+    // The frontend may grow the window past its initial size (up to
+    // windowParams.max) by granting more credit than we have consumed.
+    int32_t locWindow = ioloop->windowParams.size;
+    // A child pipe can be spliced straight into its socket, at most one
+    // window at a time, unless the data must be framed or compressed.
+    bool useSplice = !ioloop->usePty && !ioloop->mux && !ioloop->compress;
     while (true) {
-        assert(locWindow >= 0 && locWindow <= windowSize);
-        if (!hasWindow(false) && !hasWindow()) {
-            std::unique_lock<std::mutex> lock(window.mutex);
-            window.increaseCV.wait(lock, hasWindow);
+        window.wait(locWindow, ioloop->windowParams, &counters);
+        if (useSplice) {
+            const ssize_t amt1 = spliceRestarting(inputFd, socketFd, locWindow, 0);
+            if (amt1 > 0) {
+                counters.countRead(amt1);
+                counters.countWrite();
+                locWindow -= amt1;
+                continue;
+            } else if (amt1 < 0 && spliceUnsupported(errno)) {
+                useSplice = false;
+            } else {
+                break;
+            }
+        }
+        if (buf.empty()) {
+            waitReadable(inputFd);
+            buf.resize(sizeof(FrameHeader) + chunkHeaderSize + dataSize);
+            chunk = buf.data() + sizeof(FrameHeader);
+            data = chunk + chunkHeaderSize;
         }
         const ssize_t amt1 =
-            readRestarting(inputFd, buf.data(),
-                std::min<size_t>(buf.size(), locWindow));
+            readRestarting(inputFd, data,
+                std::min<size_t>(dataSize, locWindow));
         if (amt1 <= 0) {
             break;
         }
-        if (!writeAllRestarting(socketFd, buf.data(), amt1)) {
+        counters.countRead(amt1);
+        Packet keys;
+        if (signalKeysChanged(*ioloop, keys)) {
+            // Ahead of the output, which is often the screen of a program
+            // that just changed the terminal's modes.
+            writePacket(*ioloop, keys);
+        }
+        const size_t sendSize =
+            ioloop->compress ? compressor.encode(chunk, amt1) : amt1;
+        const bool success =
+            ioloop->mux ? ioloop->mux->writeFrame(channel, buf.data(), sendSize)
+                        : writeAllRestarting(socketFd, chunk, sendSize);
+        if (!success) {
             break;
         }
+        counters.countWrite();
         locWindow -= amt1;
     }
     // The pty has closed.  Shutdown I/O on the data socket to signal
     // I/O completion to the frontend.
-    revokeFd(socketFd);
+    if (ioloop->mux) {
+        ioloop->mux->writeEof(channel);
+    } else {
+        revokeFd(socketFd);
+    }
+}
+
+static void discardPacket(IoLoop*, const Packet&) {
+    // Do nothing.
 }
 
-static void discardPacket(void*, const Packet&) {
+static void discardData(IoLoop*, Channel, const char*, size_t) {
     // Do nothing.
 }
 
+static void sendStartupTrace(IoLoop &ioloop, const StartupTrace &trace) {
+    if (!(g_capabilities & kCapStartupTrace)) {
+        return;
+    }
+    PacketStartupTrace p = {};
+    p.type = Packet::Type::StartupTrace;
+    const auto events = trace.events();
+    p.count = std::min<size_t>(events.size(), kMaxTraceEvents);
+    std::copy(events.begin(), events.begin() + p.count, p.events);
+    p.size = trimmedPacketSize(p, p.events, p.count);
+    writePacket(ioloop, p);
+}
+
+// Acts on a Signal packet as the pty's line discipline would have acted on
+// the character.  Returns the character if it should be passed on as input
+// instead, or '\0' if the signal was sent.
+static char deliverTermSignal(int masterFd, TermSignal which) {
+    const auto index = static_cast<uint32_t>(which);
+    if (index >= kTermSignalCount || masterFd == -1) {
+        fatal("internal error: unexpected signal key %d\n", static_cast<int>(which));
+    }
+    const char ch = kTermSignalChars[index];
+    termios attr = {};
+    if (tcgetattr(masterFd, &attr) == 0 && signalKeyActive(attr, index)) {
+        const pid_t pgrp = tcgetpgrp(masterFd);
+        if (pgrp > 0 && kill(-pgrp, kTermSignalKeys[index].signo) == 0) {
+            if (!(attr.c_lflag & NOFLSH)) {
+                tcflush(masterFd, TCIFLUSH);
+            }
+            return '\0';
+        }
+    }
+    return ch;
+}
+
 static void handlePacket(IoLoop *ioloop, const Packet &p) {
     switch (p.type) {
         case Packet::Type::SetSize: {
@@ -355,20 +1108,15 @@ static void handlePacket(IoLoop *ioloop, const Packet &p) {
             break;
         }
         case Packet::Type::IncreaseWindow: {
+            if (p.u.window.channel != Channel::Output &&
+                    p.u.window.channel != Channel::Error) {
+                fatal("internal error: unexpected window channel %d\n",
+                    static_cast<int>(p.u.window.channel));
+            }
             ChannelWindow &window =
-                p.u.window.isErrorPipe ?
+                p.u.window.channel == Channel::Error ?
                     ioloop->errorWindow : ioloop->outputWindow;
-            {
-                // Read ioloop->window into cw once to ensure a stable value.
-                const int32_t max = ioloop->windowParams.size;
-                const int32_t cw = window.increaseAmt;
-                const int32_t iw = p.u.window.amount;
-                assert(cw >= 0 && cw <= max &&
-                       iw >= 0 && iw <= max - cw);
-                std::lock_guard<std::mutex> lock(window.mutex);
-                window.increaseAmt += iw;
-            }
-            window.increaseCV.notify_one();
+            window.increase(p.u.window.amount, ioloop->windowParams.max);
             break;
         }
         case Packet::Type::CloseStdoutPipe: {
@@ -378,10 +1126,41 @@ static void handlePacket(IoLoop *ioloop, const Packet &p) {
             // of the child stdout pipe and kill any in-progress syscall.
             assert(!ioloop->usePty);
             revokeFd(ioloop->stdoutAutoClose.pipeFd);
-            revokeFd(ioloop->stdoutAutoClose.socketFd);
+            if (!ioloop->mux) {
+                revokeFd(ioloop->stdoutAutoClose.socketFd);
+            }
             pthread_kill(ioloop->stdoutAutoClose.thread, SIGUSR1);
             break;
         }
+        case Packet::Type::RequestStats: {
+            writePacket(*ioloop, statsPacket(*ioloop));
+            break;
+        }
+        case Packet::Type::Ping: {
+            Packet pong = p;
+            pong.type = Packet::Type::Pong;
+            writePacket(*ioloop, pong);
+            break;
+        }
+        case Packet::Type::Signal: {
+            // Only a multiplexed connection keeps the key in order with the
+            // input around it.
+            if (!ioloop->mux) {
+                fatal("internal error: unexpected packet %d\n",
+                    static_cast<int>(p.type));
+            }
+            const char ch = deliverTermSignal(ioloop->childFd, p.u.termSignal);
+            if (ch != '\0') {
+                ioloop->inputQueue.push(&ch, 1);
+            } else {
+                // The frontend charged the character to its input window.
+                Packet ack = { sizeof(Packet), Packet::Type::IncreaseWindow };
+                ack.u.window.amount = 1;
+                ack.u.window.channel = Channel::Input;
+                writePacket(*ioloop, ack);
+            }
+            break;
+        }
         default: {
             fatal("internal error: unexpected packet %d\n",
                 static_cast<int>(p.type));
@@ -389,84 +1168,1170 @@ static void handlePacket(IoLoop *ioloop, const Packet &p) {
     }
 }
 
-static void mainLoop(bool usePty, int controlSocketFd,
-                     int inputSocketFd, int outputSocketFd, int errorSocketFd,
-                     const char *exe, Child child, WindowParams windowParams) {
-    if (child.spawnError.type == SpawnError::Type::Success) {
-        IoLoop ioloop;
-        ioloop.usePty = usePty;
-        ioloop.controlSocketFd = controlSocketFd;
-        ioloop.childFd = child.masterFd;
-        ioloop.windowParams = windowParams;
-
-        std::thread s2c(socketToChildThread, &ioloop, inputSocketFd, child.inputFd);
-        std::thread c2s(childToSocketThread, &ioloop, false,
-                        child.outputFd, outputSocketFd);
-        std::unique_ptr<std::thread> ec2s;
-        if (errorSocketFd != -1) {
-            ec2s = std::unique_ptr<std::thread>(
-                new std::thread(childToSocketThread, &ioloop, true,
-                                child.errorFd, errorSocketFd));
-        }
-
-        // handlePacket needs stdoutThread so it can propagate stdout closing
-        // from the frontend to the child's stdout pipe.
-        ioloop.stdoutAutoClose.thread = c2s.native_handle();
-        ioloop.stdoutAutoClose.pipeFd = child.outputFd;
-        ioloop.stdoutAutoClose.socketFd = outputSocketFd;
-
-        std::thread rcs(
-            readControlSocketThread<IoLoop, handlePacket, connectionBrokenAbort>,
-            controlSocketFd, &ioloop);
+static void handleData(IoLoop *ioloop, Channel channel, const char *data, size_t size) {
+    if (channel != Channel::Input) {
+        fatal("internal error: unexpected data on channel %d\n",
+            static_cast<int>(channel));
+    }
+    if (size == 0) {
+        ioloop->inputQueue.close();
+    } else {
+        ioloop->inputQueue.push(data, size);
+    }
+}
 
-        // Block until the child process finishes, then notify the frontend of
-        // child exit.
-        int exitStatus = 0;
-        if (waitpid(child.pid, &exitStatus, 0) != child.pid) {
-            fatalPerror("waitpid failed");
+static void readControl(IoLoop &ioloop, bool discard) {
+    if (ioloop.mux) {
+        if (discard) {
+            readMuxSocketThread<IoLoop, discardPacket, discardData, connectionBrokenAbort>(
+                ioloop.controlSocketFd, &ioloop);
+        } else {
+            readMuxSocketThread<IoLoop, handlePacket, handleData, connectionBrokenAbort>(
+                ioloop.controlSocketFd, &ioloop);
         }
-        if (WIFEXITED(exitStatus)) {
-            exitStatus = WEXITSTATUS(exitStatus);
+    } else {
+        if (discard) {
+            readControlSocketThread<IoLoop, discardPacket, connectionBrokenAbort>(
+                ioloop.controlSocketFd, &ioloop);
         } else {
-            // XXX: I'm just making something up here.  I've got
-            // no idea whether this makes sense.
-            exitStatus = 1;
+            readControlSocketThread<IoLoop, handlePacket, connectionBrokenAbort>(
+                ioloop.controlSocketFd, &ioloop);
         }
-        Packet p = { sizeof(Packet), Packet::Type::ChildExitStatus };
-        p.u.exitStatus = exitStatus;
-        writePacket(controlSocketFd, p);
+    }
+}
 
-        // If we're using pipes, then close the write-end of the child stdin
-        // pipe and the read-end of the stderr pipe.  This seems to be what ssh
-        // does.
-        if (!ioloop.usePty) {
-            revokeFd(child.inputFd);
-            pthread_kill(s2c.native_handle(), SIGUSR1);
-            revokeFd(child.errorFd);
-            pthread_kill(ec2s->native_handle(), SIGUSR1);
-        }
+static WakeupFd *g_childExitWakeup = nullptr;
 
-        // Ensure that the parent thread outlives its child threads.  The program
-        // should exit before all the worker threads finish.  Join rcs first, so
-        // that ioloop.stdoutThread remains valid if handlePacket is called.
-        //
-        // The rcs thread doesn't end gracefully -- when the control socket
-        // reaches EOF, the backend process terminates.
+const size_t kReactorMaxBacklog = 256 * 1024;
+
+// The --epoll I/O loop.  Instead of a thread per stream, every fd is
+// non-blocking and serviced from the main thread.  Flow control becomes a
+// polling decision: a child output fd is only polled while its window has
+// credit and its socket has no large backlog.  Child exit arrives as SIGCHLD,
+// so nothing needs to be interrupted with SIGUSR1.
+class Reactor {
+public:
+    Reactor(IoLoop &ioloop, const Child &child,
+            int inputSocketFd, int outputSocketFd, int errorSocketFd);
+    void run() __attribute__((noreturn));
+
+private:
+    // Bytes queued for a non-blocking socket.
+    struct Outgoing {
+        int fd = -1;
+        ByteRing buf;
+        bool closeWhenFlushed = false;
+        ChannelCounters *counters = nullptr;    // Unless it's shared.
+        size_t pending() const { return buf.size(); }
+    };
+
+    struct OutputStream {
+        Channel channel;
+        int fd = -1;            // The child's read end.
+        bool done = false;      // No longer polled.
+        bool useSplice = false;
+        Outgoing *out = nullptr;
+        int32_t locWindow = 0;
+        ChannelCounters *counters = nullptr;
+        ChunkCompressor compressor;
+        // Set while the window is below the threshold, for the stall time.
+        bool stalled = false;
+        std::chrono::steady_clock::time_point stallStart;
+    };
+
+    struct InputStream {
+        int fd = -1;            // The child's write end, or -1 once closed.
+        int socketFd = -1;      // The input socket, unless multiplexed.
+        ByteRing buf;
+        bool eof = false;       // The frontend has sent EOF.
+        bool discarding = false;
+        bool useSplice = false;
+        int32_t unacked = 0;
+        size_t pending() const { return buf.size(); }
+    };
+
+    void appendFrame(Outgoing &out, Channel channel, const void *data, size_t size);
+    void sendPacket(const Packet &p);
+    bool flush(Outgoing &out);
+    void flushControl();
+    void flushOutput(OutputStream &stream);
+    bool readChildOutput(OutputStream &stream);
+    void consumeWindow(OutputStream &stream, int32_t amount);
+    void finishOutput(OutputStream &stream);
+    void readConnection();
+    void handlePacket(const Packet &p);
+    void handleData(Channel channel, const char *data, size_t size);
+    void readInputSocket();
+    void queueInput(const char *data, size_t size);
+    void ackInput(int32_t amount);
+    void writeChildInput();
+    void stopChildInput();
+    void reapChild();
+    void closeFd(int &fd);
+    void want(int fd, uint32_t events);
+    void updateInterest();
+
+    IoLoop &ioloop_;
+    const pid_t childPid_;
+    bool childReaped_ = false;
+    int epollFd_ = -1;
+    WakeupFd childExitWakeup_;
+    Outgoing controlOut_;
+    Outgoing outputOut_;
+    Outgoing errorOut_;
+    OutputStream output_;
+    OutputStream error_;
+    InputStream input_;
+    std::vector<char> inBuf_;
+    size_t inPos_ = 0;
+    std::vector<char> discardBuf_;
+    std::vector<char> chunkBuf_;
+    // Registered epoll interest, and the interest wanted for the next wait.
+    std::vector<std::pair<int, uint32_t>> registered_;
+    std::vector<std::pair<int, uint32_t>> wanted_;
+};
+
+static void setNonBlocking(int fd) {
+    const int flags = fcntl(fd, F_GETFL);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        fatalPerror("error: could not make fd non-blocking");
+    }
+}
+
+Reactor::Reactor(IoLoop &ioloop, const Child &child,
+                 int inputSocketFd, int outputSocketFd, int errorSocketFd) :
+        ioloop_(ioloop), childPid_(child.pid) {
+    epollFd_ = epoll_create1(EPOLL_CLOEXEC);
+    if (epollFd_ < 0) {
+        fatalPerror("error: epoll_create1 failed");
+    }
+
+    controlOut_.fd = ioloop.controlSocketFd;
+    outputOut_.fd = outputSocketFd;
+    errorOut_.fd = errorSocketFd;
+    input_.fd = child.inputFd;
+    input_.socketFd = inputSocketFd;
+    outputOut_.counters = output_.counters = &channelCounters(ioloop, Channel::Output);
+    errorOut_.counters = error_.counters = &channelCounters(ioloop, Channel::Error);
+    output_.channel = Channel::Output;
+    output_.fd = child.outputFd;
+    output_.out = ioloop.mux ? &controlOut_ : &outputOut_;
+    output_.locWindow = ioloop.windowParams.size;
+    error_.channel = Channel::Error;
+    error_.fd = child.errorFd;
+    error_.done = child.errorFd == -1;
+    error_.out = ioloop.mux ? &controlOut_ : &errorOut_;
+    error_.locWindow = ioloop.windowParams.size;
+    // Pipe-mode data needs no framing, so it can be spliced whenever nothing
+    // is queued ahead of it.
+    output_.useSplice = error_.useSplice = input_.useSplice =
+        !ioloop.usePty && !ioloop.mux;
+    if (ioloop.compress) {
+        output_.useSplice = error_.useSplice = false;
+    }
+
+    for (int fd : { controlOut_.fd, outputOut_.fd, errorOut_.fd,
+                    input_.fd, input_.socketFd, output_.fd, error_.fd }) {
+        if (fd != -1) {
+            setNonBlocking(fd);
+        }
+    }
+
+    g_childExitWakeup = &childExitWakeup_;
+    struct sigaction sa = {};
+    sa.sa_handler = [](int signo) { g_childExitWakeup->set(kWakeupChildExit); };
+    sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+    sigaction(SIGCHLD, &sa, nullptr);
+}
+
+void Reactor::appendFrame(Outgoing &out, Channel channel, const void *data, size_t size) {
+    if (ioloop_.mux) {
+        const FrameHeader header = { static_cast<uint32_t>(size), channel };
+        out.buf.append(&header, sizeof(header));
+    }
+    out.buf.append(data, size);
+}
+
+void Reactor::sendPacket(const Packet &p) {
+    assert(p.size >= sizeof(p));
+    appendFrame(controlOut_, Channel::Control, &p, p.size);
+    flushControl();
+}
+
+// Returns false if the socket failed.
+bool Reactor::flush(Outgoing &out) {
+    while (out.pending() > 0) {
+        const ssize_t amt = out.buf.writeTo(out.fd);
+        if (amt < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        } else if (amt <= 0) {
+            return false;
+        }
+        if (out.counters != nullptr) {
+            out.counters->countWrite();
+        }
+    }
+    if (out.pending() == 0 && out.closeWhenFlushed) {
+        closeFd(out.fd);
+    }
+    return true;
+}
+
+void Reactor::flushControl() {
+    if (!flush(controlOut_)) {
+        connectionBrokenAbort();
+    }
+}
+
+void Reactor::flushOutput(OutputStream &stream) {
+    if (ioloop_.mux) {
+        flushControl();
+    } else if (stream.out->fd != -1 && !flush(*stream.out)) {
+        // As with the thread-per-stream loop, a failed data socket stops the
+        // stream without closing the child's pipe.
+        stream.done = true;
+        stream.out->buf.clear();
+        closeFd(stream.out->fd);
+    }
+}
+
+// Returns true if it read any data.
+bool Reactor::readChildOutput(OutputStream &stream) {
+    Outgoing &out = *stream.out;
+    if (stream.useSplice && out.pending() == 0 && out.fd != -1) {
+        const ssize_t amt = spliceRestarting(stream.fd, out.fd,
+            std::min<size_t>(ioloop_.bufferParams.output, stream.locWindow),
+            SPLICE_F_NONBLOCK);
+        if (amt > 0) {
+            stream.counters->countRead(amt);
+            stream.counters->countWrite();
+            consumeWindow(stream, amt);
+            return true;
+        } else if (amt == 0) {
+            finishOutput(stream);
+            return false;
+        } else if (spliceUnsupported(errno)) {
+            stream.useSplice = false;
+        }
+        // Otherwise (e.g. EAGAIN from a full socket), copy into the queue.
+    }
+    const size_t frameHeaderSize = ioloop_.mux ? sizeof(FrameHeader) : 0;
+    const size_t readSize = std::min<size_t>(outputReadSize(ioloop_), stream.locWindow);
+    const size_t base = out.buf.size();
+    ssize_t amt = 0;
+    size_t payloadSize = 0;
+    if (ioloop_.compress) {
+        // The compressor needs contiguous data, so chunks are built on the
+        // side and then queued.
+        chunkBuf_.resize(sizeof(ChunkHeader) + readSize);
+        amt = readRestarting(stream.fd, &chunkBuf_[sizeof(ChunkHeader)], readSize);
+        if (amt > 0) {
+            payloadSize = stream.compressor.encode(chunkBuf_.data(), amt);
+            appendFrame(out, stream.channel, chunkBuf_.data(), payloadSize);
+        }
+    } else {
+        // Read straight into the socket's queue, behind room for the frame
+        // header.
+        const FrameHeader placeholder = {};
+        out.buf.append(&placeholder, frameHeaderSize);
+        amt = out.buf.readFrom(stream.fd, readSize);
+        payloadSize = amt;
+        if (amt > 0 && ioloop_.mux) {
+            const FrameHeader header = { static_cast<uint32_t>(payloadSize), stream.channel };
+            out.buf.overwrite(base, &header, sizeof(header));
+        } else if (amt <= 0) {
+            out.buf.truncate(base);
+        }
+    }
+    if (amt < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return false;
+    } else if (amt <= 0) {
+        finishOutput(stream);
+        return false;
+    }
+    stream.counters->countRead(amt);
+    Packet keys;
+    if (signalKeysChanged(ioloop_, keys)) {
+        sendPacket(keys);
+    }
+    consumeWindow(stream, amt);
+    flushOutput(stream);
+    return true;
+}
+
+void Reactor::consumeWindow(OutputStream &stream, int32_t amount) {
+    stream.locWindow -= amount;
+    if (stream.locWindow < ioloop_.windowParams.threshold && !stream.stalled) {
+        stream.stalled = true;
+        stream.stallStart = std::chrono::steady_clock::now();
+    }
+}
+
+// The child's output has closed.  Signal I/O completion to the frontend.
+void Reactor::finishOutput(OutputStream &stream) {
+    if (stream.done) {
+        return;
+    }
+    stream.done = true;
+    if (!ioloop_.usePty) {
+        closeFd(stream.fd);
+    }
+    if (ioloop_.mux) {
+        appendFrame(controlOut_, stream.channel, nullptr, 0);
+        flushControl();
+    } else if (stream.out->fd != -1) {
+        stream.out->closeWhenFlushed = true;
+        flushOutput(stream);
+    }
+}
+
+void Reactor::readConnection() {
+    const size_t kReadSize = 64 * 1024;
+    const size_t base = inBuf_.size();
+    inBuf_.resize(base + kReadSize);
+    const ssize_t amt = readRestarting(controlOut_.fd, &inBuf_[base], kReadSize);
+    if (amt < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        inBuf_.resize(base);
+        return;
+    } else if (amt <= 0) {
+        connectionBrokenAbort();
+    }
+    inBuf_.resize(base + amt);
+
+    AnyPacket packet = {};
+    while (true) {
+        const size_t avail = inBuf_.size() - inPos_;
+        const char *const msg = inBuf_.data() + inPos_;
+        if (ioloop_.mux) {
+            FrameHeader header = {};
+            if (avail < sizeof(header)) {
+                break;
+            }
+            memcpy(&header, msg, sizeof(header));
+            if (header.size > kMaxFramePayload) {
+                connectionBrokenAbort();
+            }
+            if (avail < sizeof(header) + header.size) {
+                break;
+            }
+            const char *const payload = msg + sizeof(header);
+            if (header.channel == Channel::Control) {
+                if (!copyPacket(packet, payload, header.size)) {
+                    connectionBrokenAbort();
+                }
+                handlePacket(packet.base);
+            } else {
+                handleData(header.channel, payload, header.size);
+            }
+            inPos_ += sizeof(header) + header.size;
+        } else {
+            if (avail < sizeof(Packet)) {
+                break;
+            }
+            memcpy(&packet.base, msg, sizeof(Packet));
+            if (packet.base.size < sizeof(Packet) ||
+                    packet.base.size > sizeof(packet)) {
+                connectionBrokenAbort();
+            }
+            if (avail < packet.base.size) {
+                break;
+            }
+            copyPacket(packet, msg, packet.base.size);
+            handlePacket(packet.base);
+            inPos_ += packet.base.size;
+        }
+    }
+    inBuf_.erase(inBuf_.begin(), inBuf_.begin() + inPos_);
+    inPos_ = 0;
+}
+
+void Reactor::handlePacket(const Packet &p) {
+    switch (p.type) {
+        case Packet::Type::IncreaseWindow: {
+            if (p.u.window.channel != Channel::Output &&
+                    p.u.window.channel != Channel::Error) {
+                fatal("internal error: unexpected window channel %d\n",
+                    static_cast<int>(p.u.window.channel));
+            }
+            OutputStream &stream =
+                p.u.window.channel == Channel::Error ? error_ : output_;
+            const int32_t iw = p.u.window.amount;
+            assert(iw >= 0 && iw <= ioloop_.windowParams.max - stream.locWindow);
+            stream.locWindow += iw;
+            if (stream.stalled && stream.locWindow >= ioloop_.windowParams.threshold) {
+                stream.stalled = false;
+                stream.counters->addStall(
+                    std::chrono::duration_cast<std::chrono::microseconds>(
+                        std::chrono::steady_clock::now() - stream.stallStart).count());
+            }
+            break;
+        }
+        case Packet::Type::RequestStats: {
+            sendPacket(statsPacket(ioloop_));
+            break;
+        }
+        case Packet::Type::Ping: {
+            Packet pong = p;
+            pong.type = Packet::Type::Pong;
+            sendPacket(pong);
+            break;
+        }
+        case Packet::Type::CloseStdoutPipe: {
+            // Closing the read-end of the child's stdout pipe is enough here;
+            // there is no blocked thread to interrupt.
+            assert(!ioloop_.usePty);
+            finishOutput(output_);
+            break;
+        }
+        case Packet::Type::Signal: {
+            const char ch = deliverTermSignal(ioloop_.childFd, p.u.termSignal);
+            if (ch != '\0') {
+                queueInput(&ch, 1);
+            } else {
+                ackInput(1);
+            }
+            break;
+        }
+        default: {
+            // SetSize needs nothing from the loop.
+            ::handlePacket(&ioloop_, p);
+        }
+    }
+}
+
+void Reactor::handleData(Channel channel, const char *data, size_t size) {
+    if (channel != Channel::Input) {
+        fatal("internal error: unexpected data on channel %d\n",
+            static_cast<int>(channel));
+    }
+    if (size == 0) {
+        input_.eof = true;
+        writeChildInput();
+    } else {
+        channelCounters(ioloop_, Channel::Input).countRead(size);
+        queueInput(data, size);
+    }
+}
+
+void Reactor::readInputSocket() {
+    if (input_.useSplice && input_.pending() == 0 && input_.fd != -1 &&
+            !input_.discarding) {
+        const ssize_t amt = spliceRestarting(input_.socketFd, input_.fd,
+            kInputSpliceSize, SPLICE_F_NONBLOCK);
+        if (amt > 0) {
+            channelCounters(ioloop_, Channel::Input).countRead(amt);
+            channelCounters(ioloop_, Channel::Input).countWrite();
+            return;
+        } else if (amt == 0) {
+            input_.eof = true;
+            writeChildInput();
+            return;
+        } else if (spliceUnsupported(errno)) {
+            input_.useSplice = false;
+        }
+        // Otherwise (e.g. EAGAIN from a full pipe), queue the input.
+    }
+    // Read straight into the child's input queue, unless it's discarded.
+    ssize_t amt = 0;
+    if (input_.discarding) {
+        discardBuf_.resize(ioloop_.bufferParams.input);
+        amt = readRestarting(input_.socketFd, discardBuf_.data(), discardBuf_.size());
+    } else {
+        amt = input_.buf.readFrom(input_.socketFd, ioloop_.bufferParams.input);
+    }
+    if (amt < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return;
+    } else if (amt <= 0) {
+        input_.eof = true;
+        writeChildInput();
+        return;
+    }
+    channelCounters(ioloop_, Channel::Input).countRead(amt);
+    if (input_.discarding) {
+        ackInput(amt);
+    } else {
+        writeChildInput();
+    }
+}
+
+void Reactor::queueInput(const char *data, size_t size) {
+    if (input_.discarding) {
+        ackInput(size);
+        return;
+    }
+    input_.buf.append(data, size);
+    writeChildInput();
+}
+
+void Reactor::ackInput(int32_t amount) {
+    // The frontend's input is flow-controlled only when multiplexed.
+    if (!ioloop_.mux) {
+        return;
+    }
+    input_.unacked += amount;
+    if (input_.unacked >= ioloop_.windowParams.size / 2) {
+        Packet p = { sizeof(Packet), Packet::Type::IncreaseWindow };
+        p.u.window.amount = input_.unacked;
+        p.u.window.channel = Channel::Input;
+        sendPacket(p);
+        input_.unacked = 0;
+    }
+}
+
+void Reactor::writeChildInput() {
+    while (input_.pending() > 0) {
+        const ssize_t amt = input_.buf.writeTo(input_.fd);
+        if (amt < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
+        } else if (amt <= 0) {
+            stopChildInput();
+            return;
+        }
+        channelCounters(ioloop_, Channel::Input).countWrite();
+        ackInput(amt);
+    }
+    if (input_.eof) {
+        // If we're using pipes and the frontend hits EOF on stdin, then close
+        // the child's stdin pipe to propagate EOF.
+        if (!ioloop_.usePty) {
+            closeFd(input_.fd);
+        }
+        closeFd(input_.socketFd);
+    }
+}
+
+// The child has exited or stopped reading input.  Keep consuming the
+// frontend's input, but throw it away, as the thread-per-stream loop does
+// when it revokes the child's stdin.
+void Reactor::stopChildInput() {
+    input_.discarding = true;
+    ackInput(input_.pending());
+    input_.buf.clear();
+    if (!ioloop_.usePty) {
+        closeFd(input_.fd);
+    }
+    input_.fd = -1;
+}
+
+void Reactor::reapChild() {
+    childExitWakeup_.drain();
+    if (childReaped_) {
+        return;
+    }
+    int exitStatus = 0;
+    const pid_t ret = waitpid(childPid_, &exitStatus, WNOHANG);
+    if (ret == 0) {
+        return;
+    } else if (ret != childPid_) {
+        fatalPerror("waitpid failed");
+    }
+    childReaped_ = true;
+    if (WIFEXITED(exitStatus)) {
+        exitStatus = WEXITSTATUS(exitStatus);
+    } else {
+        exitStatus = 1;
+    }
+    Packet p = { sizeof(Packet), Packet::Type::ChildExitStatus };
+    p.u.exitStatus = exitStatus;
+    sendPacket(p);
+
+    // If we're using pipes, then close the write-end of the child stdin pipe
+    // and the read-end of the stderr pipe.  This seems to be what ssh does.
+    // Unlike the threaded loop, forward the stderr output that is already
+    // buffered (as far as the window allows) before closing it.
+    if (!ioloop_.usePty) {
+        stopChildInput();
+        while (!error_.done &&
+                error_.locWindow >= ioloop_.windowParams.threshold &&
+                error_.out->pending() < kReactorMaxBacklog &&
+                readChildOutput(error_)) {}
+        finishOutput(error_);
+    }
+}
+
+void Reactor::closeFd(int &fd) {
+    if (fd == -1) {
+        return;
+    }
+    // In pty mode, the master fd is shared by the input and output streams.
+    if (ioloop_.usePty && fd == ioloop_.childFd) {
+        fd = -1;
+        return;
+    }
+    for (size_t i = 0; i < registered_.size(); ++i) {
+        if (registered_[i].first == fd) {
+            epoll_ctl(epollFd_, EPOLL_CTL_DEL, fd, nullptr);
+            registered_.erase(registered_.begin() + i);
+            break;
+        }
+    }
+    close(fd);
+    fd = -1;
+}
+
+void Reactor::want(int fd, uint32_t events) {
+    for (auto &entry : wanted_) {
+        if (entry.first == fd) {
+            entry.second |= events;
+            return;
+        }
+    }
+    wanted_.push_back(std::make_pair(fd, events));
+}
+
+// Reconcile the epoll set with the fds we want to poll.  An fd whose
+// interest drops to nothing is removed rather than modified, because epoll
+// reports EPOLLHUP regardless of the requested events.
+void Reactor::updateInterest() {
+    wanted_.clear();
+    want(childExitWakeup_.readFd(), EPOLLIN);
+    want(controlOut_.fd, EPOLLIN);
+    for (Outgoing *out : { &controlOut_, &outputOut_, &errorOut_ }) {
+        if (out->fd != -1 && out->pending() > 0) {
+            want(out->fd, EPOLLOUT);
+        }
+    }
+    for (OutputStream *stream : { &output_, &error_ }) {
+        if (!stream->done && stream->fd != -1 &&
+                stream->locWindow >= ioloop_.windowParams.threshold &&
+                stream->out->pending() < kReactorMaxBacklog) {
+            want(stream->fd, EPOLLIN);
+        }
+    }
+    if (input_.fd != -1 && input_.pending() > 0) {
+        want(input_.fd, EPOLLOUT);
+    }
+    if (input_.socketFd != -1 && !input_.eof && input_.pending() == 0) {
+        want(input_.socketFd, EPOLLIN);
+    }
+
+    for (size_t i = 0; i < registered_.size(); ) {
+        const auto it = std::find_if(wanted_.begin(), wanted_.end(),
+            [&](const std::pair<int, uint32_t> &w) {
+                return w.first == registered_[i].first;
+            });
+        if (it == wanted_.end()) {
+            epoll_ctl(epollFd_, EPOLL_CTL_DEL, registered_[i].first, nullptr);
+            registered_.erase(registered_.begin() + i);
+        } else {
+            ++i;
+        }
+    }
+    for (const auto &w : wanted_) {
+        const auto it = std::find_if(registered_.begin(), registered_.end(),
+            [&](const std::pair<int, uint32_t> &r) { return r.first == w.first; });
+        if (it != registered_.end() && it->second == w.second) {
+            continue;
+        }
+        epoll_event ev = {};
+        ev.events = w.second;
+        ev.data.fd = w.first;
+        const int op = it == registered_.end() ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+        if (epoll_ctl(epollFd_, op, w.first, &ev) != 0) {
+            fatalPerror("error: epoll_ctl failed");
+        }
+        if (it == registered_.end()) {
+            registered_.push_back(w);
+        } else {
+            it->second = w.second;
+        }
+    }
+}
+
+void Reactor::run() {
+    // The child may have exited before the SIGCHLD handler was installed.
+    reapChild();
+    std::array<epoll_event, 16> events;
+    while (true) {
+        updateInterest();
+        const int count = epoll_wait(epollFd_, events.data(), events.size(), -1);
+        if (count < 0 && errno == EINTR) {
+            continue;
+        } else if (count < 0) {
+            fatalPerror("error: epoll_wait failed");
+        }
+        const auto ready = [&](int fd, uint32_t mask) -> bool {
+            if (fd == -1) {
+                return false;
+            }
+            for (int i = 0; i < count; ++i) {
+                if (events[i].data.fd == fd) {
+                    return (events[i].events & (mask | EPOLLHUP | EPOLLERR)) != 0;
+                }
+            }
+            return false;
+        };
+        if (ready(controlOut_.fd, EPOLLIN)) {
+            readConnection();
+        }
+        if (ready(input_.socketFd, EPOLLIN)) {
+            readInputSocket();
+        }
+        if (input_.pending() > 0 && ready(input_.fd, EPOLLOUT)) {
+            writeChildInput();
+        }
+        for (OutputStream *stream : { &output_, &error_ }) {
+            if (!stream->done && ready(stream->fd, EPOLLIN)) {
+                readChildOutput(*stream);
+            }
+        }
+        if (ready(controlOut_.fd, EPOLLOUT)) {
+            flushControl();
+        }
+        if (ready(outputOut_.fd, EPOLLOUT)) {
+            flushOutput(output_);
+        }
+        if (ready(errorOut_.fd, EPOLLOUT)) {
+            flushOutput(error_);
+        }
+        if (ready(childExitWakeup_.readFd(), EPOLLIN)) {
+            reapChild();
+        }
+    }
+}
+
+// Returns false if the backend's path is unknown.
+static bool backendPathPacket(PacketBackendPath &p) {
+    if (!(g_capabilities & kCapBackendPath)) {
+        return false;
+    }
+    p = {};
+    p.type = Packet::Type::BackendPath;
+    const ssize_t len = readlink("/proc/self/exe", p.path, sizeof(p.path) - 1);
+    p.size = trimmedPacketSize(p, p.path, std::max<ssize_t>(len, 0) + 1);
+    return len > 0;
+}
+
+// The --multi I/O loop.  The frontend opens any number of sessions on one
+// multiplexed connection, each starting with a SpawnRequest on its own
+// Control channel (see kSessionShift).  Every session runs a pipes-mode child
+// whose stdin is at EOF, and its stdout and stderr get their own windows.
+// Like the Reactor, everything is non-blocking and serviced from one thread,
+// so the backend's thread count doesn't grow with the number of sessions.
+class MultiHost {
+public:
+    MultiHost(int connectionFd, const ChildParams &baseParams,
+              WindowParams windowParams, BufferParams bufferParams);
+    void sendPacket(uint32_t session, const Packet &p);
+    void run() __attribute__((noreturn));
+
+private:
+    struct Stream {
+        int fd = -1;            // The child's read end, or -1 once finished.
+        int32_t locWindow = 0;
+    };
+
+    struct Session {
+        pid_t pid = -1;
+        Stream streams[2];      // Output and Error.
+    };
+
+    void appendFrame(Channel channel, const void *data, size_t size);
+    void flush();
+    void readConnection();
+    void handlePacket(uint32_t session, const Packet &p, const char *extra, size_t extraSize);
+    void spawnSession(uint32_t session, const char *args, size_t size, uint32_t count);
+    bool readChildOutput(uint32_t session, int index);
+    void finishOutput(uint32_t session, int index);
+    void reapChildren();
+
+    const int fd_;
+    const ChildParams baseParams_;
+    const WindowParams windowParams_;
+    const BufferParams bufferParams_;
+    std::map<uint32_t, Session> sessions_;
+    WakeupFd childExitWakeup_;
+    ByteRing outBuf_;
+    std::vector<char> inBuf_;
+    size_t inPos_ = 0;
+};
+
+static const Channel kMultiStreamChannels[2] = { Channel::Output, Channel::Error };
+
+MultiHost::MultiHost(int connectionFd, const ChildParams &baseParams,
+                     WindowParams windowParams, BufferParams bufferParams) :
+        fd_(connectionFd), baseParams_(baseParams),
+        windowParams_(windowParams), bufferParams_(bufferParams) {
+    setNonBlocking(fd_);
+    g_childExitWakeup = &childExitWakeup_;
+    struct sigaction sa = {};
+    sa.sa_handler = [](int signo) { g_childExitWakeup->set(kWakeupChildExit); };
+    sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+    sigaction(SIGCHLD, &sa, nullptr);
+}
+
+void MultiHost::appendFrame(Channel channel, const void *data, size_t size) {
+    const FrameHeader header = { static_cast<uint32_t>(size), channel };
+    outBuf_.append(&header, sizeof(header));
+    outBuf_.append(data, size);
+}
+
+void MultiHost::sendPacket(uint32_t session, const Packet &p) {
+    assert(p.size >= sizeof(p));
+    appendFrame(sessionChannel(session, Channel::Control), &p, p.size);
+    flush();
+}
+
+void MultiHost::flush() {
+    while (!outBuf_.empty()) {
+        const ssize_t amt = outBuf_.writeTo(fd_);
+        if (amt < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        } else if (amt <= 0) {
+            connectionBrokenAbort();
+        }
+    }
+}
+
+void MultiHost::readConnection() {
+    const size_t kReadSize = 64 * 1024;
+    const size_t base = inBuf_.size();
+    inBuf_.resize(base + kReadSize);
+    const ssize_t amt = readRestarting(fd_, &inBuf_[base], kReadSize);
+    if (amt < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        inBuf_.resize(base);
+        return;
+    } else if (amt <= 0) {
+        connectionBrokenAbort();
+    }
+    inBuf_.resize(base + amt);
+
+    while (true) {
+        const size_t avail = inBuf_.size() - inPos_;
+        const char *const msg = inBuf_.data() + inPos_;
+        FrameHeader header = {};
+        if (avail < sizeof(header)) {
+            break;
+        }
+        memcpy(&header, msg, sizeof(header));
+        if (header.size > kMaxFramePayload) {
+            connectionBrokenAbort();
+        }
+        if (avail < sizeof(header) + header.size) {
+            break;
+        }
+        // The frontend only sends packets.  Sessions have no stdin.
+        if (baseChannel(header.channel) != Channel::Control ||
+                header.size < sizeof(Packet)) {
+            connectionBrokenAbort();
+        }
+        Packet p = {};
+        memcpy(&p, msg + sizeof(header), sizeof(p));
+        if (p.size != header.size) {
+            connectionBrokenAbort();
+        }
+        handlePacket(channelSession(header.channel), p,
+                     msg + sizeof(header) + sizeof(p), header.size - sizeof(p));
+        inPos_ += sizeof(header) + header.size;
+    }
+    inBuf_.erase(inBuf_.begin(), inBuf_.begin() + inPos_);
+    inPos_ = 0;
+}
+
+void MultiHost::handlePacket(uint32_t session, const Packet &p,
+                             const char *extra, size_t extraSize) {
+    switch (p.type) {
+        case Packet::Type::SpawnRequest:
+            if (session == 0 || sessions_.count(session)) {
+                fatal("internal error: bad spawn request for session %u\n", session);
+            }
+            spawnSession(session, extra, extraSize, p.u.argCount);
+            break;
+        case Packet::Type::IncreaseWindow: {
+            const auto it = sessions_.find(session);
+            if (it == sessions_.end()) {
+                // The session finished while the packet was in flight.
+                break;
+            }
+            const int index = p.u.window.channel == Channel::Output ? 0 :
+                              p.u.window.channel == Channel::Error ? 1 : -1;
+            if (index == -1) {
+                fatal("internal error: unexpected window channel %d\n",
+                    static_cast<int>(p.u.window.channel));
+            }
+            it->second.streams[index].locWindow += p.u.window.amount;
+            break;
+        }
+        default:
+            fatal("internal error: unexpected packet %d in --multi mode\n",
+                static_cast<int>(p.type));
+    }
+}
+
+void MultiHost::spawnSession(uint32_t session, const char *args, size_t size, uint32_t count) {
+    // The arguments are NUL-terminated strings, as in a daemon's SpawnRequest.
+    std::vector<std::string> argStrings;
+    for (size_t pos = 0; pos < size; ) {
+        const char *const end = static_cast<const char*>(memchr(args + pos, '\0', size - pos));
+        if (end == nullptr) {
+            fatal("internal error: bad spawn request for session %u\n", session);
+        }
+        argStrings.push_back(std::string(args + pos, end));
+        pos = end - args + 1;
+    }
+    if (argStrings.empty() || argStrings.size() != count) {
+        fatal("internal error: bad spawn request for session %u\n", session);
+    }
+    ChildParams params = baseParams_;
+    params.argv.clear();
+    for (const auto &arg : argStrings) {
+        params.argv.push_back(const_cast<char*>(arg.c_str()));
+    }
+    params.argv.push_back(nullptr);
+    params.prog = argStrings[0];
+
+    const Child child = spawnChild(params, nullptr);
+    if (child.spawnError.type != SpawnError::Type::Success) {
+        PacketSpawnFailed p = {};
+        p.type = Packet::Type::SpawnFailed;
+        p.u.spawnError = child.spawnError;
+        snprintf(p.exe, sizeof(p.exe), "%s", params.prog.c_str());
+        p.size = trimmedPacketSize(p, p.exe, strlen(p.exe) + 1);
+        sendPacket(session, p);
+        return;
+    }
+    // The sessions' stdin is always at EOF.
+    close(child.inputFd);
+    Session &s = sessions_[session];
+    s.pid = child.pid;
+    s.streams[0].fd = child.outputFd;
+    s.streams[1].fd = child.errorFd;
+    for (Stream &stream : s.streams) {
+        setNonBlocking(stream.fd);
+        stream.locWindow = windowParams_.size;
+    }
+}
+
+// Returns true if it read any data.
+bool MultiHost::readChildOutput(uint32_t session, int index) {
+    Stream &stream = sessions_[session].streams[index];
+    const size_t readSize = std::min<size_t>(
+        std::min<size_t>(bufferParams_.output, kMaxFramePayload), stream.locWindow);
+    const size_t base = outBuf_.size();
+    FrameHeader header = {};
+    outBuf_.append(&header, sizeof(header));
+    const ssize_t amt = outBuf_.readFrom(stream.fd, readSize);
+    if (amt < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        outBuf_.truncate(base);
+        return false;
+    } else if (amt <= 0) {
+        outBuf_.truncate(base);
+        finishOutput(session, index);
+        return false;
+    }
+    header = { static_cast<uint32_t>(amt), sessionChannel(session, kMultiStreamChannels[index]) };
+    outBuf_.overwrite(base, &header, sizeof(header));
+    stream.locWindow -= amt;
+    flush();
+    return true;
+}
+
+// Sends EOF for the stream, and forgets the session once it's over.
+void MultiHost::finishOutput(uint32_t session, int index) {
+    const auto it = sessions_.find(session);
+    if (it == sessions_.end()) {
+        return;
+    }
+    Session &s = it->second;
+    Stream &stream = s.streams[index];
+    if (stream.fd != -1) {
+        close(stream.fd);
+        stream.fd = -1;
+        appendFrame(sessionChannel(session, kMultiStreamChannels[index]), nullptr, 0);
+        flush();
+    }
+    if (s.pid == -1 && s.streams[0].fd == -1 && s.streams[1].fd == -1) {
+        sessions_.erase(session);
+    }
+}
+
+void MultiHost::reapChildren() {
+    childExitWakeup_.drain();
+    while (true) {
+        int exitStatus = 0;
+        const pid_t pid = waitpid(-1, &exitStatus, WNOHANG);
+        if (pid == 0 || (pid < 0 && errno == ECHILD)) {
+            return;
+        } else if (pid < 0) {
+            fatalPerror("waitpid failed");
+        }
+        auto it = sessions_.begin();
+        while (it != sessions_.end() && it->second.pid != pid) {
+            ++it;
+        }
+        if (it == sessions_.end()) {
+            continue;
+        }
+        const uint32_t session = it->first;
+        it->second.pid = -1;
+        Packet p = { sizeof(Packet), Packet::Type::ChildExitStatus };
+        p.u.exitStatus = WIFEXITED(exitStatus) ? WEXITSTATUS(exitStatus) : 1;
+        sendPacket(session, p);
+
+        // As with a single pipes-mode child, stdout stays open until EOF, but
+        // stderr is closed once the buffered output (that fits the window) is
+        // forwarded.
+        // Reading to EOF can finish the session, so look it up each time.
+        const auto readable = [&]() -> bool {
+            const auto it = sessions_.find(session);
+            return it != sessions_.end() && it->second.streams[1].fd != -1 &&
+                it->second.streams[1].locWindow >= windowParams_.threshold &&
+                outBuf_.size() < kReactorMaxBacklog;
+        };
+        while (readable() && readChildOutput(session, 1)) {}
+        finishOutput(session, 1);
+    }
+}
+
+void MultiHost::run() {
+    std::vector<pollfd> fds;
+    std::vector<std::pair<uint32_t, int>> streams;
+    while (true) {
+        // Rebuild the poll set each time: a child's fd is only polled while
+        // its window has credit and the connection has no large backlog.
+        fds.clear();
+        streams.clear();
+        const bool backlogged = outBuf_.size() >= kReactorMaxBacklog;
+        fds.push_back({ fd_, static_cast<short>(
+            POLLIN | (outBuf_.empty() ? 0 : POLLOUT)), 0 });
+        fds.push_back({ childExitWakeup_.readFd(), POLLIN, 0 });
+        for (const auto &entry : sessions_) {
+            for (int i = 0; i < 2; ++i) {
+                const Stream &stream = entry.second.streams[i];
+                if (stream.fd != -1 && !backlogged &&
+                        stream.locWindow >= windowParams_.threshold) {
+                    fds.push_back({ stream.fd, POLLIN, 0 });
+                    streams.push_back({ entry.first, i });
+                }
+            }
+        }
+        if (poll(fds.data(), fds.size(), -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fatalPerror("error: poll failed");
+        }
+        if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+            readConnection();
+        }
+        if (fds[0].revents & POLLOUT) {
+            flush();
+        }
+        for (size_t i = 0; i < streams.size(); ++i) {
+            if ((fds[i + 2].revents & (POLLIN | POLLHUP | POLLERR)) &&
+                    sessions_.count(streams[i].first)) {
+                readChildOutput(streams[i].first, streams[i].second);
+            }
+        }
+        if (fds[1].revents & POLLIN) {
+            reapChildren();
+        }
+    }
+}
+
+static void mainLoop(bool usePty, bool useMux, bool useEpoll, int controlSocketFd,
+                     int inputSocketFd, int outputSocketFd, int errorSocketFd,
+                     const char *exe, Child child, WindowParams windowParams,
+                     BufferParams bufferParams, bool compress, bool reportPath,
+                     StartupTrace *trace) {
+    IoLoop ioloop;
+    ioloop.usePty = usePty;
+    ioloop.controlSocketFd = controlSocketFd;
+    ioloop.childFd = child.masterFd;
+    ioloop.windowParams = windowParams;
+    ioloop.bufferParams = bufferParams;
+    ioloop.compress = compress;
+    if (useMux) {
+        ioloop.mux = std::unique_ptr<MuxSocket>(new MuxSocket(controlSocketFd));
+    }
+    writePacket(ioloop, helloPacket());
+    PacketBackendPath pathPacket;
+    if (reportPath && backendPathPacket(pathPacket)) {
+        writePacket(ioloop, pathPacket);
+    }
+    Packet keys;
+    if (signalKeysChanged(ioloop, keys)) {
+        writePacket(ioloop, keys);
+    }
+
+    const int64_t ioStart = trace ? traceClockMicros() : 0;
+    if (child.spawnError.type == SpawnError::Type::Success && useEpoll) {
+        Reactor reactor(ioloop, child, inputSocketFd, outputSocketFd, errorSocketFd);
+        if (trace) {
+            trace->add("start reactor", ioStart, traceClockMicros());
+            sendStartupTrace(ioloop, *trace);
+        }
+        reactor.run();
+    } else if (child.spawnError.type == SpawnError::Type::Success) {
+        IoThread s2c(socketToChildThread, &ioloop, inputSocketFd, child.inputFd);
+        IoThread c2s(childToSocketThread, &ioloop, Channel::Output,
+                     child.outputFd, outputSocketFd);
+        std::unique_ptr<IoThread> ec2s;
+        if (!usePty) {
+            ec2s = std::unique_ptr<IoThread>(
+                new IoThread(childToSocketThread, &ioloop, Channel::Error,
+                             child.errorFd, errorSocketFd));
+        }
+
+        // handlePacket needs stdoutThread so it can propagate stdout closing
+        // from the frontend to the child's stdout pipe.
+        ioloop.stdoutAutoClose.thread = c2s.native_handle();
+        ioloop.stdoutAutoClose.pipeFd = child.outputFd;
+        ioloop.stdoutAutoClose.socketFd = outputSocketFd;
+
+        IoThread rcs(readControl, std::ref(ioloop), false);
+        if (trace) {
+            trace->add("start threads", ioStart, traceClockMicros());
+            sendStartupTrace(ioloop, *trace);
+        }
+
+        // Block until the child process finishes, then notify the frontend of
+        // child exit.
+        int exitStatus = 0;
+        if (waitpid(child.pid, &exitStatus, 0) != child.pid) {
+            fatalPerror("waitpid failed");
+        }
+        if (WIFEXITED(exitStatus)) {
+            exitStatus = WEXITSTATUS(exitStatus);
+        } else {
+            // XXX: I'm just making something up here.  I've got
+            // no idea whether this makes sense.
+            exitStatus = 1;
+        }
+        Packet p = { sizeof(Packet), Packet::Type::ChildExitStatus };
+        p.u.exitStatus = exitStatus;
+        writePacket(ioloop, p);
+
+        // If we're using pipes, then close the write-end of the child stdin
+        // pipe and the read-end of the stderr pipe.  This seems to be what ssh
+        // does.
+        if (!ioloop.usePty) {
+            revokeFd(child.inputFd);
+            pthread_kill(s2c.native_handle(), SIGUSR1);
+            revokeFd(child.errorFd);
+            pthread_kill(ec2s->native_handle(), SIGUSR1);
+        }
+
+        // Ensure that the parent thread outlives its child threads.  The program
+        // should exit before all the worker threads finish.  Join rcs first, so
+        // that ioloop.stdoutThread remains valid if handlePacket is called.
+        //
+        // The rcs thread doesn't end gracefully -- when the control socket
+        // reaches EOF, the backend process terminates.
         rcs.join();
         s2c.join();
         c2s.join();
         if (ec2s) { ec2s->join(); }
     } else {
         PacketSpawnFailed p = {};
-        p.size = sizeof(p);
         p.type = Packet::Type::SpawnFailed;
         p.u.spawnError = child.spawnError;
         snprintf(p.exe, sizeof(p.exe), "%s", exe);
-        writePacket(controlSocketFd, p);
+        p.size = trimmedPacketSize(p, p.exe, strlen(p.exe) + 1);
+        writePacket(ioloop, p);
 
         // Keep the backend alive until the control socket closes.
-        readControlSocketThread<void, discardPacket, connectionBrokenAbort>(
-            controlSocketFd, nullptr);
+        readControl(ioloop, true);
     }
 }
 
@@ -484,31 +2349,539 @@ void optionNotAllowed(const char *opt, const char *why, const T &val, const T &u
     }
 }
 
+// A frontend that sends VERSION/PROTOCOL/CAPS works with any backend that
+// speaks its protocol.  Older frontends send only VERSION, and expect none of
+// the protocol's packets, so they are always turned away.
 static void frontendVersionCheck(const char *frontendVersion) {
-    if (strcmp(frontendVersion, STRINGIFY(WSLBRIDGE_VERSION)) != 0) {
-        fatal("error: wslbridge frontend-backend version mismatch"
-              " (frontend is version '%s', backend is version '%s')\n",
-              frontendVersion, STRINGIFY(WSLBRIDGE_VERSION));
+    const char *const protocolStr = strchr(frontendVersion, '/');
+    if (protocolStr != nullptr) {
+        char *end = nullptr;
+        const unsigned long protocol = strtoul(protocolStr + 1, &end, 10);
+        if (*end == '/' && protocol >= kMinProtocolVersion &&
+                protocol <= kProtocolVersion) {
+            g_capabilities = kCapabilities & strtoul(end + 1, nullptr, 16);
+            return;
+        }
     }
+    fatal("error: wslbridge frontend-backend version mismatch"
+          " (frontend is version '%s', backend is version '%s', protocol %u)\n",
+          frontendVersion, STRINGIFY(WSLBRIDGE_VERSION), kProtocolVersion);
 }
 
-} // namespace
+static int runBackend(int argc, char *argv[], int sessionSocket);
 
-int main(int argc, char *argv[]) {
+// Runs one frontend's session in a process forked from the daemon.  The
+// SpawnRequest arguments are parsed exactly like a backend command line.
+static void runDaemonSession(int s, const std::string &key) __attribute__((noreturn));
+static void runDaemonSession(int s, const std::string &key) {
+    // Don't let a stray connection hold a process forever.
+    timeval timeout = { 10, 0 };
+    setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setSocketNoDelay(s);
 
-    // If the backend crashes, it prints a message to its stderr, which is a
-    // hidden console, and immediately exits.  We can show the console, but we
-    // need to keep the process around to see the error.  To do this, have a
-    // mode where the backend immediately forks itself, and the child does the
-    // real work.  The parent just sticks around for a while.
-    if (argc >= 2 && !strcmp(argv[1], "--debug-fork")) {
-        pid_t child = fork();
-        if (child != 0) {
-            sleep(3600);
-            return 0;
+    std::string checkBuf(key.size(), '\0');
+    if (!readAllRestarting(s, &checkBuf[0], checkBuf.size()) ||
+            !secureStrEqual(checkBuf, key)) {
+        _exit(1);
+    }
+    const Packet accepted = { sizeof(Packet), Packet::Type::KeyAccepted };
+    if (!writeAllRestarting(s, &accepted, sizeof(accepted))) {
+        _exit(1);
+    }
+
+    Packet request = {};
+    if (!readAllRestarting(s, &request, sizeof(request)) ||
+            request.type != Packet::Type::SpawnRequest ||
+            request.size <= sizeof(request) ||
+            request.size - sizeof(request) > kMaxSpawnRequestSize) {
+        _exit(1);
+    }
+    std::vector<char> args(request.size - sizeof(request));
+    if (!readAllRestarting(s, args.data(), args.size()) || args.back() != '\0') {
+        _exit(1);
+    }
+    timeout = {};
+    setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    static char argv0[] = "wslbridge-backend";
+    std::vector<char*> argv = { argv0 };
+    for (size_t i = 0; i < args.size(); i += strlen(&args[i]) + 1) {
+        argv.push_back(&args[i]);
+    }
+    if (argv.size() - 1 != request.u.argCount) {
+        _exit(1);
+    }
+    argv.push_back(nullptr);
+
+    // Restart getopt for the new command line.
+    optind = 0;
+    exit(runBackend(argv.size() - 1, argv.data(), s));
+}
+
+struct PoolParams {
+    int size = 0;
+    int idleSeconds = kDefaultPoolIdleSeconds;
+};
+
+// An idle session from the daemon's pool: it forks its child, then competes
+// with the others to accept the next frontend, and tells the daemon once
+// it has one so the pool is refilled.
+static void runWarmSession(int listener, int retireFd, int takenFd,
+                           const std::string &key) __attribute__((noreturn));
+static void runWarmSession(int listener, int retireFd, int takenFd,
+                           const std::string &key) {
+    WarmChild warm;
+    if (warm.start()) {
+        g_warmChild = &warm;
+    }
+    while (true) {
+        pollfd fds[2] = { { listener, POLLIN, 0 }, { retireFd, POLLIN, 0 } };
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            _exit(1);
+        }
+        if (fds[1].revents != 0) {
+            // The daemon has let the pool go.
+            _exit(0);
+        }
+        // Another session may have won the connection.
+        const int s = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+        if (s < 0) {
+            continue;
+        }
+        const pid_t self = getpid();
+        writeAllRestarting(takenFd, &self, sizeof(self));
+        close(takenFd);
+        close(retireFd);
+        close(listener);
+        runDaemonSession(s, key);
+    }
+}
+
+// With --pool, the daemon keeps pool.size sessions forked ahead of time.
+// They accept connections themselves and report each one on the taken pipe,
+// and the daemon forks replacements.  After pool.idleSeconds without a
+// launch, closing the retire pipe ends the idle sessions, and the daemon
+// accepts the next connection itself, as without a pool, before refilling.
+static void runPool(int listener, const std::string &key,
+                    const PoolParams &pool) __attribute__((noreturn));
+static void runPool(int listener, const std::string &key, const PoolParams &pool) {
+    typedef std::chrono::steady_clock Clock;
+    // Every idle session polls the listener, so none may block in accept.
+    fcntl(listener, F_SETFL, fcntl(listener, F_GETFL) | O_NONBLOCK);
+    PipePair taken = makePipePair(O_CLOEXEC);
+    PipePair retire = makePipePair(O_CLOEXEC);
+    std::vector<pid_t> idle;
+    bool retired = false;
+    auto lastLaunch = Clock::now();
+
+    // Sessions must not keep the daemon's ends of the pipes.
+    const auto forkSession = [&]() -> pid_t {
+        const pid_t pid = fork();
+        if (pid == 0) {
+            taken.read.close();
+            retire.write.close();
+            // The session's child must not inherit the daemon's dispositions.
+            signal(SIGHUP, SIG_DFL);
+            signal(SIGCHLD, SIG_DFL);
+        }
+        return pid;
+    };
+
+    while (true) {
+        // Finished sessions are reaped automatically, so one that died while
+        // idle is gone.
+        idle.erase(std::remove_if(idle.begin(), idle.end(), [](pid_t pid) {
+            return kill(pid, 0) != 0 && errno == ESRCH;
+        }), idle.end());
+        while (!retired && static_cast<int>(idle.size()) < pool.size) {
+            const pid_t pid = forkSession();
+            if (pid == 0) {
+                runWarmSession(listener, retire.read.fd(), taken.write.fd(), key);
+            } else if (pid < 0) {
+                break;
+            }
+            idle.push_back(pid);
+        }
+
+        const auto idleLimit = lastLaunch + std::chrono::seconds(pool.idleSeconds);
+        const int timeoutMs = retired ? -1 : std::max<int64_t>(0,
+            std::chrono::duration_cast<std::chrono::milliseconds>(
+                idleLimit - Clock::now()).count() + 1);
+        pollfd fds[2] = {
+            { taken.read.fd(), POLLIN, 0 },
+            { listener, static_cast<short>(retired ? POLLIN : 0), 0 },
+        };
+        const int ret = poll(fds, 2, timeoutMs);
+        if (ret < 0 && errno != EINTR) {
+            fatalPerror("error: poll failed");
+        }
+        if (fds[0].revents & POLLIN) {
+            pid_t pids[64];
+            const ssize_t amt = readRestarting(taken.read.fd(), pids, sizeof(pids));
+            for (ssize_t i = 0; i < amt / static_cast<ssize_t>(sizeof(pid_t)); ++i) {
+                idle.erase(std::remove(idle.begin(), idle.end(), pids[i]), idle.end());
+            }
+            lastLaunch = Clock::now();
+        }
+        if (fds[1].revents & POLLIN) {
+            const int s = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+            if (s >= 0) {
+                if (forkSession() == 0) {
+                    close(listener);
+                    runDaemonSession(s, key);
+                }
+                close(s);
+                retired = false;
+                lastLaunch = Clock::now();
+            }
+        }
+        if (!retired && ret == 0 && Clock::now() >= idleLimit) {
+            retire.write.close();
+            retire = makePipePair(O_CLOEXEC);
+            idle.clear();
+            retired = true;
+        }
+    }
+}
+
+// A persistent backend outlives the bash.exe that started it, so later
+// frontends skip WSL's process startup.  It reports its listening port over
+// the -3 connection, detaches, and forks a session per frontend connection.
+static void runDaemon(int controlSocketPort, const std::string &key,
+                      const PoolParams &pool) __attribute__((noreturn));
+static void runDaemon(int controlSocketPort, const std::string &key,
+                      const PoolParams &pool) {
+    const int listener = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t addrLen = sizeof(addr);
+    if (listener < 0 ||
+            bind(listener, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) != 0 ||
+            listen(listener, 16) != 0 ||
+            getsockname(listener, reinterpret_cast<sockaddr*>(&addr), &addrLen) != 0) {
+        fatalPerror("error: could not listen for daemon sessions");
+    }
+
+    const int controlSocket = connectSocket(controlSocketPort, key);
+    Packet p = { sizeof(Packet), Packet::Type::DaemonListening };
+    p.u.daemonPort = ntohs(addr.sin_port);
+    if (!writeAllRestarting(controlSocket, &p, sizeof(p))) {
+        fatal("error: could not report the daemon port\n");
+    }
+
+    const pid_t pid = fork();
+    if (pid < 0) {
+        fatalPerror("error: fork failed");
+    } else if (pid != 0) {
+        // bash.exe exits with this process.  Wait for the frontend to hang up
+        // first, so it doesn't mistake the exit for a failed start.
+        char dummy = 0;
+        while (readRestarting(controlSocket, &dummy, 1) > 0) {}
+        _exit(0);
+    }
+    close(controlSocket);
+    setsid();
+    const int nullFd = open("/dev/null", O_RDWR);
+    if (nullFd >= 0) {
+        dup2(nullFd, STDIN_FILENO);
+        dup2(nullFd, STDOUT_FILENO);
+        dup2(nullFd, STDERR_FILENO);
+        if (nullFd > STDERR_FILENO) {
+            close(nullFd);
+        }
+    }
+    signal(SIGHUP, SIG_IGN);
+    // Finished sessions are reaped automatically.
+    signal(SIGCHLD, SIG_IGN);
+
+    if (pool.size > 0) {
+        runPool(listener, key, pool);
+    }
+    while (true) {
+        const int s = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+        if (s < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            fatalPerror("error: accept failed");
+        }
+        const pid_t session = fork();
+        if (session == 0) {
+            close(listener);
+            // The session's child must not inherit the daemon's dispositions.
+            signal(SIGHUP, SIG_DFL);
+            signal(SIGCHLD, SIG_DFL);
+            runDaemonSession(s, key);
+        }
+        close(s);
+    }
+}
+
+// Fills in the program to run from argv, which is the user's shell when
+// empty, and terminates argv.
+static void setChildCommand(ChildParams &params, bool loginMode) {
+    if (params.argv.empty()) {
+        const char *shell = "/bin/sh";
+        struct passwd *pw = getpwuid(getuid());
+        if (pw == nullptr) {
+            fatalPerror("error: getpwuid failed");
+        } else if (pw->pw_shell == nullptr) {
+            fatal("error: getpwuid(...)->pw_shell is NULL\n");
+        } else {
+            shell = pw->pw_shell;
+        }
+        params.argv.push_back(strdup(shell));
+    }
+    // XXX: Replace char* args/envstrings with std::string?
+    params.prog = params.argv[0];
+    if (loginMode) {
+        std::string argv0 = params.argv[0];
+        const auto pos = argv0.find_last_of('/');
+        if (pos != std::string::npos) {
+            argv0 = argv0.substr(pos + 1);
+        }
+        argv0 = '-' + argv0;
+        params.argv[0] = strdup(argv0.c_str());
+    }
+    params.argv.push_back(nullptr);
+}
+
+// Reads the SpawnParams packet that --spawn-params waits for.  The child's
+// strings point into buf, which must outlive the spawn.
+static void readSpawnParams(int s, ChildParams &params, std::vector<char> &buf) {
+    Packet p = {};
+    if (!readAllRestarting(s, &p, sizeof(p)) ||
+            p.type != Packet::Type::SpawnParams ||
+            p.size <= sizeof(p) ||
+            p.size - sizeof(p) > kMaxSpawnRequestSize) {
+        fatal("error: did not receive the spawn parameters\n");
+    }
+    buf.resize(p.size - sizeof(p));
+    if (!readAllRestarting(s, buf.data(), buf.size()) || buf.back() != '\0') {
+        fatal("error: did not receive the spawn parameters\n");
+    }
+    std::vector<char*> strings;
+    for (size_t i = 0; i < buf.size(); i += strlen(&buf[i]) + 1) {
+        strings.push_back(&buf[i]);
+    }
+    const uint32_t envCount = p.u.spawnParams.envCount;
+    if (envCount > strings.size() - 1) {
+        fatal("error: the spawn parameters are malformed\n");
+    }
+    params.cwd = strings[0];
+    params.env.assign(strings.begin() + 1, strings.begin() + 1 + envCount);
+    params.argv.assign(strings.begin() + 1 + envCount, strings.end());
+    if (params.usePty) {
+        params.cols = p.u.spawnParams.termSize.cols;
+        params.rows = p.u.spawnParams.termSize.rows;
+    }
+}
+
+// --send-file and --receive-file, the backend's side of the frontend's --pull
+// and --push.  See kTransferChunkSize for the protocol.
+struct TransferParams {
+    std::string path;
+    bool sending = false;
+    int streams = kDefaultTransferStreams;
+    bool resume = false;
+};
+
+static void writeTransferPacket(int s, const Packet &p) {
+    if (!writeAllRestarting(s, &p, sizeof(p))) {
+        connectionBrokenAbort();
+    }
+}
+
+static Packet readTransferPacket(int s, Packet::Type type) {
+    Packet p = {};
+    if (!readAllRestarting(s, &p, sizeof(p)) || p.type != type || p.size != sizeof(p)) {
+        connectionBrokenAbort();
+    }
+    return p;
+}
+
+// The backend outlives the transfer until the frontend closes the control
+// connection, so the frontend's watchdog never sees it exit first.
+static void waitForControlClose(int s) {
+    char ch = 0;
+    while (readRestarting(s, &ch, 1) > 0) {}
+}
+
+static void transferFailed(int controlSocket, int err) __attribute__((noreturn));
+static void transferFailed(int controlSocket, int err) {
+    Packet p = { sizeof(Packet), Packet::Type::TransferFailed };
+    p.u.transferError = bridgedError(err);
+    writeTransferPacket(controlSocket, p);
+    waitForControlClose(controlSocket);
+    exit(1);
+}
+
+// Sends one connection's chunks of the file with sendfile, or by copying on a
+// WSL build without it.
+static void sendTransferChunks(int s, int fd, TransferLayout layout, int stream) {
+    bool useSendfile = true;
+    std::unique_ptr<char[]> buf;
+    for (uint64_t chunk = stream; chunk < layout.chunkCount(); chunk += layout.streams) {
+        off_t offset = layout.chunkOffset(chunk);
+        size_t left = layout.chunkSize(chunk);
+        while (left > 0 && useSendfile) {
+            const ssize_t amt = sendfile(s, fd, &offset, left);
+            if (amt < 0 && errno == EINTR) {
+                continue;
+            } else if (amt < 0 && spliceUnsupported(errno)) {
+                useSendfile = false;
+            } else if (amt < 0 && (errno == EPIPE || errno == ECONNRESET)) {
+                connectionBrokenAbort();
+            } else if (amt < 0) {
+                fatalPerror("error: sendfile failed");
+            } else if (amt == 0) {
+                fatal("error: the file shrank while it was being sent\n");
+            } else {
+                left -= amt;
+            }
+        }
+        if (left > 0) {
+            if (!buf) {
+                buf = std::unique_ptr<char[]>(new char[kTransferChunkSize]);
+            }
+            if (!preadAllRestarting(fd, buf.get(), left, offset)) {
+                fatal("error: could not read the file being sent\n");
+            }
+            if (!writeAllRestarting(s, buf.get(), left)) {
+                connectionBrokenAbort();
+            }
+        }
+    }
+    shutdown(s, SHUT_WR);
+}
+
+// Writes one connection's chunks to the file, each in its turn.  Each chunk
+// is read ahead of its turn, so the connections all keep receiving while
+// one of them writes.
+static void receiveTransferChunks(int s, int fd, TransferLayout layout, int stream,
+                                  TransferTurns *turns) {
+    std::unique_ptr<char[]> buf(new char[kTransferChunkSize]);
+    for (uint64_t chunk = stream; chunk < layout.chunkCount(); chunk += layout.streams) {
+        const size_t size = layout.chunkSize(chunk);
+        if (!readAllRestarting(s, buf.get(), size)) {
+            connectionBrokenAbort();
+        }
+        turns->wait(chunk);
+        if (!pwriteAllRestarting(fd, buf.get(), size, layout.chunkOffset(chunk))) {
+            fatalPerror("error: could not write the file");
+        }
+        turns->finish(chunk);
+    }
+}
+
+static void runTransfer(const TransferParams &params, int controlPort, int dataPort,
+                        const std::string &key, int socketBufferSize) __attribute__((noreturn));
+static void runTransfer(const TransferParams &params, int controlPort, int dataPort,
+                        const std::string &key, int socketBufferSize) {
+    const int controlSocket = connectSocket(controlPort, key, socketBufferSize);
+    // We want to handle EPIPE rather than receiving SIGPIPE.
+    signal(SIGPIPE, SIG_IGN);
+    writeTransferPacket(controlSocket, helloPacket());
+
+    TransferLayout layout = { 0, 0, params.streams };
+    UniqueFd file;
+    struct stat st = {};
+    if (params.sending) {
+        file = UniqueFd(open(params.path.c_str(), O_RDONLY | O_CLOEXEC));
+        if (file.fd() < 0 || fstat(file.fd(), &st) != 0) {
+            transferFailed(controlSocket, errno);
+        } else if (S_ISDIR(st.st_mode)) {
+            transferFailed(controlSocket, EISDIR);
+        } else if (!S_ISREG(st.st_mode)) {
+            transferFailed(controlSocket, EINVAL);
+        }
+        layout.size = st.st_size;
+        writeTransferPacket(controlSocket,
+            transferOffsetPacket(Packet::Type::TransferInfo, layout.size));
+        const Packet start = readTransferPacket(controlSocket, Packet::Type::TransferStart);
+        layout.start = transferOffset(start);
+        if (layout.start > layout.size) {
+            fatal("error: the frontend asked for an offset past the end of the file\n");
+        }
+        // Only continue a file whose last bytes match ours.
+        uint32_t checksum = 0;
+        if (!transferChecksum(file.fd(), layout.start, checksum)) {
+            transferFailed(controlSocket, errno);
+        }
+        if (checksum != start.u.transferOffset.checksum) {
+            layout.start = 0;
         }
+        writeTransferPacket(controlSocket,
+            transferOffsetPacket(Packet::Type::TransferStart, layout.start));
+    } else {
+        layout.size = transferOffset(
+            readTransferPacket(controlSocket, Packet::Type::TransferInfo));
+        const int flags = O_RDWR | O_CREAT | O_CLOEXEC | (params.resume ? 0 : O_TRUNC);
+        file = UniqueFd(open(params.path.c_str(), flags, 0666));
+        if (file.fd() < 0 || fstat(file.fd(), &st) != 0) {
+            transferFailed(controlSocket, errno);
+        } else if (!S_ISREG(st.st_mode)) {
+            transferFailed(controlSocket, EINVAL);
+        }
+        // A file longer than the one being sent isn't a prefix of it.
+        const uint64_t existing = st.st_size;
+        uint64_t offered = existing <= layout.size ? existing : 0;
+        uint32_t checksum = 0;
+        if (!transferChecksum(file.fd(), offered, checksum)) {
+            transferFailed(controlSocket, errno);
+        }
+        writeTransferPacket(controlSocket,
+            transferOffsetPacket(Packet::Type::TransferStart, offered, checksum));
+        layout.start = transferOffset(
+            readTransferPacket(controlSocket, Packet::Type::TransferStart));
+        if (layout.start > offered) {
+            fatal("error: the frontend sent an offset past the end of the file\n");
+        }
+        if (existing != layout.start && ftruncate(file.fd(), layout.start) != 0) {
+            transferFailed(controlSocket, errno);
+        }
+    }
+
+    std::vector<int> sockets;
+    for (int i = 0; i < params.streams; ++i) {
+        sockets.push_back(startConnect(dataPort, socketBufferSize));
+    }
+    for (int i = 0; i < params.streams; ++i) {
+        finishConnect(sockets[i], key);
+        const uint32_t index = i;
+        if (!writeAllRestarting(sockets[i], &index, sizeof(index))) {
+            connectionBrokenAbort();
+        }
+    }
+
+    TransferTurns turns;
+    std::vector<std::unique_ptr<IoThread>> threads;
+    for (int i = 0; i < params.streams; ++i) {
+        threads.push_back(std::unique_ptr<IoThread>(params.sending
+            ? new IoThread(sendTransferChunks, sockets[i], file.fd(), layout, i)
+            : new IoThread(receiveTransferChunks, sockets[i], file.fd(), layout, i,
+                           &turns)));
+    }
+    for (auto &thread : threads) {
+        thread->join();
     }
+    if (!params.sending) {
+        const Packet done = { sizeof(Packet), Packet::Type::TransferDone };
+        writeTransferPacket(controlSocket, done);
+    }
+    waitForControlClose(controlSocket);
+    exit(0);
+}
 
+// Runs the backend for one command line.  A daemon session passes its
+// connection as sessionSocket; otherwise it's -1 and the backend connects
+// to the frontend's ports.
+static int runBackend(int argc, char *argv[], int sessionSocket) {
+    const int64_t backendStart = traceClockMicros();
     int controlSocketPort = -1;
     int inputSocketPort = -1;
     int outputSocketPort = -1;
@@ -516,28 +2889,58 @@ int main(int argc, char *argv[]) {
     std::string key;
     int windowSize = -1;
     int windowThreshold = -1;
+    int windowMax = -1;
+    BufferParams bufferParams = { kDefaultInputBufferSize, kDefaultOutputBufferSize };
+    int socketBufferSize = 0;
     ChildParams childParams;
     int ptyMode = -1;
+    int muxMode = 0;
+    int epollMode = 0;
+    int compressMode = 0;
+    int daemonMode = 0;
+    int multiMode = 0;
+    int reportPathMode = 0;
+    int traceMode = 0;
+    int spawnParamsMode = 0;
+    PoolParams pool;
+    TransferParams transfer;
+    int resumeMode = 0;
     bool loginMode = false;
 
     const struct option kOptionTable[] = {
         { "pty",            false, &ptyMode,    1 },
         { "pipes",          false, &ptyMode,    0 },
+        { "mux",            false, &muxMode,    1 },
+        { "epoll",          false, &epollMode,  1 },
+        { "compress",       false, &compressMode, 1 },
+        { "daemon",         false, &daemonMode, 1 },
+        { "multi",          false, &multiMode,  1 },
+        { "report-path",    false, &reportPathMode, 1 },
+        { "trace-startup",  false, &traceMode,  1 },
+        { "spawn-params",   false, &spawnParamsMode, 1 },
+        { "pool",           true,  nullptr,     'P' },
+        { "pool-idle",      true,  nullptr,     'I' },
+        { "send-file",      true,  nullptr,     'F' },
+        { "receive-file",   true,  nullptr,     'G' },
+        { "streams",        true,  nullptr,     'N' },
+        { "resume",         false, &resumeMode, 1 },
         // This debugging option is handled earlier.  Include it in this table
         // just to discard it.
         { "debug-fork",     false, nullptr,     0 },
         { "version",        false, nullptr,     'v' },
         { "check-version",  true,  nullptr,     'V' },
+        { "bench-child",    true,  nullptr,     'X' },
         { nullptr,          false, nullptr,     0 },
     };
 
     int ch = 0;
     bool versionChecked = false;
-    while ((ch = getopt_long(argc, argv, "+3:0:1:2:k:c:r:w:t:e:C:l", kOptionTable, nullptr)) != -1) {
+    while ((ch = getopt_long(argc, argv, "+3:0:1:2:k:c:r:w:t:m:b:B:S:e:C:l", kOptionTable, nullptr)) != -1) {
         switch (ch) {
             case 0:
-                // This is returned for the two long options.  getopt_long
-                // already writes to ptyMode, so there's nothing more to do.
+                // This is returned for the flag long options.  getopt_long
+                // already writes to the flag variable, so there's nothing more
+                // to do.
                 break;
             case '3': controlSocketPort = atoi(optarg); break;
             case '0': inputSocketPort = atoi(optarg); break;
@@ -548,7 +2951,18 @@ int main(int argc, char *argv[]) {
             case 'r': childParams.rows = atoi(optarg); break;
             case 'w': windowSize = atoi(optarg); break;
             case 't': windowThreshold = atoi(optarg); break;
-            case 'e': childParams.env.push_back(strdup(optarg)); break;
+            case 'm': windowMax = atoi(optarg); break;
+            case 'b': bufferParams.input = atoi(optarg); break;
+            case 'B': bufferParams.output = atoi(optarg); break;
+            case 'S': socketBufferSize = atoi(optarg); break;
+            case 'X': childParams.benchChild = optarg; break;
+            case 'P': pool.size = atoi(optarg); break;
+            case 'I': pool.idleSeconds = atoi(optarg); break;
+            case 'F': transfer.path = optarg; transfer.sending = true; break;
+            case 'G': transfer.path = optarg; transfer.sending = false; break;
+            case 'N': transfer.streams = atoi(optarg); break;
+            // The arguments outlive the child's spawn, so they aren't copied.
+            case 'e': childParams.env.push_back(optarg); break;
             case 'C': childParams.cwd = optarg; break;
             case 'l': loginMode = true; break;
             case 'v':
@@ -567,64 +2981,166 @@ int main(int argc, char *argv[]) {
     if (!versionChecked) {
         frontendVersionCheck("<old>"); // The frontend predates the version-checking.
     }
-    for (int i = optind; i < argc; ++i) {
-        childParams.argv.push_back(argv[i]);
+    if (daemonMode) {
+        optionNotAllowed("--daemon", " in a daemon session", sessionSocket, -1);
+        optionRequired("-3", controlSocketPort, -1);
+        optionRequired("-k", key, std::string());
+        if (pool.size < 0 || pool.size > kMaxPoolSize || pool.idleSeconds < 1) {
+            fatal("error: invalid --pool or --pool-idle argument\n");
+        }
+        runDaemon(controlSocketPort, key, pool);
     }
-    if (childParams.argv.empty()) {
-        const char *shell = "/bin/sh";
-        struct passwd *pw = getpwuid(getuid());
-        if (pw == nullptr) {
-            fatalPerror("error: getpwuid failed");
-        } else if (pw->pw_shell == nullptr) {
-            fatal("error: getpwuid(...)->pw_shell is NULL\n");
-        } else {
-            shell = pw->pw_shell;
+    optionNotAllowed("--pool", " without --daemon", pool.size, 0);
+    if (!transfer.path.empty()) {
+        // There's no child, only the one file.
+        optionNotAllowed("--send-file/--receive-file", " in a daemon session", sessionSocket, -1);
+        optionRequired("-3", controlSocketPort, -1);
+        optionRequired("-0", inputSocketPort, -1);
+        optionRequired("-k", key, std::string());
+        if (ptyMode != -1 || muxMode || multiMode || spawnParamsMode || optind < argc) {
+            fatal("error: --send-file and --receive-file do not run a command\n");
+        }
+        if (transfer.streams < 1 || transfer.streams > kMaxTransferStreams) {
+            fatal("error: invalid --streams argument\n");
         }
-        childParams.argv.push_back(strdup(shell));
+        optionNotAllowed("--resume", " with --send-file", resumeMode && transfer.sending, false);
+        transfer.resume = resumeMode;
+        runTransfer(transfer, controlSocketPort, inputSocketPort, key, socketBufferSize);
     }
-    // XXX: Replace char* args/envstrings with std::string?
-    childParams.prog = childParams.argv[0];
-    if (loginMode) {
-        std::string argv0 = childParams.argv[0];
-        const auto pos = argv0.find_last_of('/');
-        if (pos != std::string::npos) {
-            argv0 = argv0.substr(pos + 1);
+    optionNotAllowed("--resume", " without --receive-file", resumeMode, 0);
+    if (spawnParamsMode) {
+        // The child's parameters follow the connection instead.
+        optionNotAllowed("--spawn-params", " in a daemon session", sessionSocket, -1);
+        optionNotAllowed("--spawn-params", " with --multi", multiMode, 0);
+        optionNotAllowed("-e", " with --spawn-params", childParams.env.empty(), true);
+        optionNotAllowed("-C", " with --spawn-params", childParams.cwd, std::string());
+        optionNotAllowed("-c", " with --spawn-params", childParams.cols, -1);
+        optionNotAllowed("-r", " with --spawn-params", childParams.rows, -1);
+        if (optind < argc) {
+            fatal("error: --spawn-params does not take a command\n");
         }
-        argv0 = '-' + argv0;
-        childParams.argv[0] = strdup(argv0.c_str());
+    } else {
+        childParams.argv.assign(argv + optind, argv + argc);
+        setChildCommand(childParams, loginMode);
     }
-    childParams.argv.push_back(nullptr);
 
     optionRequired("--pty/--pipes", ptyMode, -1);
-    optionRequired("-3", controlSocketPort, -1);
-    optionRequired("-0", inputSocketPort, -1);
-    optionRequired("-1", outputSocketPort, -1);
-    optionRequired("-k", key, std::string());
+    if (sessionSocket != -1) {
+        optionNotAllowed("-3", " in a daemon session", controlSocketPort, -1);
+        if (!muxMode) {
+            fatal("error: a daemon session requires --mux\n");
+        }
+    } else {
+        optionRequired("-3", controlSocketPort, -1);
+        optionRequired("-k", key, std::string());
+    }
+    if (muxMode) {
+        // Every channel shares the -3 connection.
+        optionNotAllowed("-0", " with --mux", inputSocketPort, -1);
+        optionNotAllowed("-1", " with --mux", outputSocketPort, -1);
+        optionNotAllowed("-2", " with --mux", errorSocketPort, -1);
+    } else {
+        optionRequired("-0", inputSocketPort, -1);
+        optionRequired("-1", outputSocketPort, -1);
+    }
     if (ptyMode) {
-        optionRequired("-c", childParams.cols, -1);
-        optionRequired("-r", childParams.rows, -1);
+        if (!spawnParamsMode) {
+            optionRequired("-c", childParams.cols, -1);
+            optionRequired("-r", childParams.rows, -1);
+        }
         optionNotAllowed("-2", " with --pty", errorSocketPort, -1);
     } else {
         optionNotAllowed("-c", " with --pipes", childParams.cols, -1);
         optionNotAllowed("-r", " with --pipes", childParams.rows, -1);
-        optionRequired("-2", errorSocketPort, -1);
+        if (!muxMode) {
+            optionRequired("-2", errorSocketPort, -1);
+        }
+    }
+    if (multiMode) {
+        // Each session's command arrives in a SpawnRequest.
+        if (!muxMode || ptyMode) {
+            fatal("error: --multi requires --mux and --pipes\n");
+        }
+        optionNotAllowed("--compress", " with --multi", compressMode, 0);
+        optionNotAllowed("--trace-startup", " with --multi", traceMode, 0);
+        if (optind < argc) {
+            fatal("error: --multi does not take a command\n");
+        }
     }
     optionRequired("-w", windowSize, -1);
     optionRequired("-t", windowThreshold, -1);
 
     childParams.usePty = ptyMode;
+    if (std::max(bufferParams.input, bufferParams.output) > kDefaultPipeSize) {
+        childParams.pipeSize = std::max(bufferParams.input, bufferParams.output);
+    }
+
+    // Without -m, the window stays at its initial size.
+    if (windowMax == -1) {
+        windowMax = windowSize;
+    }
 
-    const WindowParams windowParams = { windowSize, windowThreshold };
+    const WindowParams windowParams = { windowSize, windowThreshold, windowMax };
     assert(windowParams.size >= 1);
     assert(windowParams.threshold >= 1);
     assert(windowParams.threshold <= windowParams.size);
+    assert(windowParams.size <= windowParams.max);
+    assert(bufferParams.input >= 1 && bufferParams.input <= kMaxBufferSize);
+    assert(bufferParams.output >= 1 && bufferParams.output <= kMaxBufferSize);
+    assert(socketBufferSize == 0 ||
+           (socketBufferSize >= kMinSocketBufferSize &&
+            socketBufferSize <= kMaxSocketBufferSize));
 
-    const int controlSocket = connectSocket(controlSocketPort, key);
-    const int inputSocket = connectSocket(inputSocketPort, key);
-    const int outputSocket = connectSocket(outputSocketPort, key);
-    const int errorSocket = ptyMode ? -1 : connectSocket(errorSocketPort, key);
+    if (sessionSocket != -1) {
+        // The connection already exists, so only the buffer sizes change.
+        setSocketBufferSize(sessionSocket, socketBufferSize);
+    }
+
+    std::unique_ptr<StartupTrace> trace;
+    if (traceMode) {
+        trace = std::unique_ptr<StartupTrace>(new StartupTrace);
+        trace->add("parse options", backendStart, traceClockMicros());
+    }
 
-    const auto child = spawnChild(childParams);
+    // Start every connection at once, and spawn the child while they
+    // complete.
+    const int64_t connectStart = trace ? traceClockMicros() : 0;
+    const int controlSocket = sessionSocket != -1
+        ? sessionSocket : startConnect(controlSocketPort, socketBufferSize);
+    const int inputSocket = muxMode ? -1 : startConnect(inputSocketPort, socketBufferSize);
+    const int outputSocket = muxMode ? -1 : startConnect(outputSocketPort, socketBufferSize);
+    const int errorSocket = muxMode || ptyMode ? -1 :
+        startConnect(errorSocketPort, socketBufferSize);
+
+    const int64_t connectStarted = trace ? traceClockMicros() : 0;
+    if (trace) {
+        trace->add("start connects", connectStart, connectStarted);
+    }
+
+    // With --spawn-params, the control connection has to finish first, and
+    // the rest complete while the child starts.
+    std::vector<char> spawnParams;
+    if (spawnParamsMode) {
+        const int64_t paramsStart = trace ? traceClockMicros() : 0;
+        finishConnect(controlSocket, key);
+        readSpawnParams(controlSocket, childParams, spawnParams);
+        setChildCommand(childParams, loginMode);
+        if (trace) {
+            trace->add("read spawn params", paramsStart, traceClockMicros());
+        }
+    }
+
+    const auto child = multiMode ? Child() : spawnChild(childParams, trace.get());
+
+    const int64_t finishStart = trace ? traceClockMicros() : 0;
+    for (const int s : { controlSocket, inputSocket, outputSocket, errorSocket }) {
+        if (s != -1 && s != sessionSocket && !(spawnParamsMode && s == controlSocket)) {
+            finishConnect(s, key);
+        }
+    }
+    if (trace) {
+        trace->add("finish connects", finishStart, traceClockMicros());
+    }
 
     // We must not register signal handlers until *after* spawning the child.
     // It will inherit at least any SIG_IGN settings.
@@ -639,9 +3155,40 @@ int main(int argc, char *argv[]) {
     sa.sa_handler = [](int signo) {};
     sigaction(SIGUSR1, &sa, nullptr);
 
-    mainLoop(childParams.usePty, controlSocket,
+    if (multiMode) {
+        MultiHost host(controlSocket, childParams, windowParams, bufferParams);
+        host.sendPacket(0, helloPacket());
+        PacketBackendPath pathPacket;
+        if (reportPathMode && backendPathPacket(pathPacket)) {
+            host.sendPacket(0, pathPacket);
+        }
+        host.run();
+    }
+
+    mainLoop(childParams.usePty, muxMode, epollMode, controlSocket,
              inputSocket, outputSocket, errorSocket,
-             childParams.prog.c_str(), child, windowParams);
+             childParams.prog.c_str(), child, windowParams, bufferParams,
+             compressMode, reportPathMode, trace.get());
 
     return 0;
 }
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+
+    // If the backend crashes, it prints a message to its stderr, which is a
+    // hidden console, and immediately exits.  We can show the console, but we
+    // need to keep the process around to see the error.  To do this, have a
+    // mode where the backend immediately forks itself, and the child does the
+    // real work.  The parent just sticks around for a while.
+    if (argc >= 2 && !strcmp(argv[1], "--debug-fork")) {
+        pid_t child = fork();
+        if (child != 0) {
+            sleep(3600);
+            return 0;
+        }
+    }
+
+    return runBackend(argc, argv, -1);
+}
@@ -0,0 +1,207 @@
+#include "Compress.h"
+
+#include <string.h>
+
+#include <algorithm>
+#include <array>
+
+namespace {
+
+const size_t kMinMatch = 4;
+// The LZ4 block format ends with at least this many literals, and its last
+// match starts at least kMatchLimit bytes before the end.
+const size_t kLastLiterals = 5;
+const size_t kMatchLimit = 12;
+const size_t kMaxOffset = 65535;
+const int kHashBits = 12;
+
+// Compression must save at least 1/kMinSavingsRatio of the input to be used.
+const size_t kMinSavingsRatio = 16;
+// Smaller chunks, like keystroke echo, are sent as-is without counting as a
+// failure to compress.
+const size_t kMinCompressSize = 64;
+const int kMaxBackoff = 64;
+
+inline uint32_t read32(const char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+inline uint32_t hash32(uint32_t v) {
+    return (v * 2654435761u) >> (32 - kHashBits);
+}
+
+inline size_t lengthBytes(size_t len) {
+    return len < 15 ? 0 : (len - 15) / 255 + 1;
+}
+
+inline void putLength(char *&op, size_t len) {
+    for (len -= 15; len >= 255; len -= 255) {
+        *op++ = static_cast<char>(255);
+    }
+    *op++ = static_cast<char>(len);
+}
+
+// Emits one sequence: literals, then a match unless matchLen is 0 (the last
+// sequence).  Returns false if it doesn't fit.
+bool emitSequence(char *&op, const char *oend,
+                  const char *lit, size_t litLen,
+                  size_t offset, size_t matchLen) {
+    const size_t needed = 1 + lengthBytes(litLen) + litLen +
+        (matchLen == 0 ? 0 : 2 + lengthBytes(matchLen - kMinMatch));
+    if (needed > static_cast<size_t>(oend - op)) {
+        return false;
+    }
+    const size_t matchCode = matchLen == 0 ? 0 : matchLen - kMinMatch;
+    *op++ = static_cast<char>((std::min<size_t>(litLen, 15) << 4) |
+                              std::min<size_t>(matchCode, 15));
+    if (litLen >= 15) {
+        putLength(op, litLen);
+    }
+    memcpy(op, lit, litLen);
+    op += litLen;
+    if (matchLen != 0) {
+        *op++ = static_cast<char>(offset & 0xff);
+        *op++ = static_cast<char>(offset >> 8);
+        if (matchCode >= 15) {
+            putLength(op, matchCode);
+        }
+    }
+    return true;
+}
+
+// Reads a length continuation.  Returns false on truncated input.
+bool getLength(const unsigned char *&ip, const unsigned char *iend, size_t &len) {
+    unsigned char b = 0;
+    do {
+        if (ip >= iend) {
+            return false;
+        }
+        b = *ip++;
+        len += b;
+    } while (b == 255);
+    return true;
+}
+
+} // namespace
+
+size_t lzCompress(const char *src, size_t srcSize, char *dst, size_t dstCapacity) {
+    const char *const iend = src + srcSize;
+    const char *anchor = src;
+    char *op = dst;
+    const char *const oend = dst + dstCapacity;
+    if (srcSize > kMatchLimit) {
+        // Positions (plus one, so zero means empty) of recent 4-byte sequences.
+        std::array<uint32_t, 1 << kHashBits> table = {};
+        const char *const mflimit = iend - kMatchLimit;
+        const char *const matchEndLimit = iend - kLastLiterals;
+        const char *ip = src;
+        while (ip < mflimit) {
+            const uint32_t seq = read32(ip);
+            uint32_t &slot = table[hash32(seq)];
+            const uint32_t pos = ip - src + 1;
+            const uint32_t cand = slot;
+            slot = pos;
+            if (cand == 0 || pos - cand > kMaxOffset || read32(src + cand - 1) != seq) {
+                // Step faster through data that isn't matching.
+                ip += 1 + ((ip - anchor) >> 6);
+                continue;
+            }
+            const char *const match = src + cand - 1;
+            const char *p = ip + kMinMatch;
+            const char *m = match + kMinMatch;
+            while (p < matchEndLimit && *p == *m) {
+                ++p;
+                ++m;
+            }
+            if (!emitSequence(op, oend, anchor, ip - anchor, ip - match, p - ip)) {
+                return 0;
+            }
+            ip = anchor = p;
+        }
+    }
+    if (!emitSequence(op, oend, anchor, iend - anchor, 0, 0)) {
+        return 0;
+    }
+    return op - dst;
+}
+
+bool lzDecompress(const char *src, size_t srcSize, char *dst, size_t dstSize) {
+    const unsigned char *ip = reinterpret_cast<const unsigned char*>(src);
+    const unsigned char *const iend = ip + srcSize;
+    char *op = dst;
+    char *const oend = dst + dstSize;
+    while (true) {
+        if (ip >= iend) {
+            return false;
+        }
+        const unsigned char token = *ip++;
+        size_t litLen = token >> 4;
+        if (litLen == 15 && !getLength(ip, iend, litLen)) {
+            return false;
+        }
+        if (litLen > static_cast<size_t>(iend - ip) ||
+                litLen > static_cast<size_t>(oend - op)) {
+            return false;
+        }
+        memcpy(op, ip, litLen);
+        op += litLen;
+        ip += litLen;
+        if (ip == iend) {
+            // The last sequence has no match.
+            return op == oend;
+        }
+        if (iend - ip < 2) {
+            return false;
+        }
+        const size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        size_t matchLen = token & 15;
+        if (matchLen == 15 && !getLength(ip, iend, matchLen)) {
+            return false;
+        }
+        matchLen += kMinMatch;
+        if (offset == 0 || offset > static_cast<size_t>(op - dst) ||
+                matchLen > static_cast<size_t>(oend - op)) {
+            return false;
+        }
+        const char *m = op - offset;
+        if (offset >= matchLen) {
+            memcpy(op, m, matchLen);
+            op += matchLen;
+        } else {
+            // The match overlaps the bytes it produces.
+            for (size_t i = 0; i < matchLen; ++i) {
+                *op++ = *m++;
+            }
+        }
+    }
+}
+
+size_t ChunkCompressor::encode(char *chunk, size_t rawSize) {
+    char *const data = chunk + sizeof(ChunkHeader);
+    ChunkHeader header = {
+        static_cast<uint32_t>(rawSize),
+        static_cast<uint32_t>(rawSize)
+    };
+    if (rawSize < kMinCompressSize) {
+        // Send it as-is.
+    } else if (skip_ > 0) {
+        --skip_;
+    } else {
+        scratch_.resize(std::max(scratch_.size(), rawSize));
+        const size_t size = lzCompress(data, rawSize, scratch_.data(),
+                                       rawSize - rawSize / kMinSavingsRatio - 1);
+        if (size != 0) {
+            memcpy(data, scratch_.data(), size);
+            header.size = size;
+            backoff_ = 0;
+        } else {
+            backoff_ = std::min(std::max(backoff_ * 2, 1), kMaxBackoff);
+            skip_ = backoff_;
+        }
+    }
+    memcpy(chunk, &header, sizeof(header));
+    return sizeof(header) + header.size;
+}
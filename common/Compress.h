@@ -0,0 +1,43 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <vector>
+
+// A small, fast LZ77 codec producing the LZ4 block format.  It favors speed
+// over ratio: the point is to move fewer bytes through WSL's loopback socket
+// emulation, not to save space.
+
+// Compresses src into at most dstCapacity bytes.  Returns the compressed size,
+// or 0 if the result would not fit.
+size_t lzCompress(const char *src, size_t srcSize, char *dst, size_t dstCapacity);
+
+// Decompresses src, which must expand to exactly dstSize bytes.  Returns
+// false if the input is malformed.
+bool lzDecompress(const char *src, size_t srcSize, char *dst, size_t dstSize);
+
+// With --compress, the stdout and stderr streams are sequences of chunks, each
+// a ChunkHeader followed by its payload.  The payload is compressed if size is
+// less than rawSize, and stored as-is otherwise.  Flow-control windows count
+// raw bytes.
+struct ChunkHeader {
+    uint32_t size;      // Payload size, excluding this header.
+    uint32_t rawSize;
+};
+
+// Turns one channel's output into chunks.  Data that fails to compress makes
+// the compressor skip a growing number of chunks before trying again, so
+// incompressible output costs little more than a memcpy.
+class ChunkCompressor {
+public:
+    // chunk points to room for a ChunkHeader, followed by rawSize bytes of
+    // data.  The data is compressed in place when that pays off, and the
+    // header is filled in.  Returns the chunk's total size.
+    size_t encode(char *chunk, size_t rawSize);
+
+private:
+    std::vector<char> scratch_;
+    int skip_ = 0;
+    int backoff_ = 0;
+};
@@ -10,10 +10,20 @@
 #include <sys/select.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 
+#if defined(__linux__)
+#include <linux/futex.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#endif
+
 #include <algorithm>
 #include <array>
+#include <chrono>
 
 void fatal(const char *fmt, ...) {
     va_list ap;
@@ -82,12 +92,88 @@ bool readAllRestarting(int fd, void *buf, size_t count) {
     return true;
 }
 
+bool preadAllRestarting(int fd, void *buf, size_t count, uint64_t offset) {
+    while (count > 0) {
+        const ssize_t amt = pread(fd, buf, count, offset);
+        if (amt < 0 && errno == EINTR) {
+            continue;
+        }
+        if (amt <= 0) {
+            return false;
+        }
+        assert(static_cast<size_t>(amt) <= count);
+        buf = reinterpret_cast<char*>(buf) + amt;
+        count -= amt;
+        offset += amt;
+    }
+    return true;
+}
+
+bool pwriteAllRestarting(int fd, const void *buf, size_t count, uint64_t offset) {
+    while (count > 0) {
+        const ssize_t amt = pwrite(fd, buf, count, offset);
+        if (amt < 0 && errno == EINTR) {
+            continue;
+        }
+        if (amt <= 0) {
+            return false;
+        }
+        assert(static_cast<size_t>(amt) <= count);
+        buf = reinterpret_cast<const char*>(buf) + amt;
+        count -= amt;
+        offset += amt;
+    }
+    return true;
+}
+
+// FNV-1a, which is plenty to tell whether a file was replaced or rewritten.
+bool transferChecksum(int fd, uint64_t offset, uint32_t &checksum) {
+    const size_t size = offset < kTransferChunkSize ? offset : kTransferChunkSize;
+    std::unique_ptr<char[]> buf(new char[size]);
+    if (size > 0 && !preadAllRestarting(fd, buf.get(), size, offset - size)) {
+        return false;
+    }
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < size; ++i) {
+        hash = (hash ^ static_cast<uint8_t>(buf[i])) * 16777619u;
+    }
+    checksum = hash;
+    return true;
+}
+
 void setSocketNoDelay(int s) {
     const int flag = 1;
     const int nodelayRet = setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
     assert(nodelayRet == 0);
 }
 
+// Sets a socket's send and receive buffer sizes, unless size is 0.  TCP
+// picks its window scaling during the handshake, so this must happen before
+// the socket connects or listens for the receive buffer to take full effect.
+// The sizes are only a hint: the OS may clamp them.
+void setSocketBufferSize(int s, int size) {
+    if (size == 0) {
+        return;
+    }
+    setsockopt(s, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    setsockopt(s, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+}
+
+// As long as clients only get one chance to provide a key, this function
+// should be unnecessary.
+bool secureStrEqual(const std::string &x, const std::string &y) {
+    if (x.size() != y.size()) {
+        return false;
+    }
+    volatile char ch = 0;
+    volatile const char *xp = &x[0];
+    volatile const char *yp = &y[0];
+    for (size_t i = 0; i < x.size(); ++i) {
+        ch |= (xp[i] ^ yp[i]);
+    }
+    return ch == 0;
+}
+
 BridgedErrno bridgedErrno(int err) {
     switch (err) {
         case 0:                 return BridgedErrno::Success;
@@ -148,30 +234,563 @@ std::string errorString(BridgedError err) {
     return errStr;
 }
 
+const char *StreamReader::next(size_t size) {
+    assert(size <= buf_.size());
+    if (end_ - start_ < size) {
+        if (buf_.size() - start_ < size) {
+            memmove(&buf_[0], &buf_[start_], end_ - start_);
+            end_ -= start_;
+            start_ = 0;
+        }
+        while (end_ - start_ < size) {
+            const ssize_t amt = readRestarting(fd_, &buf_[end_], buf_.size() - end_);
+            if (amt <= 0) {
+                return nullptr;
+            }
+            end_ += amt;
+        }
+    }
+    const char *const ret = &buf_[start_];
+    start_ += size;
+    if (start_ == end_) {
+        start_ = end_ = 0;
+    }
+    return ret;
+}
+
+bool MuxSocket::writeFrame(Channel channel, char *buf, size_t payloadSize) {
+    assert(payloadSize <= kMaxFramePayload);
+    const FrameHeader header = { static_cast<uint32_t>(payloadSize), channel };
+    memcpy(buf, &header, sizeof(header));
+    std::lock_guard<std::mutex> lock(mutex_);
+    return writeAllRestarting(fd_, buf, sizeof(header) + payloadSize);
+}
+
+bool MuxSocket::writePacket(const Packet &p) {
+    std::array<char, sizeof(FrameHeader) + sizeof(AnyPacket)> buf;
+    assert(p.size >= sizeof(p) && p.size <= sizeof(AnyPacket));
+    memcpy(&buf[sizeof(FrameHeader)], &p, p.size);
+    return writeFrame(Channel::Control, buf.data(), p.size);
+}
+
+bool MuxSocket::writePackets(const Packet *packets, size_t count) {
+    std::vector<char> buf;
+    for (size_t i = 0; i < count; ++i) {
+        const Packet &p = packets[i];
+        assert(p.size == sizeof(p));
+        const FrameHeader header = { p.size, Channel::Control };
+        const char *const hp = reinterpret_cast<const char*>(&header);
+        buf.insert(buf.end(), hp, hp + sizeof(header));
+        buf.insert(buf.end(), reinterpret_cast<const char*>(&p),
+                   reinterpret_cast<const char*>(&p) + p.size);
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    return writeAllRestarting(fd_, buf.data(), buf.size());
+}
+
+bool MuxSocket::writeEof(Channel channel) {
+    char buf[sizeof(FrameHeader)];
+    return writeFrame(channel, buf, 0);
+}
+
+#if defined(__linux__)
+static_assert(sizeof(std::atomic<int32_t>) == sizeof(int),
+              "the window's credit counter doubles as a futex word");
+#endif
+
+void ChannelWindow::increase(int32_t amount, int32_t max) {
+    // Read increaseAmt_ into cw once to ensure a stable value.
+    const int32_t cw = increaseAmt_;
+    assert(cw >= 0 && cw <= max &&
+           amount >= 0 && amount <= max - cw);
+    (void)cw;
+#if defined(__linux__)
+    const int32_t total = increaseAmt_ += amount;
+    // The sender sets needed_ before it re-checks increaseAmt_ in
+    // FUTEX_WAIT, so either it sees the new credit or we see it asleep.
+    // Credit that still leaves it short of the threshold doesn't wake it.
+    const int32_t needed = needed_;
+    if (needed != 0 && total >= needed) {
+        syscall(SYS_futex, reinterpret_cast<int*>(&increaseAmt_),
+                FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+    }
+#else
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        increaseAmt_ += amount;
+    }
+    increaseCV_.notify_one();
+#endif
+}
+
+ChannelStats ChannelCounters::snapshot() const {
+    ChannelStats ret = {};
+    ret.bytes = bytes_;
+    ret.reads = reads_;
+    ret.writes = writes_;
+    ret.writeTime = writeTime_;
+    ret.stalls = stalls_;
+    ret.stallTime = stallTime_;
+    ret.ackWaits = ackWaits_;
+    ret.ackWaitTime = ackWaitTime_;
+    return ret;
+}
+
+int64_t traceClockMicros() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+void StartupTrace::add(const char *name, int64_t start, int64_t end, uint32_t thread) {
+    TraceEvent event = {};
+    snprintf(event.name, sizeof(event.name), "%s", name);
+    event.thread = thread;
+    event.start = start;
+    event.duration = end - start;
+    std::lock_guard<std::mutex> lock(mutex_);
+    events_.push_back(event);
+}
+
+std::vector<TraceEvent> StartupTrace::events() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return events_;
+}
+
+void ChannelWindow::wait(int32_t &locWindow, const WindowParams &params,
+                         ChannelCounters *counters) {
+    const auto hasWindow = [&](bool readAtomic = true) -> bool {
+        if (readAtomic) {
+            const int32_t iw = increaseAmt_.exchange(0);
+            assert(iw <= params.max - locWindow);
+            locWindow += iw;
+        }
+        return locWindow >= params.threshold;
+    };
+    assert(locWindow >= 0 && locWindow <= params.max);
+    if (hasWindow(false) || hasWindow()) {
+        return;
+    }
+    // From here on, we're going to block anyway, so timing it is free.
+    const auto start = std::chrono::steady_clock::now();
+#if defined(__linux__)
+    do {
+        needed_ = params.threshold - locWindow;
+        const int32_t pending = increaseAmt_;
+        if (pending < params.threshold - locWindow) {
+            syscall(SYS_futex, reinterpret_cast<int*>(&increaseAmt_),
+                    FUTEX_WAIT_PRIVATE, pending, nullptr, nullptr, 0);
+        }
+        needed_ = 0;
+    } while (!hasWindow());
+#else
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        increaseCV_.wait(lock, hasWindow);
+    }
+#endif
+    if (counters != nullptr) {
+        counters->addStall(std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - start).count());
+    }
+}
+
+const size_t BufferPool::kBlockSize;
+const size_t BufferPool::kMaxFreeBlocks;
+
+void BufferPool::Block::reset() {
+    if (data_ != nullptr) {
+        pool_->release(data_);
+        data_ = nullptr;
+    }
+}
+
+BufferPool::~BufferPool() {
+    for (char *data : free_) {
+        delete[] data;
+    }
+}
+
+BufferPool::Block BufferPool::acquire() {
+    char *data = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        ++acquires_;
+        highWater_ = std::max(highWater_, ++inUse_);
+        if (!free_.empty()) {
+            data = free_.back();
+            free_.pop_back();
+        }
+    }
+    if (data == nullptr) {
+        data = new char[kBlockSize];
+    }
+    return Block(this, data);
+}
+
+void BufferPool::release(char *data) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        --inUse_;
+        if (free_.size() < kMaxFreeBlocks) {
+            free_.push_back(data);
+            return;
+        }
+    }
+    delete[] data;
+}
+
+PoolStats BufferPool::stats() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return PoolStats { kBlockSize, acquires_, inUse_, highWater_ };
+}
+
+void ChannelQueue::push(const char *data, size_t size) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (discarding_) {
+            return;
+        }
+        while (size > 0) {
+            // Fill the newest block before starting another.
+            if (chunks_.empty() || chunks_.back().end == BufferPool::kBlockSize) {
+                chunks_.emplace_back();
+                chunks_.back().block = pool_.acquire();
+            }
+            BufferPool::Chunk &chunk = chunks_.back();
+            const size_t amt = std::min(size, BufferPool::kBlockSize - chunk.end);
+            memcpy(chunk.block.data() + chunk.end, data, amt);
+            chunk.end += amt;
+            data += amt;
+            size -= amt;
+        }
+    }
+    cv_.notify_one();
+}
+
+void ChannelQueue::close() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        closed_ = true;
+    }
+    cv_.notify_one();
+}
+
+void ChannelQueue::discard() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    discarding_ = true;
+    chunks_.clear();
+}
+
+size_t ChannelQueue::pop(char *buf, size_t size) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [&]() { return !chunks_.empty() || closed_; });
+    size_t done = 0;
+    while (done < size && !chunks_.empty()) {
+        BufferPool::Chunk &chunk = chunks_.front();
+        const size_t amt = std::min(size - done, chunk.size());
+        memcpy(buf + done, chunk.data(), amt);
+        chunk.begin += amt;
+        done += amt;
+        if (chunk.begin == chunk.end) {
+            chunks_.pop_front();
+        }
+    }
+    return done;
+}
+
+bool ChannelQueue::popChunk(BufferPool::Chunk &chunk) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [&]() { return !chunks_.empty() || closed_; });
+    if (chunks_.empty()) {
+        return false;
+    }
+    chunk = std::move(chunks_.front());
+    chunks_.pop_front();
+    return true;
+}
+
+bool ChannelQueue::waitFor(std::chrono::microseconds timeout) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    return cv_.wait_for(lock, timeout,
+                        [&]() { return !chunks_.empty() || closed_; });
+}
+
 WakeupFd::WakeupFd() {
-    if (pipe2(fds_, O_NONBLOCK | O_CLOEXEC) != 0) {
-        fatalPerror("error: pipe2 failed");
+#if defined(__linux__)
+    fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fd_ < 0) {
+        fatalPerror("error: eventfd failed");
     }
-    FD_ZERO(&fdset_);
+#else
+    if (sem_init(&sem_, 0, 0) != 0) {
+        fatalPerror("error: sem_init failed");
+    }
+#endif
+}
+
+WakeupFd::~WakeupFd() {
+#if defined(__linux__)
+    close(fd_);
+#else
+    sem_destroy(&sem_);
+#endif
 }
 
-void WakeupFd::wait() {
+void WakeupFd::set(uint32_t events) {
+    if (events_.fetch_or(events) != 0) {
+        // The waiter hasn't taken the last wakeup yet.
+        return;
+    }
+#if defined(__linux__)
+    const uint64_t one = 1;
+    writeRestarting(fd_, &one, sizeof(one));
+#else
+    sem_post(&sem_);
+#endif
+}
+
+void ByteRing::reserve(size_t extra) {
+    if (buf_.size() - size_ >= extra) {
+        return;
+    }
+    // Unwrap the queued bytes into a larger buffer.
+    std::vector<char> grown(std::max(buf_.size() * 2, size_ + extra));
+    for (size_t done = 0; done < size_; ) {
+        const size_t pos = index(done);
+        const size_t piece = std::min(size_ - done, buf_.size() - pos);
+        memcpy(&grown[done], &buf_[pos], piece);
+        done += piece;
+    }
+    buf_.swap(grown);
+    head_ = 0;
+}
+
+void ByteRing::append(const void *data, size_t size) {
+    reserve(size);
+    size_ += size;
+    overwrite(size_ - size, data, size);
+}
+
+void ByteRing::overwrite(size_t offset, const void *data, size_t size) {
+    assert(offset + size <= size_);
+    const char *src = static_cast<const char*>(data);
+    while (size > 0) {
+        const size_t pos = index(offset);
+        const size_t piece = std::min(size, buf_.size() - pos);
+        memcpy(&buf_[pos], src, piece);
+        src += piece;
+        offset += piece;
+        size -= piece;
+    }
+}
+
+void ByteRing::truncate(size_t size) {
+    assert(size <= size_);
+    size_ = size;
+}
+
+void ByteRing::consume(size_t size) {
+    assert(size <= size_);
+    size_ -= size;
+    head_ = size_ == 0 ? 0 : index(size);
+}
+
+ssize_t ByteRing::readFrom(int fd, size_t max) {
+    assert(max > 0);
+    reserve(max);
+    const size_t tail = index(size_);
+    const size_t first = std::min(max, buf_.size() - tail);
+    iovec iov[2] = {
+        { &buf_[tail], first },
+        { buf_.data(), max - first },
+    };
+    ssize_t ret = 0;
     do {
-        FD_SET(readFd(), &fdset_);
-        const int selectRet = select(readFd() + 1, &fdset_, nullptr, nullptr, nullptr);
-        if (selectRet < 0 && errno == EINTR) {
-            // Try again.
-            continue;
-        } else if (selectRet < 0) {
-            fatalPerror("internal error: select on wakeup pipe failed");
+        ret = readv(fd, iov, iov[1].iov_len > 0 ? 2 : 1);
+    } while (ret < 0 && errno == EINTR);
+    if (ret > 0) {
+        size_ += ret;
+    }
+    return ret;
+}
+
+ssize_t ByteRing::writeTo(int fd) {
+    assert(size_ > 0);
+    const size_t first = std::min(size_, buf_.size() - head_);
+    iovec iov[2] = {
+        { &buf_[head_], first },
+        { buf_.data(), size_ - first },
+    };
+    ssize_t ret = 0;
+    do {
+        ret = writev(fd, iov, iov[1].iov_len > 0 ? 2 : 1);
+    } while (ret < 0 && errno == EINTR);
+    if (ret > 0) {
+        consume(ret);
+    }
+    return ret;
+}
+
+template <typename Pred>
+void SpscRing::waitFor(Pred ready) {
+    if (ready()) {
+        return;
+    }
+    std::unique_lock<std::mutex> lock(mutex_);
+    // Either the other side sees waiters_ after publishing, or we see what
+    // it published.
+    ++waiters_;
+    while (!ready()) {
+        cv_.wait(lock);
+    }
+    --waiters_;
+}
+
+void SpscRing::wake() {
+    if (waiters_ > 0) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        cv_.notify_all();
+    }
+}
+
+bool SpscRing::push(const char *data, size_t size) {
+    const uint64_t capacity = capacity_;
+    uint64_t tail = tail_.load(std::memory_order_relaxed);
+    while (size > 0) {
+        waitFor([&]() { return failed_ || tail - head_ < capacity; });
+        if (failed_) {
+            return false;
         }
-        std::array<char, 32> dummy;
-        const ssize_t readRet = readRestarting(readFd(), dummy.data(), dummy.size());
-        if (readRet < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
-            // I'm not sure whether this can happen.
-            continue;
-        } else if (readRet <= 0) {
-            fatalPerror("internal error: wakeup pipe read failed");
+        const size_t pos = tail % capacity;
+        const size_t piece = std::min<uint64_t>(
+            { size, capacity - (tail - head_), capacity - pos });
+        memcpy(&buf_[pos], data, piece);
+        data += piece;
+        size -= piece;
+        tail += piece;
+        tail_ = tail;
+        wake();
+    }
+    return !failed_;
+}
+
+void SpscRing::close() {
+    closed_ = true;
+    wake();
+}
+
+size_t SpscRing::peek(const char *&data) {
+    const uint64_t head = head_.load(std::memory_order_relaxed);
+    waitFor([&]() { return closed_ || tail_ != head; });
+    // Check the position again: data pushed before close() still counts.
+    const uint64_t avail = tail_ - head;
+    const size_t pos = head % capacity_;
+    data = &buf_[pos];
+    return std::min<uint64_t>(avail, capacity_ - pos);
+}
+
+void SpscRing::consume(size_t size) {
+    head_ += size;
+    wake();
+}
+
+void SpscRing::fail() {
+    failed_ = true;
+    wake();
+}
+
+static void *ioThreadMain(void *arg) {
+    const std::unique_ptr<std::function<void()>> func(
+        static_cast<std::function<void()>*>(arg));
+    (*func)();
+    return nullptr;
+}
+
+void IoThread::start(std::function<void()> func) {
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, kIoThreadStackSize);
+    auto *const arg = new std::function<void()>(std::move(func));
+    const int err = pthread_create(&thread_, &attr, ioThreadMain, arg);
+    pthread_attr_destroy(&attr);
+    if (err != 0) {
+        errno = err;
+        fatalPerror("error: pthread_create failed");
+    }
+    joinable_ = true;
+}
+
+void IoThread::join() {
+    const int err = pthread_join(thread_, nullptr);
+    if (err != 0) {
+        errno = err;
+        fatalPerror("internal error: pthread_join failed");
+    }
+    joinable_ = false;
+}
+
+void IoThread::detach() {
+    pthread_detach(thread_);
+    joinable_ = false;
+}
+
+uint32_t WakeupFd::wait() {
+    uint32_t events = 0;
+    while (events == 0) {
+#if defined(__linux__)
+        pollfd pfd = { fd_, POLLIN, 0 };
+        if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+            fatalPerror("internal error: poll on wakeup eventfd failed");
+        }
+        events = drain();
+#else
+        if (sem_wait(&sem_) != 0 && errno != EINTR) {
+            fatalPerror("internal error: sem_wait failed");
+        }
+        // A set() may have posted after an earlier wait took its events.
+        events = events_.exchange(0);
+#endif
+    }
+    return events;
+}
+
+uint32_t WakeupFd::waitFor(std::chrono::microseconds timeout) {
+    const auto deadline = std::chrono::steady_clock::now() + timeout;
+    uint32_t events = 0;
+    while (events == 0) {
+        const auto remaining = std::chrono::duration_cast<std::chrono::microseconds>(
+            deadline - std::chrono::steady_clock::now()).count();
+        if (remaining <= 0) {
+            break;
         }
-    } while (false);
+#if defined(__linux__)
+        pollfd pfd = { fd_, POLLIN, 0 };
+        const timespec ts = { static_cast<time_t>(remaining / 1000000),
+                              static_cast<long>(remaining % 1000000 * 1000) };
+        if (ppoll(&pfd, 1, &ts, nullptr) < 0 && errno != EINTR) {
+            fatalPerror("internal error: poll on wakeup eventfd failed");
+        }
+        events = drain();
+#else
+        // sem_timedwait takes a CLOCK_REALTIME deadline.
+        timespec ts = {};
+        clock_gettime(CLOCK_REALTIME, &ts);
+        const int64_t nsec = ts.tv_nsec + remaining % 1000000 * 1000;
+        ts.tv_sec += remaining / 1000000 + nsec / 1000000000;
+        ts.tv_nsec = nsec % 1000000000;
+        if (sem_timedwait(&sem_, &ts) != 0 && errno != EINTR && errno != ETIMEDOUT) {
+            fatalPerror("internal error: sem_timedwait failed");
+        }
+        events = events_.exchange(0);
+#endif
+    }
+    return events;
+}
+
+#if defined(__linux__)
+uint32_t WakeupFd::drain() {
+    uint64_t count = 0;
+    readRestarting(fd_, &count, sizeof(count));
+    return events_.exchange(0);
 }
+#endif
@@ -1,6 +1,8 @@
 #pragma once
 
 #include <assert.h>
+#include <pthread.h>
+#include <semaphore.h>
 #include <stdarg.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -9,8 +11,16 @@
 #include <unistd.h>
 
 #include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <utility>
+#include <vector>
 
 #define XSTRINGIFY(x) #x
 #define STRINGIFY(x) XSTRINGIFY(x)
@@ -24,7 +34,11 @@ ssize_t writeRestarting(int fd, const void *buf, size_t count);
 bool writeAllRestarting(int fd, const void *buf, size_t count);
 ssize_t readRestarting(int fd, void *buf, size_t count);
 bool readAllRestarting(int fd, void *buf, size_t count);
+bool preadAllRestarting(int fd, void *buf, size_t count, uint64_t offset);
+bool pwriteAllRestarting(int fd, const void *buf, size_t count, uint64_t offset);
 void setSocketNoDelay(int s);
+void setSocketBufferSize(int s, int size);
+bool secureStrEqual(const std::string &x, const std::string &y);
 
 struct TermSize {
     uint16_t cols;
@@ -38,11 +52,61 @@ struct TermSize {
     }
 };
 
+// A signal key typed into a multiplexed pty session (^C, ^\, or ^Z).  The
+// backend sends a SignalKeys packet whenever the set of keys the pty's line
+// discipline acts on changes (u.signalKeys has bit N set for TermSignal N).
+// The frontend sends only those keys as Signal packets, in the same stream
+// as the input around them, so the backend can signal the child's foreground
+// process group even when the child isn't reading; other keys stay in the
+// input.  If the child turned a key off before the packet arrived, the
+// backend puts the character back into the input, still in order.  Without
+// --mux, where the input has its own connection, every key stays in it.
+enum class TermSignal : int32_t {
+    Interrupt,
+    Quit,
+    Suspend,
+};
+
+const char kTermSignalChars[] = { '\x03', '\x1c', '\x1a' };
+
+// The byte streams carried between the frontend and the backend.  Without
+// multiplexing, each has its own socket.
+enum class Channel : int32_t {
+    Control,
+    Input,
+    Output,
+    Error,
+};
+
 struct WindowParams {
-    int32_t size;       // Maximum number of bytes in flight.
+    int32_t size;       // Initial number of bytes allowed in flight.
     int32_t threshold;  // Minimum remaining window to initiate I/O.
+    int32_t max;        // Ceiling the frontend may grow the window to.
 };
 
+// Sizes of the buffers each side reads data into.  Input is the frontend's
+// stdin heading to the child; output is the child's stdout/stderr.  On the
+// multiplexed connection, each read is still limited to one frame.
+struct BufferParams {
+    int32_t input;
+    int32_t output;
+};
+
+const int32_t kDefaultInputBufferSize = 8192;
+const int32_t kDefaultOutputBufferSize = 32 * 1024;
+const int32_t kMaxBufferSize = 1024 * 1024;
+// The buffer size for --bulk.
+const int32_t kBulkBufferSize = 1024 * 1024;
+
+// The stack reserved for each I/O thread.  Their buffers live on the heap, so
+// this is plenty, where the default is 8 MiB apiece on Linux.
+const size_t kIoThreadStackSize = 256 * 1024;
+
+// Bounds for --socket-buffer, the kernel send and receive buffer size of each
+// connection.  By default, each OS picks its own.
+const int32_t kMinSocketBufferSize = 4096;
+const int32_t kMaxSocketBufferSize = 64 * 1024 * 1024;
+
 enum class BridgedErrno : int32_t {
     Success = 0,
     Unknown,
@@ -92,64 +156,717 @@ struct Packet {
         IncreaseWindow,
         SpawnFailed,
         ChildExitStatus,
-        CloseStdoutPipe
+        CloseStdoutPipe,
+        RequestStats,
+        Stats,
+        DaemonListening,
+        KeyAccepted,
+        SpawnRequest,
+        BackendPath,
+        StartupTrace,
+        Hello,
+        Signal,
+        SpawnParams,
+        Ping,
+        Pong,
+        TransferInfo,
+        TransferStart,
+        TransferFailed,
+        TransferDone,
+        SignalKeys,
     } type;
     union {
         TermSize termSize;
         struct {
             int32_t amount;
-            bool isErrorPipe;
+            Channel channel;
         } window;
         int32_t exitStatus;
         SpawnError spawnError;
+        int32_t daemonPort;
+        uint32_t argCount;
+        struct {
+            uint32_t protocol;
+            uint32_t capabilities;
+        } hello;
+        TermSignal termSignal;
+        uint32_t signalKeys;
+        struct {
+            uint32_t envCount;
+            TermSize termSize;
+        } spawnParams;
+        // The backend answers a Ping with a Pong carrying the same values.
+        // sentMicros is the low 32 bits of the frontend's steady clock.
+        struct {
+            uint32_t seq;
+            uint32_t sentMicros;
+        } ping;
+        // TransferInfo carries the file's size, and TransferStart the
+        // offset to send it from, split so the union stays 4-byte aligned.
+        // The receiver's TransferStart also has the checksum to compare.
+        struct {
+            uint32_t low;
+            uint32_t high;
+            uint32_t checksum;
+        } transferOffset;
+        BridgedError transferError;
     } u;
 };
 
+// The two sides agree on a protocol rather than on a release.  The frontend
+// passes its protocol version and capabilities to the backend with
+// --check-version=VERSION/PROTOCOL/CAPS, and the backend's first control
+// packet is a Hello with its own version and the capabilities both sides
+// have.  Optional packets are only sent when both sides understand them.
+// Protocol 2 added --spawn-params, and protocol 3 --send-file and
+// --receive-file.
+const uint32_t kProtocolVersion = 3;
+const uint32_t kMinProtocolVersion = 1;
+
+// Bits 0, 1, 2, and 6 are unused.  Options like --mux and --compress are
+// selected on the backend's command line, which every backend taking
+// --check-version understands, so they need no capability.
+const uint32_t kCapStats            = 1u << 3;
+const uint32_t kCapStartupTrace     = 1u << 4;
+const uint32_t kCapBackendPath      = 1u << 5;
+const uint32_t kCapSignal           = 1u << 7;
+const uint32_t kCapPing             = 1u << 8;
+const uint32_t kCapSignalKeys       = 1u << 9;
+const uint32_t kCapabilities        = kCapStats | kCapStartupTrace | kCapBackendPath |
+                                      kCapSignal | kCapPing | kCapSignalKeys;
+
+// A persistent backend (--daemon) runs a session for each frontend that
+// connects to its port, sends the key, and receives KeyAccepted.  The
+// frontend then sends a SpawnRequest in place of the backend's command line:
+// argCount NUL-terminated arguments follow the packet, and size covers them.
+// The session then proceeds as with --mux.
+const uint32_t kMaxSpawnRequestSize = 256 * 1024;
+
+// A daemon started with --pool keeps up to kMaxPoolSize sessions ready, and
+// lets them go after --pool-idle seconds without a launch.
+const int kMaxPoolSize = 64;
+const int kDefaultPoolIdleSeconds = 600;
+
+// With --spawn-params, the child's cwd, environment, and command line come
+// in a SpawnParams packet, sent as soon as the control connection is
+// authenticated, rather than on the backend command line, which Windows
+// limits to 32K characters.  The cwd (possibly empty), envCount VAR=value
+// settings, and the arguments follow the packet as NUL-terminated strings,
+// and size covers them.  An empty command line runs the user's shell.
+
+// A backend started with --send-file or --receive-file (the frontend's
+// --pull and --push) moves one file instead of running a child.  The
+// sender's TransferInfo gives the file's size, and the receiver answers with
+// a TransferStart giving the offset it wants the file from: zero, or with
+// --resume, the length it already has, along with the transferChecksum of
+// what it has before that offset.  The sender replies with a TransferStart
+// of its own: the same offset if the checksum matches its file, or zero.
+// The rest of the file is cut into
+// kTransferChunkSize chunks, and data connection k of --streams=N carries
+// chunks k, k + N, k + 2N, ... raw and in order.  The receiver writes the
+// chunks in file order, so an interrupted transfer leaves a prefix of the
+// file for --resume to continue.  A backend that can't open its file sends
+// a TransferFailed instead.  Each data connection sends its index, as a
+// uint32_t, after the key.  A receiving backend sends TransferDone once
+// the file is written; either way, the backend exits when the frontend
+// closes the control connection.
+const uint32_t kTransferChunkSize = 4 * 1024 * 1024;
+const int kDefaultTransferStreams = 4;
+const int kMaxTransferStreams = 16;
+
+// A checksum of the up to kTransferChunkSize bytes of fd before offset (0 if
+// offset is 0).  Returns false if they can't be read.
+bool transferChecksum(int fd, uint64_t offset, uint32_t &checksum);
+
+// Packets ending in an array are variable-length: their size covers only the
+// part of the array in use, and the reader zeroes the rest.
+template <typename P, typename E, size_t N>
+uint32_t trimmedPacketSize(const P &, const E (&)[N], size_t used) {
+    assert(used <= N);
+    return sizeof(P) - sizeof(E[N]) + used * sizeof(E);
+}
+
 struct PacketSpawnFailed : Packet {
     char exe[1024];
 };
 
-class WakeupFd {
+// Sent by a backend started with --report-path: its own WSL path, which the
+// frontend caches to skip the wslpath lookup next time.
+struct PacketBackendPath : Packet {
+    char path[1024];
+};
+
+// Counters for one data channel, as sent in a Stats packet.  Each side fills
+// in the fields that apply to it.  Times are in microseconds.
+struct ChannelStats {
+    uint64_t bytes;
+    uint64_t reads;
+    uint64_t writes;
+    uint64_t writeTime;     // Blocked writing to the destination.
+    uint64_t stalls;        // Waits for window credit...
+    uint64_t stallTime;     // ...and the time spent in them.
+    uint64_t ackWaits;      // IncreaseWindow packets sent to a stalled sender...
+    uint64_t ackWaitTime;   // ...and the time until its data arrived.
+};
+
+// The data channels, in Channel order starting at Input.
+const int kDataChannelCount = 3;
+
+inline int dataChannelIndex(Channel channel) {
+    assert(channel != Channel::Control);
+    return static_cast<int>(channel) - static_cast<int>(Channel::Input);
+}
+
+// Usage of a side's BufferPool.
+struct PoolStats {
+    uint64_t blockSize;
+    uint64_t acquires;      // Blocks handed out...
+    uint64_t inUse;         // ...and lent out now...
+    uint64_t highWater;     // ...and the most lent out at once.
+};
+
+// The backend's reply to RequestStats.  A backend from before the pool
+// existed sends a shorter packet, and pool reads as zeros.
+struct PacketStats : Packet {
+    uint32_t reserved;  // Aligns channels the same way for 32-bit frontends.
+    ChannelStats channels[kDataChannelCount];
+    PoolStats pool;
+};
+
+// --trace-startup times each phase of starting a session.  Times come from
+// the system clock, which WSL shares with Windows, in microseconds since the
+// epoch, so the two sides' timelines line up.
+struct TraceEvent {
+    char name[36];
+    uint32_t thread;    // Chosen by the recording side; 0 is its main thread.
+    int64_t start;
+    int64_t duration;   // 0 for an instant.
+};
+
+const int kMaxTraceEvents = 24;
+
+int64_t traceClockMicros();
+
+// The backend's phases, sent once its I/O is running.
+struct PacketStartupTrace : Packet {
+    uint32_t count;     // Also aligns events the same way for 32-bit frontends.
+    TraceEvent events[kMaxTraceEvents];
+};
+
+// Collects TraceEvents from any thread.
+class StartupTrace {
 public:
-    WakeupFd();
-    ~WakeupFd() {
-        close(fds_[0]);
-        close(fds_[1]);
+    void add(const char *name, int64_t start, int64_t end, uint32_t thread = 0);
+    void mark(const char *name, uint32_t thread = 0) {
+        const int64_t now = traceClockMicros();
+        add(name, now, now, thread);
+    }
+    std::vector<TraceEvent> events() const;
+
+private:
+    mutable std::mutex mutex_;
+    std::vector<TraceEvent> events_;
+};
+
+inline Packet transferOffsetPacket(Packet::Type type, uint64_t offset,
+                                   uint32_t checksum = 0) {
+    Packet p = { sizeof(Packet), type };
+    p.u.transferOffset.low = static_cast<uint32_t>(offset);
+    p.u.transferOffset.high = static_cast<uint32_t>(offset >> 32);
+    p.u.transferOffset.checksum = checksum;
+    return p;
+}
+
+inline uint64_t transferOffset(const Packet &p) {
+    return p.u.transferOffset.low |
+        static_cast<uint64_t>(p.u.transferOffset.high) << 32;
+}
+
+// The chunks of [start, size) that a transfer's connections carry.
+struct TransferLayout {
+    uint64_t start;
+    uint64_t size;
+    int streams;
+
+    uint64_t chunkCount() const {
+        return (size - start + kTransferChunkSize - 1) / kTransferChunkSize;
+    }
+    uint64_t chunkOffset(uint64_t chunk) const {
+        return start + chunk * kTransferChunkSize;
+    }
+    size_t chunkSize(uint64_t chunk) const {
+        const uint64_t left = size - chunkOffset(chunk);
+        return left < kTransferChunkSize ? left : kTransferChunkSize;
+    }
+};
+
+// Lets a transfer's receiving threads write their chunks in file order.
+class TransferTurns {
+public:
+    void wait(uint64_t chunk) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait(lock, [&]() { return next_ == chunk; });
+    }
+    void finish(uint64_t chunk) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        assert(next_ == chunk);
+        next_ = chunk + 1;
+        cv_.notify_all();
+    }
+
+private:
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    uint64_t next_ = 0;
+};
+
+// Room for a packet of any type.
+union AnyPacket {
+    Packet base;
+    PacketSpawnFailed spawnFailed;
+    PacketBackendPath backendPath;
+    PacketStats stats;
+    PacketStartupTrace startupTrace;
+};
+
+// Copies a received packet of the given size, zeroing whatever a shorter
+// packet leaves out.  Returns false if the size is invalid.
+inline bool copyPacket(AnyPacket &dst, const char *src, size_t size) {
+    if (size < sizeof(Packet) || size > sizeof(dst)) {
+        return false;
+    }
+    memcpy(&dst, src, size);
+    memset(reinterpret_cast<char*>(&dst) + size, 0, sizeof(dst) - size);
+    return dst.base.size == size;
+}
+
+// The live version of ChannelStats.  The thread doing a channel's I/O updates
+// it with relaxed atomic adds, and a snapshot can be taken at any time.
+class ChannelCounters {
+public:
+    void countRead(size_t bytes) {
+        add(bytes_, bytes);
+        add(reads_, 1);
+    }
+    void countWrite() { add(writes_, 1); }
+    void addWriteTime(uint64_t us) { add(writeTime_, us); }
+    void addStall(uint64_t us) {
+        add(stalls_, 1);
+        add(stallTime_, us);
+    }
+    void addAckWait(uint64_t us) {
+        add(ackWaits_, 1);
+        add(ackWaitTime_, us);
+    }
+    ChannelStats snapshot() const;
+
+private:
+    static void add(std::atomic<uint64_t> &counter, uint64_t amount) {
+        counter.fetch_add(amount, std::memory_order_relaxed);
+    }
+
+    std::atomic<uint64_t> bytes_ = {0};
+    std::atomic<uint64_t> reads_ = {0};
+    std::atomic<uint64_t> writes_ = {0};
+    std::atomic<uint64_t> writeTime_ = {0};
+    std::atomic<uint64_t> stalls_ = {0};
+    std::atomic<uint64_t> stallTime_ = {0};
+    std::atomic<uint64_t> ackWaits_ = {0};
+    std::atomic<uint64_t> ackWaitTime_ = {0};
+};
+
+// In multiplexed mode (--mux), every channel shares one connection, and each
+// message on it is a frame.  A Control frame carries one Packet.  Any other
+// frame carries stream data, and an empty one signals EOF on its channel.
+struct FrameHeader {
+    uint32_t size;      // Payload size, excluding this header.
+    Channel channel;
+};
+
+const uint32_t kMaxFramePayload = 64 * 1024;
+
+// With --multi, one connection carries many sessions.  A frame's channel
+// holds the session number above kSessionShift and the Channel below it.
+// Session 0 is the connection itself.  A session's Control frames carry its
+// SpawnRequest, IncreaseWindow, SpawnFailed, and ChildExitStatus packets.
+const int kSessionShift = 8;
+
+inline Channel sessionChannel(uint32_t session, Channel channel) {
+    return static_cast<Channel>(
+        (session << kSessionShift) | static_cast<uint32_t>(channel));
+}
+
+inline uint32_t channelSession(Channel channel) {
+    return static_cast<uint32_t>(channel) >> kSessionShift;
+}
+
+inline Channel baseChannel(Channel channel) {
+    return static_cast<Channel>(
+        static_cast<uint32_t>(channel) & ((1u << kSessionShift) - 1));
+}
+
+// Writes frames to the multiplexed connection.  Writes from different threads
+// are serialized, so frames never interleave.
+class MuxSocket {
+public:
+    explicit MuxSocket(int fd) : fd_(fd) {}
+    int fd() const { return fd_; }
+
+    // The payload starts sizeof(FrameHeader) bytes into buf; the header is
+    // filled in here, so the frame goes out in a single write.
+    bool writeFrame(Channel channel, char *buf, size_t payloadSize);
+    bool writePacket(const Packet &p);
+    // Writes several control packets with a single write.
+    bool writePackets(const Packet *packets, size_t count);
+    bool writeEof(Channel channel);
+
+private:
+    std::mutex mutex_;
+    int fd_;
+};
+
+// Send-side flow control for one channel.  The sending thread keeps its
+// remaining credit in a local variable, and the thread that reads
+// IncreaseWindow packets hands back more credit through increase().  The
+// returned credit is a plain atomic counter.  On Linux, a sender that runs
+// out of credit sleeps on that counter with a futex, and increase() only
+// makes a syscall when a sender is actually asleep.
+class ChannelWindow {
+public:
+    void increase(int32_t amount, int32_t max);
+
+    // Adds any returned credit to locWindow, blocking until locWindow reaches
+    // the window threshold.  Time spent blocked is added to counters.
+    void wait(int32_t &locWindow, const WindowParams &params,
+              ChannelCounters *counters = nullptr);
+
+private:
+    std::atomic<int32_t> increaseAmt_ = {0};
+#if defined(__linux__)
+    // While the sender sleeps, the credit it needs to reach the threshold.
+    std::atomic<int32_t> needed_ = {0};
+#else
+    std::mutex mutex_;
+    std::condition_variable increaseCV_;
+#endif
+};
+
+// Fixed-size blocks shared by every channel of a connection.  A channel
+// borrows blocks only while its data is in flight, so memory follows the
+// data actually queued rather than each channel's largest window.  A few
+// returned blocks are kept for reuse, so steady traffic doesn't go through
+// malloc.
+class BufferPool {
+public:
+    static const size_t kBlockSize = 64 * 1024;
+    static const size_t kMaxFreeBlocks = 4;
+
+    // Owns one block and gives it back to the pool when destroyed, so a
+    // block moves between threads by handle.
+    class Block {
+    public:
+        Block() {}
+        Block(Block &&other) : pool_(other.pool_), data_(other.data_) {
+            other.data_ = nullptr;
+        }
+        Block &operator=(Block &&other) {
+            reset();
+            pool_ = other.pool_;
+            data_ = other.data_;
+            other.data_ = nullptr;
+            return *this;
+        }
+        ~Block() { reset(); }
+
+        char *data() const { return data_; }
+        void reset();
+
+    private:
+        friend class BufferPool;
+        Block(BufferPool *pool, char *data) : pool_(pool), data_(data) {}
+
+        BufferPool *pool_ = nullptr;
+        char *data_ = nullptr;
+    };
+
+    // Part of a block: the data in [begin, end).
+    struct Chunk {
+        Block block;
+        size_t begin = 0;
+        size_t end = 0;
+
+        const char *data() const { return block.data() + begin; }
+        size_t size() const { return end - begin; }
+    };
+
+    BufferPool() {}
+    BufferPool(const BufferPool&) = delete;
+    BufferPool &operator=(const BufferPool&) = delete;
+    ~BufferPool();
+
+    Block acquire();
+    PoolStats stats();
+
+private:
+    void release(char *data);
+
+    std::mutex mutex_;
+    std::vector<char*> free_;
+    uint64_t acquires_ = 0;
+    uint64_t inUse_ = 0;
+    uint64_t highWater_ = 0;
+};
+
+// Data demultiplexed from the multiplexed connection, waiting for a channel's
+// I/O thread, in blocks borrowed from the connection's pool.  The channel's
+// window bounds the amount queued, so push never blocks the thread reading
+// the connection.
+class ChannelQueue {
+public:
+    explicit ChannelQueue(BufferPool &pool) : pool_(pool) {}
+
+    void push(const char *data, size_t size);
+    void close();
+
+    // Drop queued and future data.  Used once the consumer has failed.
+    void discard();
+
+    // Blocks until data is available.  Returns 0 at EOF.
+    size_t pop(char *buf, size_t size);
+
+    // Blocks until data is available and hands over the oldest queued
+    // chunk without copying it.  Returns false at EOF.
+    bool popChunk(BufferPool::Chunk &chunk);
+
+    // Waits up to timeout for data or EOF; returns true if pop won't block.
+    bool waitFor(std::chrono::microseconds timeout);
+
+private:
+    BufferPool &pool_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<BufferPool::Chunk> chunks_;
+    bool closed_ = false;
+    bool discarding_ = false;
+};
+
+// A byte queue for non-blocking I/O.  Reads land directly in the free space
+// and writes drain the queued bytes, each with one readv or writev over the
+// (at most two) contiguous pieces of the ring, so a partly drained buffer is
+// never compacted.  The ring only grows when it fills up.
+class ByteRing {
+public:
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+    void clear() { head_ = size_ = 0; }
+
+    void append(const void *data, size_t size);
+    // Replaces queued bytes, starting offset bytes from the front.
+    void overwrite(size_t offset, const void *data, size_t size);
+    // Drops bytes from the back, leaving size bytes queued.
+    void truncate(size_t size);
+    void consume(size_t size);
+
+    // Appends up to max bytes read from fd, returning read's result.
+    ssize_t readFrom(int fd, size_t max);
+    // Writes and consumes as much as fd accepts, returning write's result.
+    ssize_t writeTo(int fd);
+
+private:
+    void reserve(size_t extra);
+    size_t index(size_t offset) const { return (head_ + offset) % buf_.size(); }
+
+    std::vector<char> buf_;
+    size_t head_ = 0;
+    size_t size_ = 0;
+};
+
+// A bounded queue between one producer thread and one consumer thread.  The
+// positions are published with atomics, so neither side takes a lock while
+// the ring is neither full nor empty.  A side that must wait sleeps on a
+// condition variable, and the other side only locks to wake it.
+class SpscRing {
+public:
+    // The buffer is left uninitialized, so a large ring's pages are only
+    // committed as output passes through them.
+    explicit SpscRing(size_t capacity) :
+        buf_(new char[capacity]), capacity_(capacity) {}
+
+    // Producer: copies data in, waiting for room as needed.  Returns false
+    // once the consumer has failed.
+    bool push(const char *data, size_t size);
+    // Producer: no more data is coming.
+    void close();
+
+    // Consumer: waits for data and points at the next contiguous piece.
+    // Returns 0 once the ring is closed and empty.
+    size_t peek(const char *&data);
+    void consume(size_t size);
+    // Consumer: how much is waiting, in every piece.
+    size_t queued() const {
+        return tail_.load() - head_.load(std::memory_order_relaxed);
     }
+    size_t capacity() const { return capacity_; }
+    // The totals of bytes pushed and consumed so far.
+    uint64_t pushed() const { return tail_.load(); }
+    uint64_t consumed() const { return head_.load(); }
+    // Consumer: stop accepting data.
+    void fail();
+
+private:
+    template <typename Pred> void waitFor(Pred ready);
+    void wake();
 
-    void set() {
-        char dummy = 0;
-        writeRestarting(fds_[1], &dummy, 1);
+    std::unique_ptr<char[]> buf_;
+    const size_t capacity_;
+    std::atomic<uint64_t> head_ = {0};      // Total bytes consumed.
+    std::atomic<uint64_t> tail_ = {0};      // Total bytes pushed.
+    std::atomic<bool> closed_ = {false};
+    std::atomic<bool> failed_ = {false};
+    std::atomic<int> waiters_ = {0};
+    std::mutex mutex_;
+    std::condition_variable cv_;
+};
+
+// A thread like std::thread, but started with a kIoThreadStackSize stack.
+// Dropping a thread without joining it leaves it running.
+class IoThread {
+public:
+    template <typename F, typename... Args>
+    explicit IoThread(F &&func, Args &&...args) {
+        start(std::bind(std::forward<F>(func), std::forward<Args>(args)...));
     }
+    IoThread(const IoThread&) = delete;
+    IoThread &operator=(const IoThread&) = delete;
 
-    void wait();
+    pthread_t native_handle() const { return thread_; }
+    bool joinable() const { return joinable_; }
+    void join();
+    void detach();
 
 private:
-    int readFd() const { return fds_[0]; }
+    void start(std::function<void()> func);
 
-    fd_set fdset_;
-    int fds_[2];
+    pthread_t thread_;
+    bool joinable_ = false;
+};
+
+// Why a WakeupFd was set.  Events accumulate until the waiter takes them,
+// so a burst of sets costs the waiter one wakeup.
+enum WakeupEvent : uint32_t {
+    kWakeupResize = 1u << 0,
+    kWakeupChildExit = 1u << 1,
+    kWakeupIoFinished = 1u << 2,
+    kWakeupStatsRequested = 1u << 3,
+    kWakeupStatsReceived = 1u << 4,
+};
+
+// Wakes one waiting thread, from another thread or a signal handler.  On
+// Linux, it's an eventfd that a poll or epoll loop can watch; elsewhere
+// (i.e. Cygwin) it's a POSIX semaphore, which Cygwin builds on a Windows
+// semaphore.  Only the first set() after the waiter took the events makes a
+// system call.
+class WakeupFd {
+public:
+    WakeupFd();
+    ~WakeupFd();
+
+    // Async-signal-safe.
+    void set(uint32_t events);
+
+    // Blocks until set and returns the events.
+    uint32_t wait();
+    // Returns 0 if the timeout passed first.
+    uint32_t waitFor(std::chrono::microseconds timeout);
+
+#if defined(__linux__)
+    // For callers that poll the wakeup themselves: drain() takes the pending
+    // events without blocking.
+    int readFd() const { return fd_; }
+    uint32_t drain();
+#endif
+
+private:
+    std::atomic<uint32_t> events_ = {0};
+#if defined(__linux__)
+    int fd_;
+#else
+    sem_t sem_;
+#endif
+};
+
+// Reads a blocking socket a buffer at a time and hands out the messages in
+// it, so a burst of small packets or frames costs one read() rather than two
+// apiece.
+class StreamReader {
+public:
+    StreamReader(int fd, size_t capacity) : fd_(fd), buf_(capacity) {}
+    // Returns the next size bytes, which stay valid until the next call, or
+    // nullptr if the stream ends first.
+    const char *next(size_t size);
+
+private:
+    int fd_;
+    std::vector<char> buf_;
+    size_t start_ = 0;
+    size_t end_ = 0;
 };
 
 template <typename T, void packetHandlerFunc(T*, const Packet&), void readFailure()>
 void readControlSocketThread(int controlSocketFd, T *userObj) {
-    union {
-        Packet base;
-        PacketSpawnFailed spawnFailed;
-    } packet = {};
+    AnyPacket packet = {};
+    StreamReader reader(controlSocketFd, 16 * sizeof(AnyPacket));
     while (true) {
-        if (!readAllRestarting(controlSocketFd, &packet.base,
-                               sizeof(packet.base))) {
+        Packet header = {};
+        const char *p = reader.next(sizeof(header));
+        if (p == nullptr) {
             readFailure();
         }
-        if (packet.base.size < sizeof(Packet) ||
-                packet.base.size > sizeof(packet)) {
+        memcpy(&header, p, sizeof(header));
+        if (header.size < sizeof(Packet) || header.size > sizeof(packet)) {
             readFailure();
         }
-        if (!readAllRestarting(controlSocketFd, &packet.base + 1,
-                               packet.base.size - sizeof(packet.base))) {
+        const char *rest = reader.next(header.size - sizeof(header));
+        if (rest == nullptr) {
             readFailure();
         }
+        memcpy(&packet, &header, sizeof(header));
+        memcpy(reinterpret_cast<char*>(&packet) + sizeof(header), rest,
+               header.size - sizeof(header));
+        memset(reinterpret_cast<char*>(&packet) + header.size, 0,
+               sizeof(packet) - header.size);
         packetHandlerFunc(userObj, packet.base);
     }
 }
+
+template <typename T,
+          void packetHandlerFunc(T*, const Packet&),
+          void dataHandlerFunc(T*, Channel, const char*, size_t),
+          void readFailure()>
+void readMuxSocketThread(int muxSocketFd, T *userObj) {
+    AnyPacket packet = {};
+    StreamReader reader(muxSocketFd, 2 * (sizeof(FrameHeader) + kMaxFramePayload));
+    while (true) {
+        FrameHeader header = {};
+        const char *h = reader.next(sizeof(header));
+        if (h == nullptr) {
+            readFailure();
+        }
+        memcpy(&header, h, sizeof(header));
+        if (header.size > kMaxFramePayload) {
+            readFailure();
+        }
+        const char *payload = reader.next(header.size);
+        if (payload == nullptr) {
+            readFailure();
+        }
+        if (header.channel == Channel::Control) {
+            if (!copyPacket(packet, payload, header.size)) {
+                readFailure();
+            }
+            packetHandlerFunc(userObj, packet.base);
+        } else {
+            dataHandlerFunc(userObj, header.channel, payload, header.size);
+        }
+    }
+}
@@ -3,6 +3,7 @@
 #include <arpa/inet.h>
 #include <assert.h>
 #include <ctype.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
 #include <locale.h>
@@ -16,6 +17,7 @@
 #include <sys/cygwin.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <termios.h>
 #include <unistd.h>
@@ -24,6 +26,10 @@
 #include <algorithm>
 #include <array>
 #include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <fstream>
+#include <map>
 #include <memory>
 #include <mutex>
 #include <sstream>
@@ -32,6 +38,7 @@
 #include <utility>
 #include <vector>
 
+#include "../common/Compress.h"
 #include "../common/SocketIo.h"
 
 #define BACKEND_PROGRAM "wslbridge-backend"
@@ -42,7 +49,13 @@ extern "C" BOOLEAN WINAPI SystemFunction036(PVOID, ULONG);
 
 namespace {
 
-const int32_t kOutputWindowSize = 8192;
+const int32_t kDefaultWindowSize = 8192;
+const int32_t kMaxWindowSize = 256 * 1024 * 1024;
+// The default window for --bulk, enough to keep several of its buffers in
+// flight.
+const int32_t kBulkWindowSize = 4 * kBulkBufferSize;
+const size_t kDefaultCoalesceBytes = 64 * 1024;
+const size_t kMaxCoalesceBytes = 16 * 1024 * 1024;
 
 static WakeupFd *g_wakeupFd = nullptr;
 
@@ -57,7 +70,8 @@ static TermSize terminalSize() {
 
 class Socket {
 public:
-    Socket();
+    // backlog is how many connections can wait to be accepted.
+    explicit Socket(int bufferSize = 0, int backlog = 1);
     ~Socket() { close(); }
     int port() { return port_; }
     int accept();
@@ -68,11 +82,13 @@ private:
     int port_;
 };
 
-Socket::Socket() {
+Socket::Socket(int bufferSize, int backlog) {
     s_ = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
     assert(s_ >= 0);
 
     setSocketNoDelay(s_);
+    // Accepted connections inherit the listening socket's buffer sizes.
+    setSocketBufferSize(s_, bufferSize);
 
     sockaddr_in addr = {};
     addr.sin_family = AF_INET;
@@ -81,7 +97,7 @@ Socket::Socket() {
     const int bindRet = bind(s_, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr));
     assert(bindRet == 0);
 
-    const int listenRet = listen(s_, 1);
+    const int listenRet = listen(s_, backlog);
     assert(listenRet == 0);
 
     socklen_t addrLen = sizeof(addr);
@@ -118,326 +134,2517 @@ static std::string randomString() {
     return out;
 }
 
+// Both conversions make one pass into a buffer sized for the worst case: a
+// wide string never has more units than the multibyte one has bytes, and a
+// unit never takes more than MB_CUR_MAX bytes.
 static std::wstring mbsToWcs(const std::string &s) {
-    const size_t len = mbstowcs(nullptr, s.c_str(), 0);
+    std::wstring ret;
+    ret.resize(s.size());
+    const size_t len = mbstowcs(&ret[0], s.c_str(), ret.size());
     if (len == static_cast<size_t>(-1)) {
         fatal("error: mbsToWcs: invalid string\n");
     }
-    std::wstring ret;
     ret.resize(len);
-    const size_t len2 = mbstowcs(&ret[0], s.c_str(), len);
-    assert(len == len2);
     return ret;
 }
 
 static std::string wcsToMbs(const std::wstring &s, bool emptyOnError=false) {
-    const size_t len = wcstombs(nullptr, s.c_str(), 0);
+    std::string ret;
+    ret.resize(s.size() * MB_CUR_MAX);
+    const size_t len = wcstombs(&ret[0], s.c_str(), ret.size());
     if (len == static_cast<size_t>(-1)) {
         if (emptyOnError) {
             return {};
         }
         fatal("error: wcsToMbs: invalid string\n");
     }
-    std::string ret;
     ret.resize(len);
-    const size_t len2 = wcstombs(&ret[0], s.c_str(), len);
-    assert(len == len2);
     return ret;
 }
 
-// As long as clients only get one chance to provide a key, this function
-// should be unnecessary.
-static bool secureStrEqual(const std::string &x, const std::string &y) {
-    if (x.size() != y.size()) {
-        return false;
+static int acceptClientAndAuthenticate(Socket &socket, const std::string &key) {
+    const int cs = socket.accept();
+    std::string checkBuf;
+    checkBuf.resize(key.size());
+    size_t i = 0;
+    while (i < checkBuf.size()) {
+        const size_t remaining = checkBuf.size() - i;
+        const ssize_t actual = read(cs, &checkBuf[i], remaining);
+        assert(actual > 0 && static_cast<size_t>(actual) <= remaining);
+        i += actual;
+    }
+    if (!secureStrEqual(checkBuf, key)) {
+        fatal("error: key check failed\n");
+    }
+    return cs;
+}
+
+class TerminalState {
+private:
+    std::mutex mutex_;
+    bool inRawMode_ = false;
+    bool modeValid_[2] = {false, false};
+    termios mode_[2] = {};
+
+public:
+    void enterRawMode();
+
+private:
+    void leaveRawMode(const std::lock_guard<std::mutex> &lock);
+
+public:
+    void fatal(const char *fmt, ...)
+        __attribute__((noreturn))
+        __attribute__((format(printf, 2, 3)));
+    void fatalv(const char *fmt, va_list ap) __attribute__((noreturn));
+    void exitCleanly(int exitStatus);
+};
+
+// Put the input terminal into non-canonical mode.
+void TerminalState::enterRawMode() {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    assert(!inRawMode_);
+    inRawMode_ = true;
+
+    for (int i = 0; i < 2; ++i) {
+        if (!isatty(i)) {
+            modeValid_[i] = false;
+        } else {
+            if (tcgetattr(i, &mode_[i]) < 0) {
+                fatalPerror("tcgetattr failed");
+            }
+            modeValid_[i] = true;
+        }
+    }
+
+    if (modeValid_[0]) {
+        termios buf;
+        if (tcgetattr(0, &buf) < 0) {
+            fatalPerror("tcgetattr failed");
+        }
+        buf.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
+        buf.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
+        buf.c_cflag &= ~(CSIZE | PARENB);
+        buf.c_cflag |= CS8;
+        buf.c_cc[VMIN] = 1;  // blocking read
+        buf.c_cc[VTIME] = 0;
+        if (tcsetattr(0, TCSAFLUSH, &buf) < 0) {
+            fatalPerror("tcsetattr failed");
+        }
+    }
+
+    if (modeValid_[1]) {
+        termios buf;
+        if (tcgetattr(1, &buf) < 0) {
+            fatalPerror("tcgetattr failed");
+        }
+        buf.c_cflag &= ~(CSIZE | PARENB);
+        buf.c_cflag |= CS8;
+        buf.c_oflag &= ~OPOST;
+        if (tcsetattr(1, TCSAFLUSH, &buf) < 0) {
+            fatalPerror("tcsetattr failed");
+        }
+    }
+}
+
+void TerminalState::leaveRawMode(const std::lock_guard<std::mutex> &lock) {
+    if (!inRawMode_) {
+        return;
+    }
+    for (int i = 0; i < 2; ++i) {
+        if (modeValid_[i]) {
+            if (tcsetattr(i, TCSAFLUSH, &mode_[i]) < 0) {
+                fatalPerror("error restoring terminal mode");
+            }
+        }
+    }
+}
+
+// This function cannot be used from a signal handler.
+void TerminalState::fatal(const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    this->fatalv(fmt, ap);
+    va_end(ap);
+}
+
+void TerminalState::fatalv(const char *fmt, va_list ap) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    leaveRawMode(lock);
+    ::fatalv(fmt, ap);
+}
+
+void TerminalState::exitCleanly(int exitStatus) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    leaveRawMode(lock);
+    fflush(stdout);
+    fflush(stderr);
+    // Avoid calling exit, which would call global destructors and destruct the
+    // WakeupFd object.
+    _exit(exitStatus);
+}
+
+static TerminalState g_terminalState;
+
+// Remembers the backend's WSL path, per Windows path and distribution, so
+// that starting the backend doesn't need a wslpath subshell each time.
+class BackendPathCache {
+public:
+    BackendPathCache(const std::string &distroGuid, const std::wstring &backendPathWin);
+    // Returns an empty string if the path isn't cached.
+    std::string lookup() const;
+    void store(const std::string &wslPath) const;
+    void clear() const { unlink(file_.c_str()); }
+
+private:
+    std::string file_;
+    std::string backendPathWin_;
+};
+
+BackendPathCache::BackendPathCache(const std::string &distroGuid,
+                                   const std::wstring &backendPathWin) :
+        backendPathWin_(wcsToMbs(backendPathWin)) {
+    const char *home = getenv("HOME");
+    file_ = home && *home ? home : "/tmp";
+    file_.append("/.wslbridge-backend-path");
+    if (!distroGuid.empty()) {
+        file_.append("-" + distroGuid);
+    }
+}
+
+std::string BackendPathCache::lookup() const {
+    std::ifstream in(file_);
+    std::string winPath;
+    std::string wslPath;
+    if (!std::getline(in, winPath) || !std::getline(in, wslPath) ||
+            winPath != backendPathWin_) {
+        return {};
+    }
+    return wslPath;
+}
+
+void BackendPathCache::store(const std::string &wslPath) const {
+    std::ofstream out(file_, std::ios::trunc);
+    out << backendPathWin_ << "\n" << wslPath << "\n";
+}
+
+// Set while the frontend is waiting for a --report-path backend.
+static BackendPathCache *g_backendPathCache = nullptr;
+
+// With --trace-startup, the phases of both sides, written out as Chrome
+// trace-event JSON when the session ends.
+struct StartupTimeline {
+    std::string path;
+    StartupTrace frontend;
+    StartupTrace backend;
+    std::atomic<bool> sawOutput = { false };
+
+    void markFirstOutput() {
+        if (!sawOutput.exchange(true)) {
+            frontend.mark("first output byte");
+        }
+    }
+    void write() const;
+};
+
+void StartupTimeline::write() const {
+    FILE *fp = fopen(path.c_str(), "w");
+    if (fp == nullptr) {
+        fprintf(stderr, "wslbridge warning: could not write '%s': %s\n",
+            path.c_str(), strerror(errno));
+        return;
+    }
+    const std::vector<TraceEvent> sides[] = { frontend.events(), backend.events() };
+    const char *const sideNames[] = { "wslbridge", "wslbridge-backend" };
+    int64_t base = INT64_MAX;
+    for (const auto &events : sides) {
+        for (const auto &event : events) {
+            base = std::min(base, event.start);
+        }
+    }
+    fprintf(fp, "{\"traceEvents\":[\n");
+    for (int pid = 0; pid < 2; ++pid) {
+        fprintf(fp, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+                    "\"args\":{\"name\":\"%s\"}}", pid + 1, sideNames[pid]);
+        for (const auto &event : sides[pid]) {
+            std::string name;
+            for (const char *ch = event.name; *ch != '\0'; ++ch) {
+                if (*ch == '"' || *ch == '\\') {
+                    name.push_back('\\');
+                }
+                name.push_back(*ch);
+            }
+            fprintf(fp, ",\n{\"name\":\"%s\",\"pid\":%d,\"tid\":%u,\"ts\":%lld,",
+                name.c_str(), pid + 1, event.thread + 1,
+                static_cast<long long>(event.start - base));
+            if (event.duration == 0) {
+                fprintf(fp, "\"ph\":\"i\",\"s\":\"p\"}");
+            } else {
+                fprintf(fp, "\"ph\":\"X\",\"dur\":%lld}",
+                    static_cast<long long>(event.duration));
+            }
+        }
+        fprintf(fp, pid == 0 ? ",\n" : "\n");
+    }
+    fprintf(fp, "]}\n");
+    fclose(fp);
+}
+
+static StartupTimeline *g_startupTimeline = nullptr;
+
+// --record logs the traffic at the frontend's end of the connection: every
+// packet in either direction, and each chunk of output as an output thread
+// receives it (after decompression).  The user's input isn't recorded.
+// --replay plays the received side back through the same I/O path.
+//
+// The file is a RecordingHeader followed by events, each a RecordHeader and
+// then `size` bytes of packet or data.
+struct RecordingHeader {
+    char magic[8];
+    uint32_t flags;
+    uint32_t reserved;
+};
+
+const char kRecordingMagic[8] = { 'W', 'S', 'L', 'B', 'R', 'E', 'C', '1' };
+const uint32_t kRecordingPty = 1;
+
+struct RecordHeader {
+    int64_t time;       // Microseconds since the recording started.
+    uint32_t size;      // 0 for the EOF of a data channel.
+    uint16_t channel;   // A Channel.
+    uint16_t sent;      // 1 for packets the frontend sent.
+};
+
+class SessionRecorder {
+public:
+    SessionRecorder(const std::string &path, bool usePty);
+    ~SessionRecorder() { fclose(fp_); }
+
+    void packet(const Packet &p, bool sent) {
+        add(Channel::Control, sent, &p, p.size);
+    }
+    void data(Channel channel, const char *data, size_t size) {
+        add(channel, false, data, size);
+    }
+    // The frontend exits with _exit, so this must be called first.
+    void flush();
+
+private:
+    void add(Channel channel, bool sent, const void *data, size_t size);
+
+    std::mutex mutex_;
+    FILE *fp_ = nullptr;
+    const int64_t start_;
+    bool failed_ = false;
+};
+
+SessionRecorder::SessionRecorder(const std::string &path, bool usePty) :
+        start_(traceClockMicros()) {
+    fp_ = fopen(path.c_str(), "wb");
+    if (fp_ == nullptr) {
+        fatal("error: could not create '%s': %s\n", path.c_str(), strerror(errno));
+    }
+    setvbuf(fp_, nullptr, _IOFBF, 256 * 1024);
+    RecordingHeader header = {};
+    memcpy(header.magic, kRecordingMagic, sizeof(header.magic));
+    header.flags = usePty ? kRecordingPty : 0;
+    fwrite(&header, sizeof(header), 1, fp_);
+}
+
+void SessionRecorder::add(Channel channel, bool sent, const void *data, size_t size) {
+    const RecordHeader header = {
+        traceClockMicros() - start_,
+        static_cast<uint32_t>(size),
+        static_cast<uint16_t>(channel),
+        static_cast<uint16_t>(sent),
+    };
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (fwrite(&header, sizeof(header), 1, fp_) != 1 ||
+            (size > 0 && fwrite(data, size, 1, fp_) != 1)) {
+        failed_ = true;
+    }
+}
+
+void SessionRecorder::flush() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (fflush(fp_) != 0 || failed_) {
+        fprintf(stderr, "wslbridge warning: the recording is incomplete\n");
+    }
+}
+
+static SessionRecorder *g_recorder = nullptr;
+
+// IncreaseWindow credit waiting to be sent for the stdout and stderr
+// channels.  The output threads add to it with atomic adds, so an ack never
+// waits on the other channel's thread.
+struct AckBatch {
+    std::atomic<int32_t> credit[2] = {{0}, {0}};
+    std::atomic<bool> flushing = {false};
+    std::atomic<bool> urgent = {false};
+    std::atomic<int64_t> lastFlush = {0};   // steady_clock microseconds
+
+    std::atomic<int32_t> &channelCredit(Channel channel) {
+        return credit[channel == Channel::Error ? 1 : 0];
+    }
+};
+
+const int kDefaultAckIntervalUs = 500;
+// The shortest time between SetSize packets (--resize-interval).
+const int kDefaultResizeIntervalUs = 50000;
+
+// Output coalescing (--coalesce).  An interval of zero disables it.
+struct CoalesceParams {
+    int interval = 0;   // Microseconds.
+    size_t bytes = kDefaultCoalesceBytes;
+};
+
+// The latest kLatencyWindow samples of one latency, for --stats.
+const size_t kLatencyWindow = 1024;
+
+class LatencyWindow {
+public:
+    void add(int64_t micros) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (samples_.size() < kLatencyWindow) {
+            samples_.push_back(micros);
+        } else {
+            samples_[count_ % kLatencyWindow] = micros;
+        }
+        ++count_;
+    }
+
+    // Returns the window's samples in milliseconds, sorted.  total is set to
+    // the number of samples ever added.
+    std::vector<double> sortedMillis(uint64_t &total) {
+        std::vector<double> ret;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            total = count_;
+            for (const int64_t micros : samples_) {
+                ret.push_back(micros / 1000.0);
+            }
+        }
+        std::sort(ret.begin(), ret.end());
+        return ret;
+    }
+
+private:
+    std::mutex mutex_;
+    std::vector<int64_t> samples_;
+    uint64_t count_ = 0;
+};
+
+struct IoLoop {
+    std::string spawnCwd;
+    bool usePty = false;
+    WindowParams windowParams = {};
+    BufferParams bufferParams = {};
+    // With --compress, stdout and stderr arrive as chunks (see ChunkHeader).
+    bool compress = false;
+    int ackIntervalUs = kDefaultAckIntervalUs;
+    CoalesceParams coalesce;
+    // With --skip-redraws, in a pty session (see RedrawSkipper).
+    bool skipRedraws = false;
+    AckBatch acks;
+    std::mutex mutex;
+    bool ioFinished = false;
+    int controlSocketFd = -1;
+    // Set in multiplexed mode, where controlSocketFd carries every channel.
+    std::unique_ptr<MuxSocket> mux;
+    ChannelWindow inputWindow;
+    BufferPool pool;
+    ChannelQueue outputQueue { pool };
+    ChannelQueue errorQueue { pool };
+    bool childReaped = false;
+    int childExitStatus = -1;
+    // With --stats, the I/O threads also time their writes and ack waits.
+    bool statsEnabled = false;
+    ChannelCounters counters[kDataChannelCount];
+    // The backend's latest reply to RequestStats, guarded by mutex.
+    bool backendStatsReceived = false;
+    PacketStats backendStats = {};
+    std::condition_variable backendStatsCV;
+    // The capabilities from the backend's Hello.
+    std::atomic<uint32_t> capabilities { 0 };
+    // The signal keys the backend's pty acts on, from its SignalKeys packets.
+    std::atomic<uint32_t> signalKeys { 0 };
+    // When the user last typed into a pty session, from steadyMicros().
+    std::atomic<int64_t> lastInput { 0 };
+    // With --stats, in a pty session, when the oldest keystroke still
+    // waiting for output was read, or 0.  The first output after it is taken
+    // to be its echo.
+    std::atomic<int64_t> echoPending { 0 };
+    // Round trips for --stats: Ping to Pong (--ping-interval), a keystroke
+    // to its echo arriving, and to the echo being written to the console.
+    LatencyWindow pingRtt;
+    LatencyWindow echoArrived;
+    LatencyWindow echoShown;
+};
+
+static void fatalConnectionBroken() {
+    if (g_recorder != nullptr) {
+        g_recorder->flush();
+    }
+    g_terminalState.fatal("\nwslbridge error: connection broken\n");
+}
+
+static void writePacket(IoLoop &ioloop, const Packet &p) {
+    assert(p.size >= sizeof(p));
+    if (g_recorder != nullptr) {
+        g_recorder->packet(p, true);
+    }
+    if (ioloop.mux) {
+        if (!ioloop.mux->writePacket(p)) {
+            fatalConnectionBroken();
+        }
+        return;
+    }
+    std::lock_guard<std::mutex> lock(ioloop.mutex);
+    if (!writeAllRestarting(ioloop.controlSocketFd,
+            reinterpret_cast<const char*>(&p), p.size)) {
+        fatalConnectionBroken();
+    }
+}
+
+// Writes several fixed-size packets with a single write.
+static void writePackets(IoLoop &ioloop, const Packet *packets, size_t count) {
+    if (g_recorder != nullptr) {
+        for (size_t i = 0; i < count; ++i) {
+            g_recorder->packet(packets[i], true);
+        }
+    }
+    if (ioloop.mux) {
+        if (!ioloop.mux->writePackets(packets, count)) {
+            fatalConnectionBroken();
+        }
+        return;
+    }
+    std::lock_guard<std::mutex> lock(ioloop.mutex);
+    if (!writeAllRestarting(ioloop.controlSocketFd,
+            reinterpret_cast<const char*>(packets), count * sizeof(Packet))) {
+        fatalConnectionBroken();
+    }
+}
+
+static int64_t steadyMicros() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Sends the pending credit for both output channels in one control write.
+// Unless the caller says a window is about to run dry, this happens at most
+// once per ack interval; deferred credit goes out with a later flush, which
+// the next read on that channel triggers.  If another thread is already
+// flushing, it picks up our credit instead.
+static void flushAcks(IoLoop &ioloop, bool urgent) {
+    AckBatch &acks = ioloop.acks;
+    if (acks.credit[0] == 0 && acks.credit[1] == 0) {
+        return;
+    }
+    if (!urgent && steadyMicros() - acks.lastFlush < ioloop.ackIntervalUs) {
+        return;
+    }
+    if (urgent) {
+        acks.urgent = true;
+    }
+    while (!acks.flushing.exchange(true)) {
+        acks.urgent = false;
+        std::array<Packet, 2> packets = {};
+        size_t count = 0;
+        for (const Channel channel : { Channel::Output, Channel::Error }) {
+            const int32_t amount = acks.channelCredit(channel).exchange(0);
+            if (amount > 0) {
+                Packet &p = packets[count++];
+                p.size = sizeof(Packet);
+                p.type = Packet::Type::IncreaseWindow;
+                p.u.window.amount = amount;
+                p.u.window.channel = channel;
+            }
+        }
+        if (count > 0) {
+            writePackets(ioloop, packets.data(), count);
+            acks.lastFlush = steadyMicros();
+        }
+        acks.flushing = false;
+        // Another thread may have added urgent credit while we were writing.
+        if (!acks.urgent) {
+            break;
+        }
+    }
+}
+
+// Input sent over the multiplexed connection.  It needs its own window, because
+// the backend must never block the connection waiting for the child to read.
+static WindowParams inputWindowParams(const WindowParams &params) {
+    return WindowParams { params.size, params.threshold, params.size };
+}
+
+static uint64_t elapsedMicros(std::chrono::steady_clock::duration d) {
+    return std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+}
+
+// Sends data[0, size) of input.  When multiplexed, the data must follow room
+// for a frame header, which may overwrite input already sent.
+static bool sendInputData(IoLoop &ioloop, int socketFd, char *data, size_t size) {
+    return ioloop.mux
+        ? ioloop.mux->writeFrame(Channel::Input, data - sizeof(FrameHeader), size)
+        : writeAllRestarting(socketFd, data, size);
+}
+
+// Sends data[0, size) of input, with each key in signalKeys (see TermSignal)
+// as a Signal packet after the input before it.
+static bool sendInput(IoLoop &ioloop, int socketFd, char *data, size_t size,
+                      uint32_t signalKeys) {
+    size_t start = 0;
+    for (size_t i = 0; i < size && signalKeys != 0; ++i) {
+        const void *const key = memchr(kTermSignalChars, data[i], sizeof(kTermSignalChars));
+        if (key == nullptr) {
+            continue;
+        }
+        const auto index = static_cast<const char*>(key) - kTermSignalChars;
+        if (!(signalKeys & (1u << index))) {
+            continue;
+        }
+        if (i > start && !sendInputData(ioloop, socketFd, data + start, i - start)) {
+            return false;
+        }
+        Packet p = { sizeof(Packet), Packet::Type::Signal };
+        p.u.termSignal = static_cast<TermSignal>(index);
+        writePacket(ioloop, p);
+        start = i + 1;
+    }
+    return start == size || sendInputData(ioloop, socketFd, data + start, size - start);
+}
+
+static void parentToSocketThread(IoLoop *ioloop, int inputFd, int socketFd) {
+    ChannelCounters &counters = ioloop->counters[dataChannelIndex(Channel::Input)];
+    // Leave room to frame the data in place for the multiplexed connection.
+    std::vector<char> buf(sizeof(FrameHeader) + ioloop->bufferParams.input);
+    char *const data = buf.data() + sizeof(FrameHeader);
+    const size_t dataSize = buf.size() - sizeof(FrameHeader);
+    const WindowParams windowParams = inputWindowParams(ioloop->windowParams);
+    int32_t locWindow = windowParams.size;
+    while (true) {
+        size_t readSize = dataSize;
+        if (ioloop->mux) {
+            ioloop->inputWindow.wait(locWindow, windowParams, &counters);
+            readSize = std::min<size_t>(std::min<size_t>(readSize, kMaxFramePayload),
+                                        locWindow);
+        }
+        const ssize_t amt1 = readRestarting(inputFd, data, readSize);
+        if (amt1 <= 0) {
+            // If we reach EOF reading from stdin, propagate EOF to the child.
+            if (ioloop->mux) {
+                ioloop->mux->writeEof(Channel::Input);
+            } else {
+                close(socketFd);
+            }
+            break;
+        }
+        counters.countRead(amt1);
+        uint32_t signalKeys = 0;
+        if (ioloop->usePty) {
+            const int64_t now = steadyMicros();
+            ioloop->lastInput = now;
+            if (ioloop->statsEnabled) {
+                int64_t none = 0;
+                ioloop->echoPending.compare_exchange_strong(none, now);
+            }
+            // Only a multiplexed connection keeps them in order with the input.
+            if (ioloop->mux && (ioloop->capabilities & kCapSignal)) {
+                signalKeys = ioloop->signalKeys;
+            }
+        }
+        if (!sendInput(*ioloop, socketFd, data, amt1, signalKeys)) {
+            // We don't propagate EOF backwards, but we do let data build up.
+            break;
+        }
+        counters.countWrite();
+        // The backend returns credit for signal keys, too.
+        locWindow -= amt1;
+    }
+}
+
+// Receive-side flow control for one output channel.  The backend may only
+// have window() bytes in flight, and we return credit once half of it has been
+// written out.
+//
+// When the window ceiling is above the initial size, the window also grows
+// the way TCP receive autotuning does.  If the backend has used up all its
+// credit, then our next IncreaseWindow is what it is waiting for, and the time
+// until more data arrives is a round-trip sample.  The window grows toward
+// twice the bandwidth-delay product, using the rate at which we can drain
+// data into outFd as the bandwidth.  It never shrinks.
+//
+// While the user is typing, the effective window shrinks to a cap that also
+// counts output queued for outFd but not yet written, so the reply to a
+// keystroke (the prompt after ^C, say) isn't stuck behind a window's worth of
+// older output.  Credit beyond the cap is held back until outFd catches up.
+class WindowTuner {
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    explicit WindowTuner(const WindowParams &params) :
+        params_(params),
+        window_(params.size),
+        credit_(params.size),
+        adaptive_(params.max > params.size) {}
+
+    int32_t window() const { return window_; }
+    int32_t credit() const { return credit_; }
+    int32_t unacked() const { return unacked_; }
+    bool stalled() const { return stalled_; }
+
+    void dataReceived(int32_t amount) {
+        assert(amount <= credit_);
+        credit_ -= amount;
+        if (!adaptive_) {
+            return;
+        }
+        const auto now = Clock::now();
+        if (rttPending_) {
+            const double sample = std::chrono::duration<double>(now - ackTime_).count();
+            srtt_ = srtt_ == 0.0 ? sample : (srtt_ * 7 + sample) / 8;
+            rttPending_ = false;
+        }
+        if (credit_ < params_.threshold) {
+            stalled_ = true;
+        }
+    }
+
+    // The data is queued for outFd, so its credit can be returned.
+    void dataQueued(int32_t amount) {
+        unacked_ += amount;
+        backlog_ += amount;
+    }
+
+    // Bytes written to outFd, and the time it took, for the drain rate.
+    void dataDrained(int64_t amount, Clock::duration writeTime) {
+        backlog_ -= amount;
+        if (adaptive_) {
+            drainBytes_ += amount;
+            drainTime_ += writeTime;
+        }
+    }
+
+    // Sets the interactive cap, or lifts it with 0.
+    void setCap(int32_t cap) { cap_ = cap; }
+    // True if credit is being held back for the cap.
+    bool withholding() const { return cap_ > 0 && unacked_ > 0; }
+
+    // Returns the credit to send in an IncreaseWindow packet, or 0 if no
+    // packet is needed yet.
+    int32_t takeIncrease() {
+        if (cap_ > 0) {
+            return takeCappedIncrease();
+        }
+        if (unacked_ < window_ / 2 && !stalled_) {
+            return 0;
+        }
+        int32_t grant = unacked_;
+        unacked_ = 0;
+        if (stalled_) {
+            grant += grow();
+            ackTime_ = Clock::now();
+            rttPending_ = true;
+            stalled_ = false;
+        }
+        credit_ += grant;
+        return grant;
+    }
+
+private:
+    // The window doesn't grow, and RTTs aren't sampled, while capped.
+    int32_t takeCappedIncrease() {
+        const int32_t window = std::min(window_, cap_);
+        if (unacked_ < window / 2 && credit_ >= params_.threshold) {
+            return 0;
+        }
+        const int64_t room = static_cast<int64_t>(cap_) - credit_ - backlog_;
+        const int32_t grant = static_cast<int32_t>(
+            std::max<int64_t>(0, std::min<int64_t>(unacked_, room)));
+        unacked_ -= grant;
+        credit_ += grant;
+        return grant;
+    }
+
+    int32_t grow() {
+        if (srtt_ == 0.0 || window_ >= params_.max) {
+            return 0;
+        }
+        const double drainSecs = std::chrono::duration<double>(drainTime_).count();
+        // A drain time of zero is a consumer too fast to measure.
+        const double target =
+            drainSecs > 0.0 ? 2.0 * drainBytes_ / drainSecs * srtt_
+                            : static_cast<double>(params_.max);
+        drainBytes_ = 0;
+        drainTime_ = Clock::duration::zero();
+        if (target <= window_) {
+            return 0;
+        }
+        const int32_t newWindow = static_cast<int32_t>(
+            std::min<double>({ target, 2.0 * window_,
+                               static_cast<double>(params_.max) }));
+        const int32_t growth = newWindow - window_;
+        window_ = newWindow;
+        return growth;
+    }
+
+    const WindowParams params_;
+    int32_t window_;
+    int32_t credit_;            // Granted to the backend and not yet received.
+    int32_t unacked_ = 0;       // Queued for outFd and not yet granted back.
+    int64_t backlog_ = 0;       // Queued for outFd and not yet written.
+    int32_t cap_ = 0;
+    const bool adaptive_;
+    bool stalled_ = false;
+    bool rttPending_ = false;
+    Clock::time_point ackTime_;
+    double srtt_ = 0.0;
+    int64_t drainBytes_ = 0;
+    Clock::duration drainTime_ = Clock::duration::zero();
+};
+
+const size_t kMaxConsoleRingSize = 4 * 1024 * 1024;
+
+// A pty session counts as interactive for this long after each keystroke,
+// and meanwhile keeps at most kInteractiveWindow bytes of output in flight
+// or waiting for the console.
+const int64_t kInteractiveHoldUs = 500 * 1000;
+const int32_t kInteractiveWindow = 32 * 1024;
+const auto kWithholdPollInterval = std::chrono::milliseconds(1);
+
+// With --skip-redraws, the console writer of a pty session thins out output
+// it has fallen behind on.  A full-screen clear paints over everything queued
+// before it, so of that output only the escape sequences that change the
+// terminal's state rather than the screen's contents (modes, colours, the
+// scroll region, character sets, titles, queries) are written; text, cursor
+// motion, and erases are dropped.  Escape sequences are followed across
+// writes, so one split between two writes is never cut in half.
+class RedrawSkipper {
+public:
+    // Passes data through, following the escape sequences in it.
+    void track(const char *data, size_t size);
+    // Returns where the last full-screen clear in data starts, or 0.
+    size_t lastClear(const char *data, size_t size) const;
+    // Consumes data that a clear paints over, appending the parts that still
+    // have to reach the terminal to kept.
+    void skip(const char *data, size_t size, std::string &kept);
+
+private:
+    enum class State { Ground, Escape, Csi, String, StringEscape };
+    // What a finished piece of output does.  Abort means an ESC abandoned the
+    // sequence in progress and starts another.
+    enum class Unit { None, Abort, Keep, Drop, Home, Clear, ClearBelow, Reset };
+
+    struct Parser {
+        State state = State::Ground;
+        // The current sequence's parameter and intermediate bytes, as far
+        // as classifying it needs.
+        std::string params;
+
+        Unit feed(char c);
+        Unit escapeUnit(char final) const;
+        Unit csiUnit(char final) const;
+    };
+
+    Parser parser_;
+    // Whether the sequence in progress was partly written already.
+    bool passThrough_ = false;
+    // The sequence in progress while skipping.
+    std::string pending_;
+};
+
+RedrawSkipper::Unit RedrawSkipper::Parser::feed(char ch) {
+    const unsigned char c = ch;
+    const bool cancel = c == 0x18 || c == 0x1a;
+    switch (state) {
+        case State::Ground:
+            if (c == 0x1b) {
+                state = State::Escape;
+                params.clear();
+                return Unit::None;
+            }
+            // SO and SI switch character sets.
+            return c == 0x0e || c == 0x0f ? Unit::Keep : Unit::Drop;
+        case State::Escape:
+            if (c == 0x1b) {
+                params.clear();
+                return Unit::Abort;
+            } else if (c == '[') {
+                state = State::Csi;
+            } else if (c == ']' || c == 'P' || c == '_' || c == '^' || c == 'X') {
+                // OSC, DCS, APC, PM, and SOS run to a string terminator.
+                state = State::String;
+            } else if (c >= 0x20 && c <= 0x2f) {
+                params += ch;
+            } else if (c >= 0x30 && c <= 0x7e) {
+                state = State::Ground;
+                return escapeUnit(ch);
+            } else if (cancel || c >= 0x7f) {
+                state = State::Ground;
+                return Unit::Drop;
+            }
+            return Unit::None;
+        case State::Csi:
+            if (c == 0x1b) {
+                state = State::Escape;
+                params.clear();
+                return Unit::Abort;
+            } else if (c >= 0x40 && c <= 0x7e) {
+                state = State::Ground;
+                return csiUnit(ch);
+            } else if (cancel) {
+                state = State::Ground;
+                return Unit::Drop;
+            } else if (params.size() < 16) {
+                params += ch;
+            }
+            return Unit::None;
+        case State::String:
+            if (c == 0x07 || cancel) {
+                state = State::Ground;
+                return Unit::Keep;
+            } else if (c == 0x1b) {
+                state = State::StringEscape;
+            }
+            return Unit::None;
+        case State::StringEscape:
+            // Normally ESC \; anything else ends the string too.
+            state = State::Ground;
+            return Unit::Keep;
+    }
+    return Unit::Drop;
+}
+
+RedrawSkipper::Unit RedrawSkipper::Parser::escapeUnit(char final) const {
+    if (!params.empty()) {
+        // Character set designations and the like.
+        return Unit::Keep;
+    }
+    switch (final) {
+        case 'c': return Unit::Reset;
+        // IND, NEL, and RI move the cursor, scrolling at the margins.
+        case 'D': case 'E': case 'M': return Unit::Drop;
+        default: return Unit::Keep;
+    }
+}
+
+RedrawSkipper::Unit RedrawSkipper::Parser::csiUnit(char final) const {
+    const bool isPrivate = !params.empty() && strchr("<=>?", params[0]) != nullptr;
+    for (char c : params) {
+        if (c >= 0x20 && c <= 0x2f) {
+            // Intermediate bytes mark settings such as the cursor style.
+            return Unit::Keep;
+        }
+    }
+    if (final == 'J' || final == 'K') {
+        // ED and EL erase; ED 2 erases the whole screen.
+        if (isPrivate || final == 'K') {
+            return Unit::Drop;
+        }
+        return params == "2" ? Unit::Clear :
+               params.empty() || params == "0" ? Unit::ClearBelow : Unit::Drop;
+    }
+    if (isPrivate) {
+        return Unit::Keep;
+    }
+    if (final == 'H' || final == 'f') {
+        return params.empty() || params == "1" || params == ";" || params == "1;" ||
+               params == ";1" || params == "1;1" ? Unit::Home : Unit::Drop;
+    }
+    // Cursor motion and editing; everything else (SGR, modes, margins,
+    // queries, saving the cursor) is kept.
+    return strchr("@ABCDEFGILMPSTXZ`abde", final) != nullptr ? Unit::Drop : Unit::Keep;
+}
+
+void RedrawSkipper::track(const char *data, size_t size) {
+    for (size_t i = 0; i < size; ++i) {
+        parser_.feed(data[i]);
+    }
+    passThrough_ = parser_.state != State::Ground;
+}
+
+size_t RedrawSkipper::lastClear(const char *data, size_t size) const {
+    Parser parser = parser_;
+    size_t last = 0;
+    size_t start = 0;
+    // Neither ED 0 nor ED 2 moves the cursor, so an erase only leaves the
+    // screen in a known state, home included, right after a home.  RIS does
+    // on its own.
+    bool homed = false;
+    size_t homeStart = 0;
+    for (size_t i = 0; i < size; ++i) {
+        if (parser.state == State::Ground) {
+            start = i;
+        }
+        const Unit unit = parser.feed(data[i]);
+        if (unit == Unit::None) {
+            continue;
+        } else if (unit == Unit::Abort) {
+            start = i;
+            continue;
+        }
+        if (unit == Unit::Reset) {
+            last = start;
+        } else if ((unit == Unit::Clear || unit == Unit::ClearBelow) && homed) {
+            last = homeStart;
+        }
+        homed = unit == Unit::Home;
+        homeStart = start;
+    }
+    return last;
+}
+
+void RedrawSkipper::skip(const char *data, size_t size, std::string &kept) {
+    pending_.clear();
+    for (size_t i = 0; i < size; ++i) {
+        const char c = data[i];
+        const Unit unit = parser_.feed(c);
+        if (unit == Unit::Abort) {
+            passThrough_ = false;
+            pending_.assign(1, c);
+        } else if (passThrough_) {
+            kept += c;
+            passThrough_ = unit == Unit::None;
+        } else if (unit == Unit::None) {
+            pending_ += c;
+        } else {
+            pending_ += c;
+            // A reset undoes the state kept before it, so it stays too.
+            if (unit == Unit::Keep || unit == Unit::Reset) {
+                kept += pending_;
+            }
+            pending_.clear();
+        }
+    }
+}
+
+// Writes one channel's output to outFd (usually the console) from its own
+// thread.  The thread reading the socket hands off data through an SpscRing
+// and returns its window credit right away, so a busy console doesn't stop
+// the socket from being drained or stall the backend.
+class ConsoleWriter {
+public:
+    typedef WindowTuner::Clock Clock;
+
+    // Echo latencies go to echoShown, if it's set (see markEcho).
+    ConsoleWriter(size_t capacity, int outFd, ChannelCounters &counters,
+                  bool timeWrites, bool statsEnabled, bool skipRedraws,
+                  LatencyWindow *echoShown) :
+        ring_(capacity), outFd_(outFd), counters_(counters),
+        timeWrites_(timeWrites), statsEnabled_(statsEnabled),
+        skipRedraws_(skipRedraws), echoShown_(echoShown),
+        thread_(&ConsoleWriter::run, this) {}
+
+    ~ConsoleWriter() {
+        if (thread_.joinable()) {
+            finish();
+        }
+    }
+
+    // Returns false once a write to outFd has failed.
+    bool write(const char *data, size_t size) { return ring_.push(data, size); }
+
+    // The output written so far ends with the echo of a keystroke read at
+    // `typed`.  The time until it is written out goes to echoShown.  While an
+    // echo is outstanding, later ones aren't measured.
+    void markEcho(int64_t typed) {
+        if (echoShown_ != nullptr && echoEnd_ == 0) {
+            echoTyped_ = typed;
+            echoEnd_ = ring_.pushed();
+        }
+    }
+
+    // Waits for the queued output to be written.
+    void finish() {
+        ring_.close();
+        thread_.join();
+    }
+
+    // Adds the output written since the last call to the tuner's drain rate.
+    void reportDrained(WindowTuner &window) {
+        const int64_t bytes = drainedBytes_.exchange(0);
+        const int64_t micros = drainedMicros_.exchange(0);
+        if (bytes > 0) {
+            window.dataDrained(bytes, std::chrono::microseconds(micros));
+        }
+    }
+
+private:
+    void run() {
+        const char *data = nullptr;
+        size_t size = 0;
+        std::string kept;
+        while ((size = ring_.peek(data)) > 0) {
+            if (skipRedraws_) {
+                // Output is only skipped once the console has fallen behind.
+                const size_t clear = ring_.queued() >= ring_.capacity() / 2
+                    ? skipper_.lastClear(data, size) : 0;
+                if (clear > 0) {
+                    kept.clear();
+                    skipper_.skip(data, clear, kept);
+                    if (!writeOut(kept.data(), kept.size(), clear)) {
+                        return;
+                    }
+                    continue;
+                }
+                skipper_.track(data, size);
+            }
+            if (!writeOut(data, size, size)) {
+                return;
+            }
+        }
+    }
+
+    // Writes data in place of the next `consumed` bytes of the ring.
+    bool writeOut(const char *data, size_t size, size_t consumed) {
+        const auto writeStart = timeWrites_ ? Clock::now() : Clock::time_point();
+        if (size > 0 && !writeAllRestarting(outFd_, data, size)) {
+            ring_.fail();
+            return false;
+        }
+        const auto writeTime =
+            timeWrites_ ? Clock::now() - writeStart : Clock::duration::zero();
+        ring_.consume(consumed);
+        const uint64_t echoEnd = echoEnd_;
+        if (echoEnd != 0 && ring_.consumed() >= echoEnd) {
+            echoShown_->add(steadyMicros() - echoTyped_);
+            echoEnd_ = 0;
+        }
+        if (size > 0) {
+            counters_.countWrite();
+        }
+        if (statsEnabled_) {
+            counters_.addWriteTime(elapsedMicros(writeTime));
+        }
+        drainedMicros_ += elapsedMicros(writeTime);
+        drainedBytes_ += consumed;
+        return true;
+    }
+
+    SpscRing ring_;
+    const int outFd_;
+    ChannelCounters &counters_;
+    const bool timeWrites_;
+    const bool statsEnabled_;
+    const bool skipRedraws_;
+    RedrawSkipper skipper_;
+    LatencyWindow *const echoShown_;
+    std::atomic<int64_t> echoTyped_ = {0};
+    std::atomic<uint64_t> echoEnd_ = {0};   // Ring position, or 0.
+    std::atomic<int64_t> drainedBytes_ = {0};
+    std::atomic<int64_t> drainedMicros_ = {0};
+    IoThread thread_;
+};
+
+// Waits up to timeout for a data socket to have something to read (data or
+// EOF).
+static bool waitReadable(int fd, std::chrono::microseconds timeout) {
+    fd_set fds;
+    FD_ZERO(&fds);
+    FD_SET(fd, &fds);
+    timeval tv = {};
+    tv.tv_sec = timeout.count() / 1000000;
+    tv.tv_usec = timeout.count() % 1000000;
+    const int ret = select(fd + 1, &fds, nullptr, nullptr, &tv);
+    // On an error, let the read report it.
+    return ret != 0;
+}
+
+static void socketToParentThread(IoLoop *ioloop, Channel channel, int socketFd, int outFd) {
+    typedef WindowTuner::Clock Clock;
+    const bool isErrorPipe = channel == Channel::Error;
+    ChannelQueue &queue = isErrorPipe ? ioloop->errorQueue : ioloop->outputQueue;
+    WindowTuner window(ioloop->windowParams);
+    ChannelCounters &counters = ioloop->counters[dataChannelIndex(channel)];
+    const bool timeWrites =
+        ioloop->statsEnabled || ioloop->windowParams.max > ioloop->windowParams.size;
+    // With --stats, an ack that lets a starved backend resume is timed until
+    // its data arrives.
+    bool ackWaitPending = false;
+    Clock::time_point ackSent;
+
+    const auto dataReady = [&](std::chrono::microseconds timeout) -> bool {
+        return ioloop->mux ? queue.waitFor(timeout) : waitReadable(socketFd, timeout);
+    };
+
+    // Most programs never write to stderr, so its buffers and console
+    // writer are only set up once something (if only EOF) arrives.
+    if (isErrorPipe) {
+        while (!dataReady(std::chrono::hours(1))) {}
+    }
+
+    // With --coalesce, output arriving in quick succession is held in
+    // buf[0, held) and written out together, after at most the coalescing
+    // interval or once holdLimit bytes are held.  Output that follows a
+    // quiet period -- an echoed keystroke, say -- is written immediately
+    // unless more is already waiting.
+    const auto interval = std::chrono::microseconds(ioloop->coalesce.interval);
+    const size_t holdLimit = interval.count() > 0 ? ioloop->coalesce.bytes : 0;
+    // With --stats, the pty's output times keystroke echoes, and echoTyped is
+    // the keystroke whose echo is among the held output.
+    const bool measureEcho = ioloop->statsEnabled && ioloop->usePty;
+    int64_t echoTyped = 0;
+    const size_t readSize = ioloop->bufferParams.output;
+    std::vector<char> buf(holdLimit + readSize);
+    size_t held = 0;
+    // Up to a window of output (within reason) can wait on the console while
+    // the next one is in flight.
+    ConsoleWriter writer(
+        std::max(holdLimit + readSize,
+                 std::min<size_t>(ioloop->windowParams.max, kMaxConsoleRingSize)),
+        outFd, counters, timeWrites, ioloop->statsEnabled, ioloop->skipRedraws,
+        measureEcho ? &ioloop->echoShown : nullptr);
+    Clock::time_point heldSince;
+    Clock::time_point lastFlush;
+
+    const auto readData = [&](char *data, size_t size) -> ssize_t {
+        return ioloop->mux ? queue.pop(data, size)
+                           : readRestarting(socketFd, data, size);
+    };
+
+    // Reads exactly size bytes.  Returns size, 0 at EOF, or -1 on an error
+    // or an EOF partway through.
+    const auto readExact = [&](char *data, size_t size) -> ssize_t {
+        size_t done = 0;
+        while (done < size) {
+            const ssize_t amt = readData(data + done, size - done);
+            if (amt <= 0) {
+                return done == 0 ? amt : -1;
+            }
+            done += amt;
+        }
+        return size;
+    };
+
+    // Reads one chunk and returns its raw size, which fits in readSize bytes.
+    std::vector<char> compressed;
+    const auto readChunk = [&](char *data) -> ssize_t {
+        ChunkHeader header = {};
+        const ssize_t amt = readExact(reinterpret_cast<char*>(&header), sizeof(header));
+        if (amt <= 0) {
+            return amt;
+        }
+        if (header.rawSize == 0 || header.rawSize > readSize ||
+                header.size > header.rawSize) {
+            g_terminalState.fatal("internal error: bad compressed chunk header\n");
+        }
+        if (header.size == header.rawSize) {
+            return readExact(data, header.size) > 0 ? header.rawSize : -1;
+        }
+        compressed.resize(header.size);
+        if (readExact(compressed.data(), header.size) <= 0) {
+            return -1;
+        }
+        if (!lzDecompress(compressed.data(), header.size, data, header.rawSize)) {
+            g_terminalState.fatal("internal error: corrupt compressed chunk\n");
+        }
+        return header.rawSize;
+    };
+
+    const int32_t interactiveCap =
+        std::max(kInteractiveWindow, 2 * ioloop->windowParams.threshold);
+    const auto isInteractive = [&]() -> bool {
+        return ioloop->usePty &&
+            steadyMicros() - ioloop->lastInput < kInteractiveHoldUs;
+    };
+
+    // Returns credit for the output queued so far.
+    const auto returnCredit = [&]() {
+        writer.reportDrained(window);
+        window.setCap(isInteractive() ? interactiveCap : 0);
+        const bool stalled = window.stalled();
+        const bool starved = window.credit() < ioloop->windowParams.threshold;
+        const int32_t increase = window.takeIncrease();
+        std::atomic<int32_t> &pending = ioloop->acks.channelCredit(channel);
+        if (increase > 0) {
+            pending += increase;
+            if (starved && ioloop->statsEnabled) {
+                ackSent = Clock::now();
+                ackWaitPending = true;
+            }
+        }
+        // If nothing more is in transit, the backend blocks once the credit
+        // we're holding leaves it below the threshold, so send it right away.
+        const bool urgent = stalled ||
+            pending + window.unacked() >
+                window.window() - ioloop->windowParams.threshold;
+        flushAcks(*ioloop, urgent);
+    };
+
+    // Queues the held output for the console and returns credit for it.
+    const auto flush = [&]() -> bool {
+        if (!writer.write(buf.data(), held)) {
+            if (!ioloop->usePty && !isErrorPipe) {
+                // ssh seems to propagate an stdout EOF backwards to the remote
+                // program, so do the same thing.  It doesn't do this for
+                // stderr, though, where the remote process is allowed to block
+                // forever.
+                Packet p = { sizeof(Packet), Packet::Type::CloseStdoutPipe };
+                writePacket(*ioloop, p);
+            }
+            if (ioloop->mux) {
+                queue.discard();
+            } else {
+                shutdown(socketFd, SHUT_RDWR);
+            }
+            return false;
+        }
+        window.dataQueued(held);
+        held = 0;
+        if (echoTyped != 0) {
+            writer.markEcho(echoTyped);
+            echoTyped = 0;
+        }
+        if (holdLimit > 0) {
+            lastFlush = Clock::now();
+        }
+        returnCredit();
+        return true;
+    };
+
+    while (true) {
+        if (held > 0) {
+            const auto remaining = std::chrono::duration_cast<std::chrono::microseconds>(
+                heldSince + interval - Clock::now());
+            if (remaining.count() <= 0 || !dataReady(remaining)) {
+                if (!flush()) {
+                    break;
+                }
+                continue;
+            }
+        }
+        if (held == 0 && window.withholding() && !dataReady(kWithholdPollInterval)) {
+            // Credit held back for a typing user goes out as the console
+            // catches up, or once the typing stops.
+            returnCredit();
+            continue;
+        }
+        char *const data = buf.data() + held;
+        const ssize_t amt1 =
+            ioloop->compress ? readChunk(data) : readData(data, readSize);
+        if (amt1 >= 0 && g_recorder != nullptr) {
+            g_recorder->data(channel, data, amt1);
+        }
+        if (amt1 <= 0 && held > 0 && !flush()) {
+            break;
+        }
+        if (amt1 == 0) {
+            // The output is only finished once it reaches the console.
+            writer.finish();
+            std::lock_guard<std::mutex> lock(ioloop->mutex);
+            ioloop->ioFinished = true;
+            g_wakeupFd->set(kWakeupIoFinished);
+            break;
+        }
+        if (amt1 < 0) {
+            break;
+        }
+        if (g_startupTimeline != nullptr) {
+            g_startupTimeline->markFirstOutput();
+        }
+        if (ackWaitPending) {
+            counters.addAckWait(elapsedMicros(Clock::now() - ackSent));
+            ackWaitPending = false;
+        }
+        counters.countRead(amt1);
+        window.dataReceived(amt1);
+        if (measureEcho) {
+            const int64_t typed = ioloop->echoPending.exchange(0);
+            if (typed != 0) {
+                ioloop->echoArrived.add(steadyMicros() - typed);
+                if (echoTyped == 0) {
+                    echoTyped = typed;
+                }
+            }
+        }
+        if (held == 0 && holdLimit > 0) {
+            heldSince = Clock::now();
+        }
+        held += amt1;
+        // Once the backend is out of credit, nothing more is coming until
+        // we write this out.
+        if (held >= holdLimit ||
+                window.credit() < ioloop->windowParams.threshold ||
+                (!dataReady(std::chrono::microseconds::zero()) &&
+                    Clock::now() - lastFlush >= interval)) {
+            if (!flush()) {
+                break;
+            }
+        }
+    }
+}
+
+// The backend's Hello comes first on the connection.
+static uint32_t helloCapabilities(const Packet &p) {
+    if (p.u.hello.protocol < kMinProtocolVersion) {
+        g_terminalState.fatal("error: wslbridge backend protocol %u is too old"
+                              " (need at least %u)\n",
+                              p.u.hello.protocol, kMinProtocolVersion);
+    }
+    return p.u.hello.capabilities & kCapabilities;
+}
+
+static std::string spawnFailedMessage(const PacketSpawnFailed &psf,
+                                      const std::string &spawnCwd) {
+    std::string msg;
+    switch (psf.u.spawnError.type) {
+        case SpawnError::Type::ForkPtyFailed:
+            msg = "error: forkpty failed: ";
+            break;
+        case SpawnError::Type::ChdirFailed:
+            msg = "error: could not chdir to '" + spawnCwd + "': ";
+            break;
+        case SpawnError::Type::ExecFailed:
+            msg = "error: could not exec '" +
+                std::string(psf.exe, strnlen(psf.exe, sizeof(psf.exe))) + "': ";
+            break;
+        default:
+            assert(false && "Unhandled SpawnError type");
+    }
+    return msg + errorString(psf.u.spawnError.error);
+}
+
+static void handlePacket(IoLoop *ioloop, const Packet &p) {
+    if (g_recorder != nullptr) {
+        g_recorder->packet(p, false);
+    }
+    switch (p.type) {
+        case Packet::Type::Hello:
+            ioloop->capabilities = helloCapabilities(p);
+            break;
+        case Packet::Type::ChildExitStatus: {
+            std::lock_guard<std::mutex> lock(ioloop->mutex);
+            ioloop->childReaped = true;
+            ioloop->childExitStatus = p.u.exitStatus;
+            g_wakeupFd->set(kWakeupChildExit);
+            break;
+        }
+        case Packet::Type::SpawnFailed: {
+            const std::string msg = spawnFailedMessage(
+                reinterpret_cast<const PacketSpawnFailed&>(p), ioloop->spawnCwd);
+            if (g_recorder != nullptr) {
+                g_recorder->flush();
+            }
+            g_terminalState.fatal("%s\n", msg.c_str());
+            break;
+        }
+        case Packet::Type::IncreaseWindow: {
+            if (!ioloop->mux || p.u.window.channel != Channel::Input) {
+                g_terminalState.fatal("internal error: unexpected window channel %d\n",
+                    static_cast<int>(p.u.window.channel));
+            }
+            ioloop->inputWindow.increase(p.u.window.amount,
+                inputWindowParams(ioloop->windowParams).max);
+            break;
+        }
+        case Packet::Type::BackendPath: {
+            const auto &pbp = reinterpret_cast<const PacketBackendPath&>(p);
+            if (g_backendPathCache != nullptr &&
+                    strnlen(pbp.path, sizeof(pbp.path)) < sizeof(pbp.path)) {
+                g_backendPathCache->store(pbp.path);
+            }
+            break;
+        }
+        case Packet::Type::StartupTrace: {
+            const auto &pst = reinterpret_cast<const PacketStartupTrace&>(p);
+            if (g_startupTimeline != nullptr) {
+                const uint32_t count = std::min<uint32_t>(pst.count, kMaxTraceEvents);
+                for (uint32_t i = 0; i < count; ++i) {
+                    TraceEvent event = pst.events[i];
+                    event.name[sizeof(event.name) - 1] = '\0';
+                    g_startupTimeline->backend.add(event.name, event.start,
+                        event.start + event.duration, event.thread);
+                }
+            }
+            break;
+        }
+        case Packet::Type::SignalKeys:
+            ioloop->signalKeys = p.u.signalKeys;
+            break;
+        case Packet::Type::Pong: {
+            const uint32_t now = static_cast<uint32_t>(steadyMicros());
+            ioloop->pingRtt.add(now - p.u.ping.sentMicros);
+            break;
+        }
+        case Packet::Type::Stats: {
+            std::lock_guard<std::mutex> lock(ioloop->mutex);
+            ioloop->backendStats = reinterpret_cast<const PacketStats&>(p);
+            ioloop->backendStatsReceived = true;
+            ioloop->backendStatsCV.notify_all();
+            g_wakeupFd->set(kWakeupStatsReceived);
+            break;
+        }
+        default: {
+            g_terminalState.fatal("internal error: unexpected packet %d\n",
+                static_cast<int>(p.type));
+        }
+    }
+}
+
+static void handleData(IoLoop *ioloop, Channel channel, const char *data, size_t size) {
+    ChannelQueue *queue = nullptr;
+    if (channel == Channel::Output) {
+        queue = &ioloop->outputQueue;
+    } else if (channel == Channel::Error && !ioloop->usePty) {
+        queue = &ioloop->errorQueue;
+    } else {
+        g_terminalState.fatal("internal error: unexpected data on channel %d\n",
+            static_cast<int>(channel));
+    }
+    if (size == 0) {
+        queue->close();
+    } else {
+        queue->push(data, size);
+    }
+}
+
+static double percentile(const std::vector<double> &sorted, double pct) {
+    const size_t i = static_cast<size_t>(pct / 100.0 * sorted.size());
+    return sorted[std::min(i, sorted.size() - 1)];
+}
+
+static void printStats(IoLoop &ioloop, const PacketStats *backend) {
+    // The console may be in raw mode, with output post-processing off.
+    const char *const eol = ioloop.usePty && isatty(STDERR_FILENO) ? "\r\n" : "\n";
+    const char *const names[kDataChannelCount] = { "stdin", "stdout", "stderr" };
+    fprintf(stderr, "%swslbridge stats:%18s %9s %9s %9s %7s %9s %9s %9s%s",
+            eol, "bytes", "reads", "writes", "write ms",
+            "stalls", "stall ms", "ack waits", "ack ms", eol);
+    for (int side = 0; side < 2; ++side) {
+        if (side == 1 && backend == nullptr) {
+            fprintf(stderr, "  backend: no reply%s", eol);
+            break;
+        }
+        for (int i = 0; i < kDataChannelCount; ++i) {
+            if (ioloop.usePty && i == dataChannelIndex(Channel::Error)) {
+                continue;
+            }
+            const ChannelStats cs =
+                side == 0 ? ioloop.counters[i].snapshot() : backend->channels[i];
+            fprintf(stderr, "  %-8s %-6s %14llu %9llu %9llu %9.1f %7llu %9.1f %9llu %9.1f%s",
+                    side == 0 ? "frontend" : "backend", names[i],
+                    static_cast<unsigned long long>(cs.bytes),
+                    static_cast<unsigned long long>(cs.reads),
+                    static_cast<unsigned long long>(cs.writes),
+                    cs.writeTime / 1000.0,
+                    static_cast<unsigned long long>(cs.stalls),
+                    cs.stallTime / 1000.0,
+                    static_cast<unsigned long long>(cs.ackWaits),
+                    cs.ackWaitTime / 1000.0,
+                    eol);
+        }
+    }
+    // Only the multiplexed connection queues data in the pools.
+    for (int side = 0; side < 2 && ioloop.mux; ++side) {
+        const PoolStats ps = side == 0 ? ioloop.pool.stats() :
+                             backend != nullptr ? backend->pool : PoolStats {};
+        if (ps.blockSize == 0) {
+            continue;
+        }
+        fprintf(stderr, "  %-8s pool   %llu KiB blocks: %llu acquired, %llu in use, %llu at most%s",
+                side == 0 ? "frontend" : "backend",
+                static_cast<unsigned long long>(ps.blockSize / 1024),
+                static_cast<unsigned long long>(ps.acquires),
+                static_cast<unsigned long long>(ps.inUse),
+                static_cast<unsigned long long>(ps.highWater),
+                eol);
+    }
+    // Comparing these tells the bridge's own round trip (ping) apart from
+    // the time the pty and the child add (echo) and the console's rendering
+    // (shown).
+    const struct { const char *name; LatencyWindow &latency; } latencies[] = {
+        { "ping", ioloop.pingRtt },
+        { "echo", ioloop.echoArrived },
+        { "shown", ioloop.echoShown },
+    };
+    for (const auto &l : latencies) {
+        uint64_t total = 0;
+        const std::vector<double> ms = l.latency.sortedMillis(total);
+        if (ms.empty()) {
+            continue;
+        }
+        fprintf(stderr, "  latency  %-6s %llu samples, ms over the last %zu: "
+                "p50 %.2f  p90 %.2f  p99 %.2f  max %.2f%s",
+                l.name, static_cast<unsigned long long>(total), ms.size(),
+                percentile(ms, 50), percentile(ms, 90), percentile(ms, 99),
+                ms.back(), eol);
+    }
+    fflush(stderr);
+}
+
+// Returns false if the backend can't report stats.
+static bool requestBackendStats(IoLoop &ioloop) {
+    if (!(ioloop.capabilities & kCapStats)) {
+        return false;
+    }
+    Packet p = { sizeof(Packet), Packet::Type::RequestStats };
+    writePacket(ioloop, p);
+    return true;
+}
+
+// The --bench mode.  The backend runs a built-in load in place of the child
+// (see runBenchChild in the backend), and the frontend's I/O threads read and
+// write pipes driven by a benchmark thread instead of the console.  Everything
+// between those pipes is the ordinary I/O path.
+enum class BenchTest { None, Throughput, Latency };
+
+const long long kDefaultBenchBytes = 256 * 1024 * 1024;
+const int kDefaultBenchCount = 1000;
+const int kBenchWarmupCount = 20;
+const auto kBenchSampleInterval = std::chrono::milliseconds(20);
+
+// The echo child exits when it sees this byte.  (It's raw mode, so a pty
+// passes it through unchanged.)
+const char kBenchEchoQuit = '\x04';
+
+struct BenchParams {
+    BenchTest test = BenchTest::None;
+    long long bytes = kDefaultBenchBytes;
+    int count = kDefaultBenchCount;
+};
+
+class Benchmark {
+public:
+    Benchmark(const BenchParams &params, const std::string &description);
+    int inputFd() const { return inputPipe_[0]; }
+    int outputFd() const { return outputPipe_[1]; }
+    void start();
+    void finish();
+
+private:
+    typedef std::chrono::steady_clock Clock;
+    void runThroughput();
+    void runLatency();
+    void drainOutput();
+    void report(const char *what, const char *unit, std::vector<double> samples);
+
+    const BenchParams params_;
+    const std::string description_;
+    int inputPipe_[2];
+    int outputPipe_[2];
+    std::thread thread_;
+    std::string summary_;
+    std::vector<double> samples_;
+};
+
+Benchmark::Benchmark(const BenchParams &params, const std::string &description) :
+        params_(params), description_(description) {
+    if (pipe(inputPipe_) != 0 || pipe(outputPipe_) != 0) {
+        fatalPerror("error: pipe failed");
+    }
+}
+
+void Benchmark::start() {
+    thread_ = std::thread([this]() {
+        if (params_.test == BenchTest::Throughput) {
+            runThroughput();
+        } else {
+            runLatency();
+        }
+    });
+}
+
+// Called once the child has exited and its output is written out.
+void Benchmark::finish() {
+    close(outputPipe_[1]);
+    thread_.join();
+    printf("wslbridge bench: %s\n", description_.c_str());
+    printf("wslbridge bench: %s\n", summary_.c_str());
+    if (params_.test == BenchTest::Throughput) {
+        report("throughput", "MB/s", std::move(samples_));
+    } else {
+        report("round trip", "us", std::move(samples_));
+    }
+    fflush(stdout);
+}
+
+// Times the backend's output, excluding startup: the clock starts with the
+// first byte.  Each sample is the rate over one kBenchSampleInterval.
+void Benchmark::runThroughput() {
+    close(inputPipe_[1]);
+    std::vector<char> buf(64 * 1024);
+    long long total = 0;
+    long long intervalBytes = 0;
+    Clock::time_point first, intervalStart, last;
+    while (total < params_.bytes) {
+        const ssize_t amt = readRestarting(outputPipe_[0], buf.data(), buf.size());
+        if (amt <= 0) {
+            break;
+        }
+        last = Clock::now();
+        if (total == 0) {
+            first = intervalStart = last;
+        }
+        total += amt;
+        intervalBytes += amt;
+        if (last - intervalStart >= kBenchSampleInterval) {
+            const double secs = std::chrono::duration<double>(last - intervalStart).count();
+            samples_.push_back(intervalBytes / secs / 1e6);
+            intervalBytes = 0;
+            intervalStart = last;
+        }
+    }
+    const double secs = std::chrono::duration<double>(last - first).count();
+    char line[256];
+    snprintf(line, sizeof(line), "%lld bytes in %.3f s: %.1f MB/s",
+             total, secs, secs > 0 ? total / secs / 1e6 : 0.0);
+    summary_ = line;
+    drainOutput();
+}
+
+// Sends one keystroke at a time and times its echo.  The first few round
+// trips warm up the path and are not counted.
+void Benchmark::runLatency() {
+    const char probe = 'x';
+    char reply = 0;
+    for (int i = 0; i < kBenchWarmupCount + params_.count; ++i) {
+        const auto start = Clock::now();
+        if (!writeAllRestarting(inputPipe_[1], &probe, 1) ||
+                readRestarting(outputPipe_[0], &reply, 1) != 1) {
+            break;
+        }
+        const auto elapsed = Clock::now() - start;
+        if (i >= kBenchWarmupCount) {
+            samples_.push_back(
+                std::chrono::duration<double, std::micro>(elapsed).count());
+        }
+    }
+    char line[256];
+    snprintf(line, sizeof(line), "%zu keystrokes echoed", samples_.size());
+    summary_ = line;
+    writeAllRestarting(inputPipe_[1], &kBenchEchoQuit, 1);
+    drainOutput();
+}
+
+void Benchmark::drainOutput() {
+    std::array<char, 4096> buf;
+    while (readRestarting(outputPipe_[0], buf.data(), buf.size()) > 0) {}
+}
+
+void Benchmark::report(const char *what, const char *unit, std::vector<double> samples) {
+    if (samples.empty()) {
+        printf("wslbridge bench: no %s samples\n", what);
+        return;
+    }
+    std::sort(samples.begin(), samples.end());
+    printf("wslbridge bench: %s (%s, %zu samples): "
+           "min %.1f  p10 %.1f  p50 %.1f  p90 %.1f  p99 %.1f  max %.1f\n",
+           what, unit, samples.size(),
+           samples.front(),
+           percentile(samples, 10),
+           percentile(samples, 50),
+           percentile(samples, 90),
+           percentile(samples, 99),
+           samples.back());
+}
+
+static void mainLoop(const std::string &spawnCwd,
+                     bool usePty, bool useMux, int controlSocketFd,
+                     int inputSocketFd, int outputSocketFd, int errorSocketFd,
+                     TermSize termSize, WindowParams windowParams,
+                     BufferParams bufferParams, int ackIntervalUs,
+                     int resizeIntervalUs, int pingIntervalUs,
+                     bool compress, CoalesceParams coalesce, bool skipRedraws,
+                     bool statsEnabled, Benchmark *bench) {
+    IoLoop ioloop;
+    ioloop.spawnCwd = spawnCwd;
+    ioloop.usePty = usePty;
+    ioloop.windowParams = windowParams;
+    ioloop.bufferParams = bufferParams;
+    ioloop.compress = compress;
+    ioloop.ackIntervalUs = ackIntervalUs;
+    ioloop.coalesce = coalesce;
+    ioloop.skipRedraws = skipRedraws && usePty;
+    ioloop.statsEnabled = statsEnabled;
+    ioloop.controlSocketFd = controlSocketFd;
+    if (useMux) {
+        ioloop.mux = std::unique_ptr<MuxSocket>(new MuxSocket(controlSocketFd));
+    }
+    const int parentInputFd = bench ? bench->inputFd() : STDIN_FILENO;
+    const int parentOutputFd = bench ? bench->outputFd() : STDOUT_FILENO;
+    if (bench) {
+        bench->start();
+    }
+    IoThread p2s(parentToSocketThread, &ioloop, parentInputFd, inputSocketFd);
+    IoThread s2p(socketToParentThread, &ioloop, Channel::Output, outputSocketFd, parentOutputFd);
+    std::unique_ptr<IoThread> es2p;
+    if (!usePty) {
+        es2p = std::unique_ptr<IoThread>(
+            new IoThread(socketToParentThread, &ioloop, Channel::Error, errorSocketFd, STDERR_FILENO));
+    }
+    IoThread rcs(useMux ?
+                        readMuxSocketThread<IoLoop, handlePacket, handleData, fatalConnectionBroken> :
+                        readControlSocketThread<IoLoop, handlePacket, fatalConnectionBroken>,
+                    controlSocketFd, &ioloop);
+    int32_t exitStatus = -1;
+
+    // Each SetSize makes full-screen programs redraw, and dragging a window's
+    // border resizes it many times a second.  A new size is sent at once
+    // unless one went out within the last resizeIntervalUs; then the latest
+    // size is sent when that interval ends.
+    //
+    // The loop only does what its wakeup says, so an idle session sleeps in
+    // wait() without any periodic work.
+    //
+    // With --ping-interval, a Ping also goes out every pingIntervalUs.
+    int64_t lastResize = 0;
+    bool resizePending = false;
+    int64_t nextPing = steadyMicros() + pingIntervalUs;
+    uint32_t pingSeq = 0;
+    while (true) {
+        int64_t deadline = INT64_MAX;
+        if (resizePending) {
+            deadline = lastResize + resizeIntervalUs;
+        }
+        if (pingIntervalUs > 0) {
+            deadline = std::min(deadline, nextPing);
+        }
+        uint32_t events = 0;
+        if (deadline == INT64_MAX) {
+            events = g_wakeupFd->wait();
+        } else {
+            const int64_t timeout = deadline - steadyMicros();
+            if (timeout > 0) {
+                events = g_wakeupFd->waitFor(std::chrono::microseconds(timeout));
+            }
+        }
+        const int64_t now = steadyMicros();
+        if (resizePending && now - lastResize >= resizeIntervalUs) {
+            events |= kWakeupResize;
+        }
+        if (pingIntervalUs > 0 && now >= nextPing) {
+            nextPing = now + pingIntervalUs;
+            if (ioloop.capabilities & kCapPing) {
+                Packet p = { sizeof(Packet), Packet::Type::Ping };
+                p.u.ping.seq = ++pingSeq;
+                p.u.ping.sentMicros = static_cast<uint32_t>(now);
+                writePacket(ioloop, p);
+            }
+        }
+        if (events & kWakeupResize) {
+            const auto newSize = terminalSize();
+            resizePending = false;
+            if (newSize != termSize) {
+                const int64_t now = steadyMicros();
+                if (now - lastResize >= resizeIntervalUs) {
+                    Packet p = { sizeof(Packet), Packet::Type::SetSize };
+                    p.u.termSize = termSize = newSize;
+                    writePacket(ioloop, p);
+                    lastResize = now;
+                } else {
+                    resizePending = true;
+                }
+            }
+        }
+        if (events & kWakeupStatsRequested) {
+            if (!requestBackendStats(ioloop)) {
+                printStats(ioloop, nullptr);
+            }
+        }
+        if (!(events & (kWakeupStatsReceived | kWakeupChildExit | kWakeupIoFinished))) {
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(ioloop.mutex);
+        if (ioloop.backendStatsReceived) {
+            // A live snapshot asked for with SIGUSR1.
+            ioloop.backendStatsReceived = false;
+            const PacketStats backend = ioloop.backendStats;
+            lock.unlock();
+            printStats(ioloop, &backend);
+            lock.lock();
+        }
+        if (ioloop.childReaped && ioloop.ioFinished) {
+            exitStatus = ioloop.childExitStatus;
+            break;
+        }
+    }
+
+    // Socket-to-pty I/O is finished already.
+    s2p.join();
+
+    if (statsEnabled) {
+        // The backend keeps serving the control connection until we exit.
+        std::unique_lock<std::mutex> lock(ioloop.mutex);
+        ioloop.backendStatsReceived = false;
+        lock.unlock();
+        const bool requested = requestBackendStats(ioloop);
+        lock.lock();
+        const bool received = requested && ioloop.backendStatsCV.wait_for(
+            lock, std::chrono::seconds(2),
+            [&]() { return ioloop.backendStatsReceived; });
+        const PacketStats backend = ioloop.backendStats;
+        lock.unlock();
+        printStats(ioloop, received ? &backend : nullptr);
+    }
+
+    if (bench) {
+        bench->finish();
+    }
+
+    if (g_startupTimeline != nullptr) {
+        g_startupTimeline->write();
+    }
+
+    if (g_recorder != nullptr) {
+        g_recorder->flush();
+    }
+
+    // We can't return, because the threads could still be running.  Rather
+    // than shut them down gracefully, which seems hard(?), just let the OS
+    // clean everything up.
+    g_terminalState.exitCleanly(exitStatus);
+}
+
+// --multi: runs each line of stdin as its own session, all sharing one
+// multiplexed connection to one backend.  The main thread reads commands and
+// keeps up to `jobs` sessions running; a second thread reads the connection.
+// Each line a session prints is prefixed with "[N] ", where N is the
+// command's line number, so the interleaved output stays attributable.
+class MultiRunner {
+public:
+    MultiRunner(int socketFd, WindowParams windowParams, int jobs) :
+        mux_(socketFd), windowParams_(windowParams), jobs_(jobs) {}
+    void run() __attribute__((noreturn));
+
+private:
+    struct Session {
+        std::string partial[2];     // An unfinished line of stdout and stderr.
+        int eofCount = 0;
+        bool exited = false;
+    };
+
+    void startSession(uint32_t id, const std::string &command);
+    void readConnection();
+    void handlePacket(uint32_t id, const Packet &p);
+    void handleData(uint32_t id, int index, const char *data, size_t size);
+    void finishSession(uint32_t id, int exitStatus);
+    void writeLine(uint32_t id, int index, const char *data, size_t size);
+
+    MuxSocket mux_;
+    const WindowParams windowParams_;
+    const int jobs_;
+    std::mutex mutex_;
+    std::condition_variable sessionFinished_;
+    std::map<uint32_t, Session> sessions_;
+    int exitStatus_ = 0;
+};
+
+void MultiRunner::run() {
+    IoThread reader(&MultiRunner::readConnection, this);
+    reader.detach();
+    char *line = nullptr;
+    size_t capacity = 0;
+    ssize_t len = 0;
+    uint32_t lineNumber = 0;
+    while ((len = getline(&line, &capacity, stdin)) >= 0) {
+        ++lineNumber;
+        std::string command(line, len);
+        while (!command.empty() && (command.back() == '\n' || command.back() == '\r')) {
+            command.pop_back();
+        }
+        if (command.find_first_not_of(" \t") == std::string::npos) {
+            continue;
+        }
+        if (lineNumber >= (1u << (31 - kSessionShift))) {
+            fatal("error: --multi accepts at most %u lines\n",
+                  (1u << (31 - kSessionShift)) - 1);
+        }
+        std::unique_lock<std::mutex> lock(mutex_);
+        sessionFinished_.wait(lock, [&]() {
+            return sessions_.size() < static_cast<size_t>(jobs_);
+        });
+        sessions_[lineNumber];
+        lock.unlock();
+        startSession(lineNumber, command);
+    }
+    free(line);
+    std::unique_lock<std::mutex> lock(mutex_);
+    sessionFinished_.wait(lock, [&]() { return sessions_.empty(); });
+    g_terminalState.exitCleanly(exitStatus_);
+}
+
+void MultiRunner::startSession(uint32_t id, const std::string &command) {
+    const char *const args[] = { "sh", "-c", command.c_str() };
+    std::vector<char> buf(sizeof(FrameHeader) + sizeof(Packet));
+    for (const char *arg : args) {
+        buf.insert(buf.end(), arg, arg + strlen(arg) + 1);
+    }
+    const size_t payloadSize = buf.size() - sizeof(FrameHeader);
+    if (payloadSize > kMaxFramePayload) {
+        fatal("error: line %u is too long for --multi\n", id);
+    }
+    Packet p = { static_cast<uint32_t>(payloadSize), Packet::Type::SpawnRequest };
+    p.u.argCount = 3;
+    memcpy(&buf[sizeof(FrameHeader)], &p, sizeof(p));
+    if (!mux_.writeFrame(sessionChannel(id, Channel::Control), buf.data(), payloadSize)) {
+        fatalConnectionBroken();
+    }
+}
+
+void MultiRunner::readConnection() {
+    AnyPacket packet = {};
+    StreamReader reader(mux_.fd(), 2 * (sizeof(FrameHeader) + kMaxFramePayload));
+    while (true) {
+        FrameHeader header = {};
+        const char *h = reader.next(sizeof(header));
+        if (h == nullptr) {
+            fatalConnectionBroken();
+        }
+        memcpy(&header, h, sizeof(header));
+        const char *payload = nullptr;
+        if (header.size > kMaxFramePayload ||
+                (payload = reader.next(header.size)) == nullptr) {
+            fatalConnectionBroken();
+        }
+        const uint32_t id = channelSession(header.channel);
+        const Channel channel = baseChannel(header.channel);
+        if (channel == Channel::Control) {
+            if (!copyPacket(packet, payload, header.size)) {
+                fatalConnectionBroken();
+            }
+            handlePacket(id, packet.base);
+        } else if (channel == Channel::Output || channel == Channel::Error) {
+            handleData(id, channel == Channel::Output ? 0 : 1, payload, header.size);
+        } else {
+            g_terminalState.fatal("internal error: unexpected data on channel %d\n",
+                static_cast<int>(header.channel));
+        }
+    }
+}
+
+void MultiRunner::handlePacket(uint32_t id, const Packet &p) {
+    switch (p.type) {
+        case Packet::Type::Hello:
+            helloCapabilities(p);
+            break;
+        case Packet::Type::BackendPath: {
+            const auto &pbp = reinterpret_cast<const PacketBackendPath&>(p);
+            if (id == 0 && g_backendPathCache != nullptr &&
+                    strnlen(pbp.path, sizeof(pbp.path)) < sizeof(pbp.path)) {
+                g_backendPathCache->store(pbp.path);
+            }
+            break;
+        }
+        case Packet::Type::ChildExitStatus:
+            finishSession(id, p.u.exitStatus);
+            break;
+        case Packet::Type::SpawnFailed: {
+            const std::string msg = spawnFailedMessage(
+                reinterpret_cast<const PacketSpawnFailed&>(p), std::string());
+            writeLine(id, 1, msg.data(), msg.size());
+            // Count the streams as finished too; the child never existed.
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                sessions_[id].eofCount = 2;
+            }
+            finishSession(id, 127);
+            break;
+        }
+        default:
+            g_terminalState.fatal("internal error: unexpected packet %d\n",
+                static_cast<int>(p.type));
+    }
+}
+
+void MultiRunner::handleData(uint32_t id, int index, const char *data, size_t size) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    const auto it = sessions_.find(id);
+    if (it == sessions_.end()) {
+        g_terminalState.fatal("internal error: data for unknown session %u\n", id);
+    }
+    // Only this thread changes or removes a session once it's started.
+    Session &session = it->second;
+    lock.unlock();
+    std::string &partial = session.partial[index];
+    if (size == 0) {
+        if (!partial.empty()) {
+            writeLine(id, index, partial.data(), partial.size());
+            partial.clear();
+        }
+        lock.lock();
+        ++session.eofCount;
+        lock.unlock();
+        finishSession(id, -1);
+        return;
     }
-    volatile char ch = 0;
-    volatile const char *xp = &x[0];
-    volatile const char *yp = &y[0];
-    for (size_t i = 0; i < x.size(); ++i) {
-        ch |= (xp[i] ^ yp[i]);
+    const char *const end = data + size;
+    const char *start = data;
+    for (const char *nl; (nl = static_cast<const char*>(
+                memchr(start, '\n', end - start))) != nullptr; start = nl + 1) {
+        if (partial.empty()) {
+            writeLine(id, index, start, nl - start);
+        } else {
+            partial.append(start, nl);
+            writeLine(id, index, partial.data(), partial.size());
+            partial.clear();
+        }
+    }
+    partial.append(start, end);
+    // The output has been written, so return the whole window.
+    Packet p = { sizeof(Packet), Packet::Type::IncreaseWindow };
+    p.u.window.amount = size;
+    p.u.window.channel = index == 0 ? Channel::Output : Channel::Error;
+    std::array<char, sizeof(FrameHeader) + sizeof(Packet)> buf;
+    memcpy(&buf[sizeof(FrameHeader)], &p, sizeof(p));
+    if (!mux_.writeFrame(sessionChannel(id, Channel::Control), buf.data(), sizeof(p))) {
+        fatalConnectionBroken();
     }
-    return ch == 0;
 }
 
-static int acceptClientAndAuthenticate(Socket &socket, const std::string &key) {
-    const int cs = socket.accept();
-    std::string checkBuf;
-    checkBuf.resize(key.size());
-    size_t i = 0;
-    while (i < checkBuf.size()) {
-        const size_t remaining = checkBuf.size() - i;
-        const ssize_t actual = read(cs, &checkBuf[i], remaining);
-        assert(actual > 0 && static_cast<size_t>(actual) <= remaining);
-        i += actual;
+// Records the exit status (or, with -1, another EOF), and ends the session
+// once its child has exited and both streams are done.
+void MultiRunner::finishSession(uint32_t id, int exitStatus) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    const auto it = sessions_.find(id);
+    if (it == sessions_.end()) {
+        g_terminalState.fatal("internal error: status for unknown session %u\n", id);
     }
-    if (!secureStrEqual(checkBuf, key)) {
-        fatal("error: key check failed\n");
+    if (exitStatus != -1) {
+        it->second.exited = true;
+        exitStatus_ = std::max(exitStatus_, exitStatus);
+    }
+    if (it->second.exited && it->second.eofCount == 2) {
+        sessions_.erase(it);
+        sessionFinished_.notify_all();
     }
-    return cs;
 }
 
-class TerminalState {
-private:
-    std::mutex mutex_;
-    bool inRawMode_ = false;
-    bool modeValid_[2] = {false, false};
-    termios mode_[2] = {};
+void MultiRunner::writeLine(uint32_t id, int index, const char *data, size_t size) {
+    std::string line = "[" + std::to_string(id) + "] ";
+    line.append(data, size);
+    line.push_back('\n');
+    if (!writeAllRestarting(index == 0 ? STDOUT_FILENO : STDERR_FILENO,
+                            line.data(), line.size())) {
+        // Nothing is left to show the output to.
+        g_terminalState.exitCleanly(1);
+    }
+}
 
+// --replay: stands in for the backend, playing a recording's received
+// packets and output into mainLoop over loopback sockets.  Output is paced as
+// recorded, or sent as fast as the windows the frontend grants allow, so the
+// console and ack path can be measured against real traffic without WSL.
+// Only the packets that end the session are replayed; the rest (acks for
+// input, BackendPath, stats) belong to the original run.
+class ReplayBackend {
 public:
-    void enterRawMode();
+    ReplayBackend(FILE *fp, bool maxSpeed, const WindowParams &windowParams,
+                  int controlFd, int inputFd, int outputFd, int errorFd) :
+        fp_(fp), maxSpeed_(maxSpeed), windowParams_(windowParams),
+        controlFd_(controlFd), inputFd_(inputFd)
+    {
+        streams_[0].fd = outputFd;
+        streams_[1].fd = errorFd;
+    }
+
+    // Starts playing on background threads.
+    void start();
+    void handlePacket(const Packet &p);
 
 private:
-    void leaveRawMode(const std::lock_guard<std::mutex> &lock);
+    struct Stream {
+        // -1 once closed.  run() closes it while the control reader looks
+        // it up in handlePacket.
+        std::atomic<int> fd = { -1 };
+        ChannelWindow window;
+        int32_t locWindow = 0;
+    };
 
-public:
-    void fatal(const char *fmt, ...)
-        __attribute__((noreturn))
-        __attribute__((format(printf, 2, 3)));
-    void fatalv(const char *fmt, va_list ap) __attribute__((noreturn));
-    void exitCleanly(int exitStatus);
+    void run();
+    void sendData(Channel channel, const char *data, size_t size);
+    void sendPacket(const Packet &p);
+    Stream *stream(Channel channel);
+
+    FILE *const fp_;
+    const bool maxSpeed_;
+    const WindowParams windowParams_;
+    const int controlFd_;
+    const int inputFd_;
+    Stream streams_[2];
 };
 
-// Put the input terminal into non-canonical mode.
-void TerminalState::enterRawMode() {
-    std::lock_guard<std::mutex> lock(mutex_);
+static void handleReplayPacket(ReplayBackend *replay, const Packet &p) {
+    replay->handlePacket(p);
+}
 
-    assert(!inRawMode_);
-    inRawMode_ = true;
+void ReplayBackend::start() {
+    for (Stream &s : streams_) {
+        s.locWindow = windowParams_.size;
+    }
+    IoThread(readControlSocketThread<ReplayBackend, handleReplayPacket,
+                                     fatalConnectionBroken>,
+             controlFd_, this).detach();
+    // The input goes nowhere.
+    IoThread([this]() {
+        std::array<char, 4096> buf;
+        while (readRestarting(inputFd_, buf.data(), buf.size()) > 0) {}
+    }).detach();
+    IoThread(&ReplayBackend::run, this).detach();
+}
 
-    for (int i = 0; i < 2; ++i) {
-        if (!isatty(i)) {
-            modeValid_[i] = false;
-        } else {
-            if (tcgetattr(i, &mode_[i]) < 0) {
-                fatalPerror("tcgetattr failed");
-            }
-            modeValid_[i] = true;
+void ReplayBackend::handlePacket(const Packet &p) {
+    if (p.type == Packet::Type::IncreaseWindow) {
+        Stream *const s = stream(p.u.window.channel);
+        if (s != nullptr) {
+            s->window.increase(p.u.window.amount, windowParams_.max);
         }
     }
+}
 
-    if (modeValid_[0]) {
-        termios buf;
-        if (tcgetattr(0, &buf) < 0) {
-            fatalPerror("tcgetattr failed");
+ReplayBackend::Stream *ReplayBackend::stream(Channel channel) {
+    Stream *const s =
+        channel == Channel::Output ? &streams_[0] :
+        channel == Channel::Error ? &streams_[1] : nullptr;
+    return s != nullptr && s->fd != -1 ? s : nullptr;
+}
+
+void ReplayBackend::run() {
+    Packet hello = { sizeof(Packet), Packet::Type::Hello };
+    hello.u.hello.protocol = kProtocolVersion;
+    sendPacket(hello);
+    const auto start = std::chrono::steady_clock::now();
+    bool exited = false;
+    std::vector<char> buf;
+    RecordHeader header = {};
+    while (fread(&header, sizeof(header), 1, fp_) == 1) {
+        buf.resize(header.size);
+        if (header.size > 0 && fread(buf.data(), header.size, 1, fp_) != 1) {
+            break;
         }
-        buf.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
-        buf.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
-        buf.c_cflag &= ~(CSIZE | PARENB);
-        buf.c_cflag |= CS8;
-        buf.c_cc[VMIN] = 1;  // blocking read
-        buf.c_cc[VTIME] = 0;
-        if (tcsetattr(0, TCSAFLUSH, &buf) < 0) {
-            fatalPerror("tcsetattr failed");
+        if (header.sent) {
+            continue;
         }
-    }
-
-    if (modeValid_[1]) {
-        termios buf;
-        if (tcgetattr(1, &buf) < 0) {
-            fatalPerror("tcgetattr failed");
+        if (!maxSpeed_) {
+            std::this_thread::sleep_until(start + std::chrono::microseconds(header.time));
         }
-        buf.c_cflag &= ~(CSIZE | PARENB);
-        buf.c_cflag |= CS8;
-        buf.c_oflag &= ~OPOST;
-        if (tcsetattr(1, TCSAFLUSH, &buf) < 0) {
-            fatalPerror("tcsetattr failed");
+        const auto channel = static_cast<Channel>(header.channel);
+        if (channel != Channel::Control) {
+            sendData(channel, buf.data(), header.size);
+            continue;
+        }
+        AnyPacket packet = {};
+        if (!copyPacket(packet, buf.data(), header.size)) {
+            g_terminalState.fatal("error: the recording is corrupt\n");
+        }
+        if (packet.base.type == Packet::Type::ChildExitStatus ||
+                packet.base.type == Packet::Type::SpawnFailed) {
+            exited = true;
+            sendPacket(packet.base);
         }
     }
+    // A recording cut short still ends the session.
+    for (Stream &s : streams_) {
+        if (s.fd != -1) {
+            shutdown(s.fd, SHUT_WR);
+            s.fd = -1;
+        }
+    }
+    if (!exited) {
+        Packet p = { sizeof(Packet), Packet::Type::ChildExitStatus };
+        p.u.exitStatus = 0;
+        sendPacket(p);
+    }
 }
 
-void TerminalState::leaveRawMode(const std::lock_guard<std::mutex> &lock) {
-    if (!inRawMode_) {
+void ReplayBackend::sendData(Channel channel, const char *data, size_t size) {
+    Stream *const s = stream(channel);
+    if (s == nullptr) {
+        g_terminalState.fatal("error: the recording has unexpected data on channel %d\n",
+            static_cast<int>(channel));
+    }
+    if (size == 0) {
+        shutdown(s->fd, SHUT_WR);
+        s->fd = -1;
         return;
     }
-    for (int i = 0; i < 2; ++i) {
-        if (modeValid_[i]) {
-            if (tcsetattr(i, TCSAFLUSH, &mode_[i]) < 0) {
-                fatalPerror("error restoring terminal mode");
-            }
+    while (size > 0) {
+        s->window.wait(s->locWindow, windowParams_);
+        const size_t amt = std::min<size_t>(size, s->locWindow);
+        if (!writeAllRestarting(s->fd, data, amt)) {
+            // The frontend stopped reading; it will exit on its own.
+            return;
         }
+        s->locWindow -= amt;
+        data += amt;
+        size -= amt;
     }
 }
 
-// This function cannot be used from a signal handler.
-void TerminalState::fatal(const char *fmt, ...) {
-    va_list ap;
-    va_start(ap, fmt);
-    this->fatalv(fmt, ap);
-    va_end(ap);
+void ReplayBackend::sendPacket(const Packet &p) {
+    if (!writeAllRestarting(controlFd_, &p, p.size)) {
+        fatalConnectionBroken();
+    }
 }
 
-void TerminalState::fatalv(const char *fmt, va_list ap) {
-    std::lock_guard<std::mutex> lock(mutex_);
-    leaveRawMode(lock);
-    ::fatalv(fmt, ap);
+// Returns a connected pair of loopback sockets: ours, and the backend's.
+static std::pair<int, int> loopbackPair(int bufferSize) {
+    Socket listener(bufferSize);
+    const int s = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    assert(s >= 0);
+    setSocketBufferSize(s, bufferSize);
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(listener.port());
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(s, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) != 0) {
+        fatalPerror("error: could not connect a loopback socket");
+    }
+    setSocketNoDelay(s);
+    return std::make_pair(listener.accept(), s);
 }
 
-void TerminalState::exitCleanly(int exitStatus) {
-    std::lock_guard<std::mutex> lock(mutex_);
-    leaveRawMode(lock);
-    fflush(stdout);
-    fflush(stderr);
-    // Avoid calling exit, which would call global destructors and destruct the
-    // WakeupFd object.
-    _exit(exitStatus);
+static void runReplay(const std::string &path, bool maxSpeed,
+                      WindowParams windowParams, BufferParams bufferParams,
+                      int ackIntervalUs, int resizeIntervalUs,
+                      CoalesceParams coalesce, bool skipRedraws,
+                      bool statsEnabled, int socketBufferSize) __attribute__((noreturn));
+static void runReplay(const std::string &path, bool maxSpeed,
+                      WindowParams windowParams, BufferParams bufferParams,
+                      int ackIntervalUs, int resizeIntervalUs,
+                      CoalesceParams coalesce, bool skipRedraws,
+                      bool statsEnabled, int socketBufferSize) {
+    FILE *const fp = fopen(path.c_str(), "rb");
+    if (fp == nullptr) {
+        fatal("error: could not open '%s': %s\n", path.c_str(), strerror(errno));
+    }
+    RecordingHeader header = {};
+    if (fread(&header, sizeof(header), 1, fp) != 1 ||
+            memcmp(header.magic, kRecordingMagic, sizeof(header.magic)) != 0) {
+        fatal("error: '%s' is not a wslbridge recording\n", path.c_str());
+    }
+    const bool usePty = (header.flags & kRecordingPty) != 0;
+    const auto control = loopbackPair(socketBufferSize);
+    const auto input = loopbackPair(socketBufferSize);
+    const auto output = loopbackPair(socketBufferSize);
+    const auto error = usePty ? std::make_pair(-1, -1) : loopbackPair(socketBufferSize);
+    // Leaked, like the rest of mainLoop's state.
+    ReplayBackend *const replay = new ReplayBackend(
+        fp, maxSpeed, windowParams,
+        control.second, input.second, output.second, error.second);
+    replay->start();
+    mainLoop(std::string(), usePty, false,
+             control.first, input.first, output.first, error.first,
+             terminalSize(), windowParams, bufferParams, ackIntervalUs,
+             resizeIntervalUs, 0, false, coalesce, skipRedraws, statsEnabled, nullptr);
+    abort();
 }
 
-static TerminalState g_terminalState;
+// --push and --pull: copies one file into or out of WSL instead of running a
+// command.  The backend, started with --receive-file or --send-file, connects
+// several times to the -0 port, and each connection carries its share of the
+// chunks (see kTransferChunkSize).  A receiving connection reads its next
+// chunk whole while the others are written, then writes it in its turn.
+struct TransferParams {
+    bool push = false;
+    std::string localPath;
+    std::string remotePath;
+    int streams = kDefaultTransferStreams;
+    bool resume = false;
+};
 
-struct IoLoop {
-    std::string spawnCwd;
-    bool usePty = false;
-    std::mutex mutex;
-    bool ioFinished = false;
-    int controlSocketFd = -1;
-    bool childReaped = false;
-    int childExitStatus = -1;
+static std::vector<std::wstring> transferBackendArgs(const TransferParams &params,
+                                                     int socketBufferSize) {
+    std::vector<std::wstring> args;
+    args.push_back((params.push ? L"--receive-file=" : L"--send-file=") +
+                   mbsToWcs(params.remotePath));
+    args.push_back(L"--streams=" + std::to_wstring(params.streams));
+    if (params.push && params.resume) {
+        args.push_back(L"--resume");
+    }
+    if (socketBufferSize != 0) {
+        args.push_back(L"-S" + std::to_wstring(socketBufferSize));
+    }
+    return args;
+}
+
+class FileTransfer {
+public:
+    FileTransfer(const TransferParams &params, int controlSocket) :
+        params_(params), controlSocket_(controlSocket) {}
+    void run(Socket &dataSocket, const std::string &key) __attribute__((noreturn));
+
+private:
+    Packet readPacket();
+    Packet readOffset(Packet::Type type);
+    void writePacket(const Packet &p);
+    void openSource();
+    void openDestination();
+    void sendChunks(int s, int stream);
+    void receiveChunks(int s, int stream);
+
+    const TransferParams params_;
+    const int controlSocket_;
+    int fd_ = -1;
+    TransferLayout layout_ = {};
+    TransferTurns turns_;
 };
 
-static void fatalConnectionBroken() {
-    g_terminalState.fatal("\nwslbridge error: connection broken\n");
+Packet FileTransfer::readPacket() {
+    Packet p = {};
+    if (!readAllRestarting(controlSocket_, &p, sizeof(p)) || p.size != sizeof(p)) {
+        fatalConnectionBroken();
+    }
+    return p;
 }
 
-static void writePacket(IoLoop &ioloop, const Packet &p) {
-    assert(p.size >= sizeof(p));
-    std::lock_guard<std::mutex> lock(ioloop.mutex);
-    if (!writeAllRestarting(ioloop.controlSocketFd,
-            reinterpret_cast<const char*>(&p), p.size)) {
+// Reads the backend's TransferInfo or TransferStart, or reports why it
+// couldn't open or read its file.
+Packet FileTransfer::readOffset(Packet::Type type) {
+    const Packet p = readPacket();
+    if (p.type == Packet::Type::TransferFailed) {
+        g_terminalState.fatal("error: could not open '%s' in WSL: %s\n",
+                              params_.remotePath.c_str(),
+                              errorString(p.u.transferError).c_str());
+    } else if (p.type != type) {
         fatalConnectionBroken();
     }
+    return p;
 }
 
-static void parentToSocketThread(int socketFd) {
-    std::array<char, 8192> buf;
-    while (true) {
-        const ssize_t amt1 = readRestarting(STDIN_FILENO, buf.data(), buf.size());
-        if (amt1 <= 0) {
-            // If we reach EOF reading from stdin, propagate EOF to the child.
-            close(socketFd);
-            break;
-        }
-        if (!writeAllRestarting(socketFd, buf.data(), amt1)) {
-            // We don't propagate EOF backwards, but we do let data build up.
-            break;
-        }
+void FileTransfer::writePacket(const Packet &p) {
+    if (!writeAllRestarting(controlSocket_, &p, sizeof(p))) {
+        fatalConnectionBroken();
     }
 }
 
-static void socketToParentThread(IoLoop *ioloop, bool isErrorPipe, int socketFd, int outFd) {
-    uint32_t bytesWritten = 0;
-    std::array<char, 32 * 1024> buf;
-    while (true) {
-        const ssize_t amt1 = readRestarting(socketFd, buf.data(), buf.size());
-        if (amt1 == 0) {
-            std::lock_guard<std::mutex> lock(ioloop->mutex);
-            ioloop->ioFinished = true;
-            g_wakeupFd->set();
-            break;
-        }
-        if (amt1 < 0) {
-            break;
-        }
-        if (!writeAllRestarting(outFd, buf.data(), amt1)) {
-            if (!ioloop->usePty && !isErrorPipe) {
-                // ssh seems to propagate an stdout EOF backwards to the remote
-                // program, so do the same thing.  It doesn't do this for
-                // stderr, though, where the remote process is allowed to block
-                // forever.
-                Packet p = { sizeof(Packet), Packet::Type::CloseStdoutPipe };
-                writePacket(*ioloop, p);
-            }
-            shutdown(socketFd, SHUT_RDWR);
-            break;
-        }
-        bytesWritten += amt1;
-        if (bytesWritten >= kOutputWindowSize / 2) {
-            Packet p = { sizeof(Packet), Packet::Type::IncreaseWindow };
-            p.u.window.amount = bytesWritten;
-            p.u.window.isErrorPipe = isErrorPipe;
-            writePacket(*ioloop, p);
-            bytesWritten = 0;
-        }
+static void noteTransferRestarted(const std::string &path) {
+    fprintf(stderr, "wslbridge warning: '%s' doesn't match the file being sent; "
+                    "starting over\n", path.c_str());
+}
+
+void FileTransfer::openSource() {
+    const char *const path = params_.localPath.c_str();
+    struct stat st = {};
+    fd_ = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd_ < 0 || fstat(fd_, &st) != 0) {
+        g_terminalState.fatal("error: could not open '%s': %s\n", path, strerror(errno));
+    } else if (!S_ISREG(st.st_mode)) {
+        g_terminalState.fatal("error: '%s' is not a regular file\n", path);
+    }
+    layout_.size = st.st_size;
+    writePacket(transferOffsetPacket(Packet::Type::TransferInfo, layout_.size));
+    const Packet start = readOffset(Packet::Type::TransferStart);
+    layout_.start = transferOffset(start);
+    if (layout_.start > layout_.size) {
+        fatalConnectionBroken();
+    }
+    // Only continue a file whose last bytes match ours.
+    uint32_t checksum = 0;
+    if (!transferChecksum(fd_, layout_.start, checksum)) {
+        g_terminalState.fatal("error: could not read '%s'\n", path);
     }
+    if (checksum != start.u.transferOffset.checksum) {
+        noteTransferRestarted(params_.remotePath);
+        layout_.start = 0;
+    }
+    writePacket(transferOffsetPacket(Packet::Type::TransferStart, layout_.start));
 }
 
-static void handlePacket(IoLoop *ioloop, const Packet &p) {
-    switch (p.type) {
-        case Packet::Type::ChildExitStatus: {
-            std::lock_guard<std::mutex> lock(ioloop->mutex);
-            ioloop->childReaped = true;
-            ioloop->childExitStatus = p.u.exitStatus;
-            g_wakeupFd->set();
-            break;
-        }
-        case Packet::Type::SpawnFailed: {
-            const PacketSpawnFailed &psf = reinterpret_cast<const PacketSpawnFailed&>(p);
-            std::string msg;
-            switch (p.u.spawnError.type) {
-                case SpawnError::Type::ForkPtyFailed:
-                    msg = "error: forkpty failed: ";
-                    break;
-                case SpawnError::Type::ChdirFailed:
-                    msg = "error: could not chdir to '" + ioloop->spawnCwd + "': ";
-                    break;
-                case SpawnError::Type::ExecFailed:
-                    msg = "error: could not exec '" + std::string(psf.exe) + "': ";
-                    break;
-                default:
-                    assert(false && "Unhandled SpawnError type");
-            }
-            msg += errorString(p.u.spawnError.error);
-            g_terminalState.fatal("%s\n", msg.c_str());
-            break;
-        }
-        default: {
-            g_terminalState.fatal("internal error: unexpected packet %d\n",
-                static_cast<int>(p.type));
-        }
+void FileTransfer::openDestination() {
+    const char *const path = params_.localPath.c_str();
+    layout_.size = transferOffset(readOffset(Packet::Type::TransferInfo));
+    struct stat st = {};
+    fd_ = open(path, O_RDWR | O_CREAT | O_CLOEXEC | (params_.resume ? 0 : O_TRUNC), 0666);
+    if (fd_ < 0 || fstat(fd_, &st) != 0) {
+        g_terminalState.fatal("error: could not open '%s': %s\n", path, strerror(errno));
+    } else if (!S_ISREG(st.st_mode)) {
+        g_terminalState.fatal("error: '%s' is not a regular file\n", path);
+    }
+    // A file longer than the one being sent isn't a prefix of it.
+    const uint64_t existing = st.st_size;
+    const uint64_t offered = existing <= layout_.size ? existing : 0;
+    uint32_t checksum = 0;
+    if (!transferChecksum(fd_, offered, checksum)) {
+        g_terminalState.fatal("error: could not read '%s'\n", path);
+    }
+    writePacket(transferOffsetPacket(Packet::Type::TransferStart, offered, checksum));
+    layout_.start = transferOffset(readOffset(Packet::Type::TransferStart));
+    if (layout_.start > offered) {
+        fatalConnectionBroken();
+    } else if (layout_.start != offered) {
+        noteTransferRestarted(params_.localPath);
+    }
+    if (existing != layout_.start && ftruncate(fd_, layout_.start) != 0) {
+        g_terminalState.fatal("error: could not truncate '%s': %s\n", path, strerror(errno));
     }
 }
 
-static void mainLoop(const std::string &spawnCwd,
-                     bool usePty, int controlSocketFd,
-                     int inputSocketFd, int outputSocketFd, int errorSocketFd,
-                     TermSize termSize) {
-    IoLoop ioloop;
-    ioloop.spawnCwd = spawnCwd;
-    ioloop.usePty = usePty;
-    ioloop.controlSocketFd = controlSocketFd;
-    std::thread p2s(parentToSocketThread, inputSocketFd);
-    std::thread s2p(socketToParentThread, &ioloop, false, outputSocketFd, STDOUT_FILENO);
-    std::unique_ptr<std::thread> es2p;
-    if (errorSocketFd != -1) {
-        es2p = std::unique_ptr<std::thread>(
-            new std::thread(socketToParentThread, &ioloop, true, errorSocketFd, STDERR_FILENO));
-    }
-    std::thread rcs(readControlSocketThread<IoLoop, handlePacket, fatalConnectionBroken>,
-                    controlSocketFd, &ioloop);
-    int32_t exitStatus = -1;
+void FileTransfer::run(Socket &dataSocket, const std::string &key) {
+    const Packet hello = readPacket();
+    if (hello.type != Packet::Type::Hello) {
+        fatalConnectionBroken();
+    }
+    helloCapabilities(hello);
+    layout_.streams = params_.streams;
+    if (params_.push) {
+        openSource();
+    } else {
+        openDestination();
+    }
 
-    while (true) {
-        g_wakeupFd->wait();
-        const auto newSize = terminalSize();
-        if (newSize != termSize) {
-            Packet p = { sizeof(Packet), Packet::Type::SetSize };
-            p.u.termSize = termSize = newSize;
-            writePacket(ioloop, p);
-        }
-        std::lock_guard<std::mutex> lock(ioloop.mutex);
-        if (ioloop.childReaped && ioloop.ioFinished) {
-            exitStatus = ioloop.childExitStatus;
-            break;
+    // The connections can arrive in any order, so each starts with its index.
+    std::vector<int> sockets(params_.streams, -1);
+    for (int i = 0; i < params_.streams; ++i) {
+        const int s = acceptClientAndAuthenticate(dataSocket, key);
+        uint32_t index = 0;
+        if (!readAllRestarting(s, &index, sizeof(index)) ||
+                index >= sockets.size() || sockets[index] != -1) {
+            fatalConnectionBroken();
         }
+        sockets[index] = s;
     }
+    dataSocket.close();
 
-    // Socket-to-pty I/O is finished already.
-    s2p.join();
+    std::vector<std::unique_ptr<IoThread>> threads;
+    for (int i = 0; i < params_.streams; ++i) {
+        threads.push_back(std::unique_ptr<IoThread>(params_.push
+            ? new IoThread(&FileTransfer::sendChunks, this, sockets[i], i)
+            : new IoThread(&FileTransfer::receiveChunks, this, sockets[i], i)));
+    }
+    for (auto &thread : threads) {
+        thread->join();
+    }
+    if (params_.push && readPacket().type != Packet::Type::TransferDone) {
+        fatalConnectionBroken();
+    }
+    if (close(fd_) != 0) {
+        g_terminalState.fatal("error: could not close '%s': %s\n",
+                              params_.localPath.c_str(), strerror(errno));
+    }
+    g_terminalState.exitCleanly(0);
+}
 
-    // We can't return, because the threads could still be running.  Rather
-    // than shut them down gracefully, which seems hard(?), just let the OS
-    // clean everything up.
-    g_terminalState.exitCleanly(exitStatus);
+void FileTransfer::sendChunks(int s, int stream) {
+    std::unique_ptr<char[]> buf(new char[kTransferChunkSize]);
+    for (uint64_t chunk = stream; chunk < layout_.chunkCount(); chunk += layout_.streams) {
+        const size_t size = layout_.chunkSize(chunk);
+        if (!preadAllRestarting(fd_, buf.get(), size, layout_.chunkOffset(chunk))) {
+            g_terminalState.fatal("error: could not read '%s'\n", params_.localPath.c_str());
+        }
+        if (!writeAllRestarting(s, buf.get(), size)) {
+            fatalConnectionBroken();
+        }
+    }
+    shutdown(s, SHUT_WR);
+}
+
+void FileTransfer::receiveChunks(int s, int stream) {
+    std::unique_ptr<char[]> buf(new char[kTransferChunkSize]);
+    for (uint64_t chunk = stream; chunk < layout_.chunkCount(); chunk += layout_.streams) {
+        const size_t size = layout_.chunkSize(chunk);
+        if (!readAllRestarting(s, buf.get(), size)) {
+            fatalConnectionBroken();
+        }
+        turns_.wait(chunk);
+        if (!pwriteAllRestarting(fd_, buf.get(), size, layout_.chunkOffset(chunk))) {
+            g_terminalState.fatal("error: could not write '%s': %s\n",
+                                  params_.localPath.c_str(), strerror(errno));
+        }
+        turns_.finish(chunk);
+    }
 }
 
 static bool pathExists(const std::wstring &path) {
@@ -559,7 +2766,9 @@ normalizePath(const std::wstring &path) {
     return std::make_pair(std::move(npath), fsname.data());
 }
 
-static std::wstring convertPathToWsl(const std::wstring &path) {
+// Returns the /mnt/<LTR> path for a Windows path on a letter drive, or an
+// empty string if WSL can't reach the path that way.
+static std::wstring drivePathToWsl(const std::wstring &path) {
     const auto isSlash = [](wchar_t ch) -> bool {
         return ch == L'/' || ch == L'\\';
     };
@@ -578,6 +2787,14 @@ static std::wstring convertPathToWsl(const std::wstring &path) {
             return ret;
         }
     }
+    return {};
+}
+
+static std::wstring convertPathToWsl(const std::wstring &path) {
+    auto ret = drivePathToWsl(path);
+    if (!ret.empty()) {
+        return ret;
+    }
     fatal(
         "error: the backend program '%s' must be located on a "
         "letter drive so WSL can access it with a /mnt/<LTR> path\n",
@@ -642,9 +2859,136 @@ static void usage(const char *prog) {
     printf("  --backend BACKEND\n");
     printf("                Overrides the default path to wslbridge-backend. BACKEND is a\n");
     printf("                Cygwin-style path (not a WSL path).\n");
+    printf("  --window-size BYTES\n");
+    printf("                Sets the initial flow-control window for the child's output\n");
+    printf("                (default %d).\n", kDefaultWindowSize);
+    printf("  --window-threshold BYTES\n");
+    printf("                Sets the minimum window the backend waits for before\n");
+    printf("                reading more output (default: a quarter of the window).\n");
+    printf("  --window-max BYTES\n");
+    printf("                Lets the window grow up to BYTES, based on the measured\n");
+    printf("                round-trip time and how fast output is consumed.\n");
+    printf("  --input-buffer BYTES, --output-buffer BYTES\n");
+    printf("                Sets the size of the buffers that stdin and the child's\n");
+    printf("                output are read into (defaults %d and %d, at most %d).\n",
+           kDefaultInputBufferSize, kDefaultOutputBufferSize, kMaxBufferSize);
+    printf("                With --mux, each read still fits in one %u-byte frame.\n",
+           kMaxFramePayload);
+    printf("  --bulk        Tunes for streaming large amounts of data through pipes:\n");
+    printf("                input and output buffers default to %d bytes, and the\n",
+           kBulkBufferSize);
+    printf("                window to %d.  Does not use a pty.\n", kBulkWindowSize);
+    printf("  --mux         Carries all I/O over a single connection to the backend.\n");
+    printf("  --epoll       Runs the backend's I/O on one epoll thread rather than a\n");
+    printf("                thread per stream.\n");
+    printf("  --compress    Compresses the child's output in transit, for bulk\n");
+    printf("                transfers.  Output that doesn't compress is sent as-is.\n");
+    printf("  --daemon      Runs the command through a persistent backend, started on\n");
+    printf("                first use, so later invocations skip bash.exe's startup.\n");
+    printf("                Implies --mux.  The backend's port and key are kept in\n");
+    printf("                ~/.wslbridge-daemon.\n");
+    printf("  --daemon-pool N\n");
+    printf("                When starting the daemon, has it keep N sessions (at most\n");
+    printf("                %d) with their child process forked and waiting, so a\n",
+           kMaxPoolSize);
+    printf("                launch only has to exec the command.\n");
+    printf("  --daemon-pool-idle SECONDS\n");
+    printf("                Lets the daemon's pool go after SECONDS without a launch;\n");
+    printf("                the next launch refills it (default %d).\n",
+           kDefaultPoolIdleSeconds);
+    printf("  --multi JOBS  Runs each line of stdin as a separate command (with sh -c),\n");
+    printf("                up to JOBS at a time, through one backend and connection.\n");
+    printf("                Each line of output is prefixed with the command's line\n");
+    printf("                number.  Exits with the highest exit status.\n");
+    printf("  --trace-startup FILE\n");
+    printf("                Times each phase of startup on both sides and writes\n");
+    printf("                the timeline to FILE as Chrome trace-event JSON on exit.\n");
+    printf("  --record FILE Writes every packet and block of output the session\n");
+    printf("                exchanges with the backend to FILE, with timestamps.\n");
+    printf("                Input read from stdin is not recorded.\n");
+    printf("  --replay FILE Plays a recording through the frontend in place of a\n");
+    printf("                backend, without starting WSL.\n");
+    printf("  --replay-speed recorded|max\n");
+    printf("                Paces the replayed output as it was recorded (default),\n");
+    printf("                or sends it as fast as the frontend accepts it.\n");
+    printf("  --socket-buffer BYTES\n");
+    printf("                Sets the kernel send and receive buffers of each connection\n");
+    printf("                to the backend, on both sides (default: the OS's choice).\n");
+    printf("  --ack-interval USEC\n");
+    printf("                Batches window acknowledgements for both output streams\n");
+    printf("                into one write per USEC microseconds, unless the backend\n");
+    printf("                would otherwise stall (default %d).\n", kDefaultAckIntervalUs);
+    printf("  --resize-interval USEC\n");
+    printf("                Sends terminal size changes at most once per USEC\n");
+    printf("                microseconds while a window is being resized.  The final\n");
+    printf("                size is always sent (default %d).\n", kDefaultResizeIntervalUs);
+    printf("  --ping-interval USEC\n");
+    printf("                With --stats, pings the backend over the control connection\n");
+    printf("                every USEC microseconds and reports the round trips\n");
+    printf("                (default 0, disabled).\n");
+    printf("  --coalesce USEC\n");
+    printf("                Collects output that arrives in quick succession for up to\n");
+    printf("                USEC microseconds and writes it to the console together.\n");
+    printf("                Output after a pause is still written immediately (default\n");
+    printf("                0, disabled).\n");
+    printf("  --coalesce-bytes BYTES\n");
+    printf("                Writes coalesced output once BYTES are collected (default %zu).\n",
+           kDefaultCoalesceBytes);
+    printf("  --skip-redraws\n");
+    printf("                When the console falls behind a pty session, drops the\n");
+    printf("                queued output that a later full-screen clear paints over,\n");
+    printf("                keeping only mode and colour changes.  Has no effect\n");
+    printf("                without a pty.\n");
+    printf("  --stats       Prints I/O statistics for both sides on exit, and whenever\n");
+    printf("                wslbridge receives SIGUSR1.  With a pty, this includes how\n");
+    printf("                long keystrokes take to be echoed.\n");
+    printf("  --bench throughput|latency\n");
+    printf("                Measures the bridge instead of running a command.  The\n");
+    printf("                backend generates output, or echoes each keystroke, and\n");
+    printf("                the results are printed as percentiles.  Uses pipes unless\n");
+    printf("                -t is given.\n");
+    printf("  --bench-bytes BYTES\n");
+    printf("                Output to generate for --bench throughput (default %lld).\n",
+           kDefaultBenchBytes);
+    printf("  --bench-count N\n");
+    printf("                Keystrokes to time for --bench latency (default %d).\n",
+           kDefaultBenchCount);
+    printf("  --push LOCAL WSLPATH\n");
+    printf("                Copies the file LOCAL into WSL as WSLPATH instead of running\n");
+    printf("                a command.  A relative WSLPATH is in the current directory.\n");
+    printf("  --pull WSLPATH LOCAL\n");
+    printf("                Copies the file WSLPATH out of WSL as LOCAL.\n");
+    printf("  --streams N   Splits a --push or --pull across N connections (default\n");
+    printf("                %d, at most %d).\n", kDefaultTransferStreams, kMaxTransferStreams);
+    printf("  --resume      Continues an interrupted --push or --pull from the part\n");
+    printf("                of the file already copied, rather than starting over.\n");
+    printf("                Only the last 4 MiB copied is checked against the source;\n");
+    printf("                if it differs, the copy starts over.\n");
     exit(0);
 }
 
+static int32_t parseWindowOption(const char *opt, const char *arg) {
+    char *end = nullptr;
+    const long val = strtol(arg, &end, 10);
+    if (end == arg || *end != '\0' || val < 1 || val > kMaxWindowSize) {
+        fatal("error: the %s argument '%s' must be between 1 and %d\n",
+              opt, arg, kMaxWindowSize);
+    }
+    return val;
+}
+
+static int32_t parseBufferOption(const char *opt, const char *arg) {
+    char *end = nullptr;
+    const long val = strtol(arg, &end, 10);
+    if (end == arg || *end != '\0' || val < 1 || val > kMaxBufferSize) {
+        fatal("error: the %s argument '%s' must be between 1 and %d\n",
+              opt, arg, kMaxBufferSize);
+    }
+    return val;
+}
+
+// The variables to set in the child, kept as VAR=value strings in the
+// frontend's locale until they're put on the backend's command line.
 class Environment {
 public:
     void set(const std::string &var) {
@@ -655,24 +2999,42 @@ public:
     }
 
     void set(const std::string &var, const std::string &value) {
-        pairs_.push_back(std::make_pair(mbsToWcs(var), mbsToWcs(value)));
+        std::string pair;
+        pair.reserve(var.size() + 1 + value.size());
+        pair.append(var);
+        pair.push_back('=');
+        pair.append(value);
+        pairs_.push_back(std::move(pair));
     }
 
-    bool hasVar(const std::wstring &var) {
+    bool hasVar(const std::string &var) {
         for (const auto &pair : pairs_) {
-            if (pair.first == var) {
+            if (pair.size() > var.size() && pair[var.size()] == '=' &&
+                    !pair.compare(0, var.size(), var)) {
                 return true;
             }
         }
         return false;
     }
 
-    const std::vector<std::pair<std::wstring, std::wstring>> &pairs() { return pairs_; }
+    const std::vector<std::string> &pairs() { return pairs_; }
 
 private:
-    std::vector<std::pair<std::wstring, std::wstring>> pairs_;
+    std::vector<std::string> pairs_;
 };
 
+// Tells the backend our version, protocol, and capabilities (in hex).
+static std::wstring versionCheckArg() {
+    wchar_t caps[16];
+    swprintf(caps, 16, L"%x", kCapabilities);
+    return L"--check-version=" STRINGIFY(WSLBRIDGE_VERSION) L"/" +
+        std::to_wstring(kProtocolVersion) + L"/" + caps;
+}
+
+// Room for the connection arguments put before the rest on the backend's
+// command line.
+const size_t kBackendArgsReserve = 256;
+
 static void appendBashArg(std::wstring &out, const std::wstring &arg) {
     if (!out.empty()) {
         out.push_back(L' ');
@@ -706,26 +3068,19 @@ static void appendBashArg(std::wstring &out, const std::wstring &arg) {
         out.append(arg);
         return;
     }
-    bool inQuote = false;
-    const auto enterQuote = [&](bool newInQuote) {
-        if (inQuote != newInQuote) {
-            out.push_back(L'\'');
-            inQuote = newInQuote;
-        }
-    };
-    enterQuote(true);
-    for (auto ch : arg) {
-        if (ch == L'\'') {
-            enterQuote(false);
-            out.append(L"\\'");
-            enterQuote(true);
-        } else if (isCharSafe(ch)) {
-            out.push_back(ch);
-        } else {
-            out.push_back(ch);
-        }
+    // Single-quote the argument, copying the runs between any single quotes
+    // it contains whole and writing each quote as '\''.
+    out.reserve(out.size() + arg.size() + 2);
+    out.push_back(L'\'');
+    size_t start = 0;
+    size_t quote = 0;
+    while ((quote = arg.find(L'\'', start)) != std::wstring::npos) {
+        out.append(arg, start, quote - start);
+        out.append(L"'\\''");
+        start = quote + 1;
     }
-    enterQuote(false);
+    out.append(arg, start, std::wstring::npos);
+    out.push_back(L'\'');
 }
 
 static std::string errorMessageToString(DWORD err) {
@@ -986,7 +3341,274 @@ static std::string canonicalGuid(std::string guid) {
 
 } // namespace
 
+// The bash -c script that finds the backend: its cached WSL path if there is
+// one, or else a lookup with or without wslpath.
+static std::wstring backendLauncher(const std::wstring &backendPathWin,
+                                    const std::wstring &backendPathWsl,
+                                    const std::string &cachedPathWsl) {
+    std::wstring ret;
+    if (!cachedPathWsl.empty()) {
+        appendBashArg(ret, mbsToWcs(cachedPathWsl));
+        return ret;
+    }
+    ret.append(L"\"$(if [ \"$(command -v wslpath)\" ]; then wslpath");
+    appendBashArg(ret, backendPathWin);
+    ret.append(L" || echo false; else echo");
+    appendBashArg(ret, backendPathWsl);
+    ret.append(L"; fi)\"");
+    return ret;
+}
+
+static std::wstring bashCommandLine(const std::wstring &bashPath,
+                                    const std::string &distroGuid,
+                                    const std::wstring &bashCmdLine) {
+    std::wstring cmdLine;
+    cmdLine.reserve(bashPath.size() + distroGuid.size() + bashCmdLine.size() + 16);
+    cmdLine.append(L"\"");
+    cmdLine.append(bashPath);
+    cmdLine.append(L"\"");
+    if (!distroGuid.empty()) {
+        cmdLine.append(L" ");
+        cmdLine.append(mbsToWcs(distroGuid));
+    }
+    cmdLine.append(L" -c ");
+    appendBashArg(cmdLine, bashCmdLine);
+    return cmdLine;
+}
+
+// With --daemon, the backend to use is remembered in a state file, one per
+// WSL distribution.
+struct DaemonInfo {
+    int port = -1;
+    std::string key;
+    std::string version;
+};
+
+const int kDaemonReplyTimeoutUs = 5000000;
+
+static std::string daemonStatePath(const std::string &distroGuid) {
+    const char *home = getenv("HOME");
+    std::string ret = home && *home ? home : "/tmp";
+    ret.append("/.wslbridge-daemon");
+    if (!distroGuid.empty()) {
+        ret.append("-" + distroGuid);
+    }
+    return ret;
+}
+
+static DaemonInfo readDaemonState(const std::string &path) {
+    DaemonInfo info;
+    FILE *fp = fopen(path.c_str(), "r");
+    if (fp == nullptr) {
+        return info;
+    }
+    int port = -1;
+    char key[128] = {};
+    char version[128] = {};
+    if (fscanf(fp, "%d %127s %127s", &port, key, version) == 3) {
+        info.port = port;
+        info.key = key;
+        info.version = version;
+    }
+    fclose(fp);
+    return info;
+}
+
+static void writeDaemonState(const std::string &path, const DaemonInfo &info) {
+    // The key lets its holder run programs in WSL, so keep the file private.
+    const int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        fprintf(stderr, "wslbridge warning: could not write '%s': %s\n",
+            path.c_str(), strerror(errno));
+        return;
+    }
+    fchmod(fd, 0600);
+    const std::string text =
+        std::to_string(info.port) + " " + info.key + " " + info.version + "\n";
+    if (!writeAllRestarting(fd, text.data(), text.size())) {
+        fprintf(stderr, "wslbridge warning: could not write '%s'\n", path.c_str());
+    }
+    close(fd);
+}
+
+// Connects to a daemon and authenticates.  Returns -1 if nothing there
+// accepts the key, e.g. because the daemon has exited.
+static int connectToDaemon(const DaemonInfo &info, int bufferSize) {
+    const int s = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    assert(s >= 0);
+    setSocketBufferSize(s, bufferSize);
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(info.port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    Packet reply = {};
+    if (connect(s, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) != 0 ||
+            !writeAllRestarting(s, info.key.data(), info.key.size()) ||
+            !waitReadable(s, std::chrono::microseconds(kDaemonReplyTimeoutUs)) ||
+            !readAllRestarting(s, &reply, sizeof(reply)) ||
+            reply.size != sizeof(reply) ||
+            reply.type != Packet::Type::KeyAccepted) {
+        close(s);
+        return -1;
+    }
+    setSocketNoDelay(s);
+    return s;
+}
+
+// Starts a daemon backend through bash.exe and waits for its port.
+static DaemonInfo startDaemon(const std::wstring &bashPath,
+                              const std::string &distroGuid,
+                              const std::wstring &launcher,
+                              const BackendPathCache &backendPathCache,
+                              const std::vector<std::wstring> &daemonArgs) {
+    Socket controlSocket;
+    DaemonInfo info;
+    info.key = randomString();
+    info.version = STRINGIFY(WSLBRIDGE_VERSION);
+
+    std::wstring bashCmdLine = launcher;
+    appendBashArg(bashCmdLine, versionCheckArg());
+    appendBashArg(bashCmdLine, L"--daemon");
+    appendBashArg(bashCmdLine, L"-3" + std::to_wstring(controlSocket.port()));
+    appendBashArg(bashCmdLine, L"-k" + mbsToWcs(info.key));
+    for (const auto &arg : daemonArgs) {
+        appendBashArg(bashCmdLine, arg);
+    }
+    auto cmdLine = bashCommandLine(bashPath, distroGuid, bashCmdLine);
+
+    STARTUPINFOW sui = {};
+    sui.cb = sizeof(sui);
+    PROCESS_INFORMATION pi = {};
+    BOOL success = CreateProcessW(bashPath.c_str(), &cmdLine[0], nullptr, nullptr,
+        false, CREATE_NO_WINDOW, nullptr, nullptr, &sui, &pi);
+    if (!success) {
+        fatal("error starting bash.exe adapter: %s\n",
+            formatErrorMessage(GetLastError()).c_str());
+    }
+    CloseHandle(pi.hThread);
+    success = SetHandleInformation(pi.hProcess, HANDLE_FLAG_INHERIT, HANDLE_FLAG_INHERIT);
+    assert(success && "SetHandleInformation failed");
+    spawnPressReturnProcess(pi.hProcess);
+
+    // The backend keeps bash.exe running until the port has been received.
+    std::atomic<bool> started = { false };
+    std::thread watchdog([&]() {
+        WaitForSingleObject(pi.hProcess, INFINITE);
+        if (!started) {
+            backendPathCache.clear();
+            g_terminalState.fatal("wslbridge error: failed to start backend daemon\n");
+        }
+    });
+
+    const int cs = acceptClientAndAuthenticate(controlSocket, info.key);
+    Packet p = {};
+    if (!readAllRestarting(cs, &p, sizeof(p)) ||
+            p.size != sizeof(p) ||
+            p.type != Packet::Type::DaemonListening) {
+        fatal("error: the backend daemon did not report its port\n");
+    }
+    info.port = p.u.daemonPort;
+    started = true;
+    close(cs);
+    watchdog.join();
+    CloseHandle(pi.hProcess);
+    return info;
+}
+
+// Connects to the remembered daemon, or to a new one, started with
+// daemonArgs, if it's gone or from a different version.  Returns the
+// session's connection.
+static int connectDaemonSession(const std::wstring &bashPath,
+                                const std::string &distroGuid,
+                                const std::wstring &launcher,
+                                const BackendPathCache &backendPathCache,
+                                const std::vector<std::wstring> &daemonArgs,
+                                int bufferSize) {
+    const auto statePath = daemonStatePath(distroGuid);
+    auto info = readDaemonState(statePath);
+    if (info.port != -1 && info.version == STRINGIFY(WSLBRIDGE_VERSION)) {
+        const int s = connectToDaemon(info, bufferSize);
+        if (s != -1) {
+            return s;
+        }
+    }
+    info = startDaemon(bashPath, distroGuid, launcher, backendPathCache, daemonArgs);
+    writeDaemonState(statePath, info);
+    const int s = connectToDaemon(info, bufferSize);
+    if (s == -1) {
+        fatal("error: could not connect to the backend daemon\n");
+    }
+    return s;
+}
+
+static void sendSpawnRequest(int s, const std::vector<std::wstring> &args) {
+    std::string payload;
+    for (const auto &arg : args) {
+        payload.append(wcsToMbs(arg));
+        payload.push_back('\0');
+    }
+    if (payload.size() > kMaxSpawnRequestSize) {
+        fatal("error: the command line is too long for --daemon\n");
+    }
+    Packet p = {
+        static_cast<uint32_t>(sizeof(Packet) + payload.size()),
+        Packet::Type::SpawnRequest
+    };
+    p.u.argCount = args.size();
+    payload.insert(0, reinterpret_cast<const char*>(&p), sizeof(p));
+    if (!writeAllRestarting(s, payload.data(), payload.size())) {
+        fatalConnectionBroken();
+    }
+}
+
+// Sends the child's parameters for --spawn-params.  Like a SpawnRequest's
+// arguments, the strings are in the frontend's locale.
+static void sendSpawnParams(int s, const std::string &cwd,
+                            const std::vector<std::string> &env, TermSize termSize,
+                            const std::vector<std::string> &args) {
+    size_t size = sizeof(Packet) + cwd.size() + 1;
+    for (const auto &str : env) {
+        size += str.size() + 1;
+    }
+    for (const auto &str : args) {
+        size += str.size() + 1;
+    }
+    if (size - sizeof(Packet) > kMaxSpawnRequestSize) {
+        fatal("error: the command line and environment are too long\n");
+    }
+    Packet p = { static_cast<uint32_t>(size), Packet::Type::SpawnParams };
+    p.u.spawnParams.envCount = env.size();
+    p.u.spawnParams.termSize = termSize;
+    std::string payload;
+    payload.reserve(size);
+    payload.append(reinterpret_cast<const char*>(&p), sizeof(p));
+    payload.append(cwd.c_str(), cwd.size() + 1);
+    for (const auto &str : env) {
+        payload.append(str.c_str(), str.size() + 1);
+    }
+    for (const auto &str : args) {
+        payload.append(str.c_str(), str.size() + 1);
+    }
+    if (!writeAllRestarting(s, payload.data(), payload.size())) {
+        fatalConnectionBroken();
+    }
+}
+
+// A daemon session starts in the frontend's directory, as bash.exe does,
+// when WSL can reach it.
+static std::string daemonSessionCwd() {
+    wchar_t *winPath = static_cast<wchar_t*>(
+        cygwin_create_path(CCP_POSIX_TO_WIN_W, "."));
+    std::wstring ret;
+    if (winPath != nullptr) {
+        ret = drivePathToWsl(winPath);
+        free(winPath);
+    }
+    return ret.empty() ? "~" : wcsToMbs(ret);
+}
+
 int main(int argc, char *argv[]) {
+    const int64_t mainStart = traceClockMicros();
     setlocale(LC_ALL, "");
     cygwin_internal(CW_SYNC_WINENV);
     g_wakeupFd = new WakeupFd();
@@ -999,10 +3621,41 @@ int main(int argc, char *argv[]) {
     std::string spawnCwd;
     std::string distroGuid;
     std::string customBackendPath;
+    int32_t windowSize = 0;
+    int32_t windowThreshold = -1;
+    int32_t windowMax = -1;
+    // Zero means unset, so --bulk can pick the defaults.
+    BufferParams bufferParams = { 0, 0 };
+    int socketBufferSize = 0;
+    std::string tracePath;
+    std::string recordPath;
+    std::string replayPath;
+    bool replayMaxSpeed = false;
+    int multiJobs = 0;
+    // Zero means the backend's default.
+    int daemonPool = 0;
+    int daemonPoolIdle = 0;
+    int ackIntervalUs = kDefaultAckIntervalUs;
+    int resizeIntervalUs = kDefaultResizeIntervalUs;
+    int pingIntervalUs = 0;
+    CoalesceParams coalesce;
+    BenchParams benchParams;
     enum class TtyRequest { Auto, Yes, No, Force } ttyRequest = TtyRequest::Auto;
     enum class LoginMode { Auto, Yes, No } loginMode = LoginMode::Auto;
 
     int debugFork = 0;
+    int useMux = 0;
+    int useEpoll = 0;
+    int useStats = 0;
+    int useCompress = 0;
+    int useDaemon = 0;
+    int useBulk = 0;
+    int skipRedraws = 0;
+    int usePush = 0;
+    int usePull = 0;
+    int useResume = 0;
+    // Zero means unset.
+    int transferStreams = 0;
     int c = 0;
     if (argv[0][0] == '-') {
         loginMode = LoginMode::Yes;
@@ -1010,10 +3663,42 @@ int main(int argc, char *argv[]) {
     const struct option kOptionTable[] = {
         { "help",           false, nullptr,     'h' },
         { "debug-fork",     false, &debugFork,  1   },
+        { "mux",            false, &useMux,     1   },
+        { "epoll",          false, &useEpoll,   1   },
+        { "stats",          false, &useStats,   1   },
+        { "compress",       false, &useCompress, 1  },
+        { "daemon",         false, &useDaemon,  1   },
+        { "bulk",           false, &useBulk,    1   },
+        { "skip-redraws",   false, &skipRedraws, 1  },
+        { "push",           false, &usePush,    1   },
+        { "pull",           false, &usePull,    1   },
+        { "resume",         false, &useResume,  1   },
         { "version",        false, nullptr,     'v' },
         { "distro-guid",    true,  nullptr,     'd' },
         { "no-login",       false, nullptr,     'L' },
         { "backend",        true,  nullptr,     'b' },
+        { "window-size",    true,  nullptr,     'w' },
+        { "window-threshold", true, nullptr,    'W' },
+        { "window-max",     true,  nullptr,     'M' },
+        { "ack-interval",   true,  nullptr,     'A' },
+        { "resize-interval", true, nullptr,     'z' },
+        { "ping-interval",  true,  nullptr,     'K' },
+        { "coalesce",       true,  nullptr,     'c' },
+        { "coalesce-bytes", true,  nullptr,     'G' },
+        { "input-buffer",   true,  nullptr,     'i' },
+        { "output-buffer",  true,  nullptr,     'o' },
+        { "socket-buffer",  true,  nullptr,     'S' },
+        { "trace-startup",  true,  nullptr,     'R' },
+        { "record",         true,  nullptr,     'E' },
+        { "replay",         true,  nullptr,     'P' },
+        { "replay-speed",   true,  nullptr,     'Q' },
+        { "multi",          true,  nullptr,     'J' },
+        { "daemon-pool",    true,  nullptr,     'N' },
+        { "daemon-pool-idle", true, nullptr,    'I' },
+        { "bench",          true,  nullptr,     'B' },
+        { "bench-bytes",    true,  nullptr,     'Y' },
+        { "bench-count",    true,  nullptr,     'Z' },
+        { "streams",        true,  nullptr,     'F' },
         { nullptr,          false, nullptr,     0   },
     };
     while ((c = getopt_long(argc, argv, "+e:C:tTl", kOptionTable, nullptr)) != -1) {
@@ -1074,12 +3759,289 @@ int main(int argc, char *argv[]) {
                     fatal("error: the --backend option requires a non-empty string argument\n");
                 }
                 break;
+            case 'w':
+                windowSize = parseWindowOption("--window-size", optarg);
+                break;
+            case 'W':
+                windowThreshold = parseWindowOption("--window-threshold", optarg);
+                break;
+            case 'M':
+                windowMax = parseWindowOption("--window-max", optarg);
+                break;
+            case 'A': {
+                char *end = nullptr;
+                const long val = strtol(optarg, &end, 10);
+                if (end == optarg || *end != '\0' || val < 0 || val > 1000000) {
+                    fatal("error: the --ack-interval argument '%s' must be between 0 and 1000000\n",
+                          optarg);
+                }
+                ackIntervalUs = val;
+                break;
+            }
+            case 'z': {
+                char *end = nullptr;
+                const long val = strtol(optarg, &end, 10);
+                if (end == optarg || *end != '\0' || val < 0 || val > 1000000) {
+                    fatal("error: the --resize-interval argument '%s' must be between 0 and 1000000\n",
+                          optarg);
+                }
+                resizeIntervalUs = val;
+                break;
+            }
+            case 'K': {
+                char *end = nullptr;
+                const long val = strtol(optarg, &end, 10);
+                if (end == optarg || *end != '\0' || val < 0 || val > 60000000) {
+                    fatal("error: the --ping-interval argument '%s' must be between 0 and 60000000\n",
+                          optarg);
+                }
+                pingIntervalUs = val;
+                break;
+            }
+            case 'c': {
+                char *end = nullptr;
+                const long val = strtol(optarg, &end, 10);
+                if (end == optarg || *end != '\0' || val < 0 || val > 1000000) {
+                    fatal("error: the --coalesce argument '%s' must be between 0 and 1000000\n",
+                          optarg);
+                }
+                coalesce.interval = val;
+                break;
+            }
+            case 'G': {
+                char *end = nullptr;
+                const long val = strtol(optarg, &end, 10);
+                if (end == optarg || *end != '\0' || val < 1 ||
+                        val > static_cast<long>(kMaxCoalesceBytes)) {
+                    fatal("error: the --coalesce-bytes argument '%s' must be between 1 and %zu\n",
+                          optarg, kMaxCoalesceBytes);
+                }
+                coalesce.bytes = val;
+                break;
+            }
+            case 'i':
+                bufferParams.input = parseBufferOption("--input-buffer", optarg);
+                break;
+            case 'o':
+                bufferParams.output = parseBufferOption("--output-buffer", optarg);
+                break;
+            case 'R':
+                tracePath = optarg;
+                if (tracePath.empty()) {
+                    fatal("error: the --trace-startup option requires a non-empty string argument\n");
+                }
+                break;
+            case 'E':
+                recordPath = optarg;
+                if (recordPath.empty()) {
+                    fatal("error: the --record option requires a non-empty string argument\n");
+                }
+                break;
+            case 'P':
+                replayPath = optarg;
+                if (replayPath.empty()) {
+                    fatal("error: the --replay option requires a non-empty string argument\n");
+                }
+                break;
+            case 'Q':
+                if (!strcmp(optarg, "recorded")) {
+                    replayMaxSpeed = false;
+                } else if (!strcmp(optarg, "max")) {
+                    replayMaxSpeed = true;
+                } else {
+                    fatal("error: the --replay-speed argument '%s' must be 'recorded' or 'max'\n",
+                          optarg);
+                }
+                break;
+            case 'S': {
+                char *end = nullptr;
+                const long val = strtol(optarg, &end, 10);
+                if (end == optarg || *end != '\0' ||
+                        val < kMinSocketBufferSize || val > kMaxSocketBufferSize) {
+                    fatal("error: the --socket-buffer argument '%s' must be between %d and %d\n",
+                          optarg, kMinSocketBufferSize, kMaxSocketBufferSize);
+                }
+                socketBufferSize = val;
+                break;
+            }
+            case 'J': {
+                char *end = nullptr;
+                const long val = strtol(optarg, &end, 10);
+                if (end == optarg || *end != '\0' || val < 1 || val > 1000) {
+                    fatal("error: the --multi argument '%s' must be between 1 and 1000\n",
+                          optarg);
+                }
+                multiJobs = val;
+                break;
+            }
+            case 'N': {
+                char *end = nullptr;
+                const long val = strtol(optarg, &end, 10);
+                if (end == optarg || *end != '\0' || val < 0 || val > kMaxPoolSize) {
+                    fatal("error: the --daemon-pool argument '%s' must be between 0 and %d\n",
+                          optarg, kMaxPoolSize);
+                }
+                daemonPool = val;
+                break;
+            }
+            case 'I': {
+                char *end = nullptr;
+                const long val = strtol(optarg, &end, 10);
+                if (end == optarg || *end != '\0' || val < 1 || val > 1000000) {
+                    fatal("error: the --daemon-pool-idle argument '%s' must be between 1 and 1000000\n",
+                          optarg);
+                }
+                daemonPoolIdle = val;
+                break;
+            }
+            case 'B':
+                if (!strcmp(optarg, "throughput")) {
+                    benchParams.test = BenchTest::Throughput;
+                } else if (!strcmp(optarg, "latency")) {
+                    benchParams.test = BenchTest::Latency;
+                } else {
+                    fatal("error: the --bench argument '%s' must be 'throughput' or 'latency'\n",
+                          optarg);
+                }
+                break;
+            case 'Y': {
+                char *end = nullptr;
+                benchParams.bytes = strtoll(optarg, &end, 10);
+                if (end == optarg || *end != '\0' || benchParams.bytes < 1) {
+                    fatal("error: the --bench-bytes argument '%s' must be a positive integer\n",
+                          optarg);
+                }
+                break;
+            }
+            case 'Z': {
+                char *end = nullptr;
+                const long val = strtol(optarg, &end, 10);
+                if (end == optarg || *end != '\0' || val < 1 || val > 10000000) {
+                    fatal("error: the --bench-count argument '%s' must be between 1 and 10000000\n",
+                          optarg);
+                }
+                benchParams.count = val;
+                break;
+            }
+            case 'F': {
+                char *end = nullptr;
+                const long val = strtol(optarg, &end, 10);
+                if (end == optarg || *end != '\0' || val < 1 || val > kMaxTransferStreams) {
+                    fatal("error: the --streams argument '%s' must be between 1 and %d\n",
+                          optarg, kMaxTransferStreams);
+                }
+                transferStreams = val;
+                break;
+            }
             default:
                 fatal("Try '%s --help' for more information.\n", argv[0]);
         }
     }
 
+    std::unique_ptr<StartupTimeline> timeline;
+    if (!tracePath.empty()) {
+        timeline = std::unique_ptr<StartupTimeline>(new StartupTimeline);
+        timeline->path = tracePath;
+        timeline->frontend.add("parse options", mainStart, traceClockMicros());
+        g_startupTimeline = timeline.get();
+    }
+    // Times a startup phase, when tracing.
+    const auto tracePhase = [&](const char *name, int64_t start) {
+        if (timeline) {
+            timeline->frontend.add(name, start, traceClockMicros());
+        }
+    };
+
     const bool hasCommand = optind < argc;
+    const bool transferMode = usePush || usePull;
+    TransferParams transfer;
+    if (transferMode) {
+        if (usePush && usePull) {
+            fatal("error: --push and --pull cannot be combined\n");
+        }
+        if (argc - optind != 2) {
+            fatal("error: --push takes LOCAL WSLPATH, and --pull WSLPATH LOCAL\n");
+        }
+        if (benchParams.test != BenchTest::None || !replayPath.empty() || multiJobs > 0 ||
+                useDaemon || useMux || useEpoll || useCompress || useStats ||
+                !tracePath.empty() || !recordPath.empty()) {
+            fatal("error: --push and --pull cannot be combined with --bench, --replay, "
+                  "--multi, --daemon, --mux, --epoll, --compress, --stats, "
+                  "--trace-startup, or --record\n");
+        }
+        // No child runs, so there is nothing for these to apply to.
+        if (!spawnCwd.empty() || !env.pairs().empty()) {
+            fatal("error: --push and --pull cannot be combined with -C or -e\n");
+        }
+        if (windowSize != 0 || windowThreshold != -1 || windowMax != -1 ||
+                bufferParams.input != 0 || bufferParams.output != 0 || useBulk) {
+            fatal("error: --push and --pull cannot be combined with the window "
+                  "or buffer options\n");
+        }
+        if (ttyRequest == TtyRequest::Yes || ttyRequest == TtyRequest::Force) {
+            fatal("error: --push and --pull do not use a pty\n");
+        }
+        transfer.push = usePush;
+        transfer.localPath = argv[usePush ? optind : optind + 1];
+        transfer.remotePath = argv[usePush ? optind + 1 : optind];
+        if (transferStreams != 0) {
+            transfer.streams = transferStreams;
+        }
+        transfer.resume = useResume;
+        ttyRequest = TtyRequest::No;
+        loginMode = LoginMode::No;
+    } else if (transferStreams != 0 || useResume) {
+        fatal("error: --streams and --resume require --push or --pull\n");
+    }
+    const bool benchMode = benchParams.test != BenchTest::None;
+    if (benchMode) {
+        if (hasCommand) {
+            fatal("error: --bench does not take a command\n");
+        }
+        // The benchmark doesn't touch the console, so a pty is only used
+        // when asked for, whether or not stdin is a terminal.
+        ttyRequest = ttyRequest == TtyRequest::Auto || ttyRequest == TtyRequest::No
+            ? TtyRequest::No : TtyRequest::Force;
+        loginMode = LoginMode::No;
+    }
+    const bool replayMode = !replayPath.empty();
+    if (replayMode) {
+        if (hasCommand) {
+            fatal("error: --replay does not take a command\n");
+        }
+        if (benchMode || multiJobs > 0 || useDaemon || useCompress || useMux ||
+                !tracePath.empty() || !recordPath.empty()) {
+            fatal("error: --replay cannot be combined with --bench, --multi, --daemon, "
+                  "--compress, --mux, --trace-startup, or --record\n");
+        }
+        // The recording says whether the session used a pty.
+        ttyRequest = TtyRequest::No;
+        loginMode = LoginMode::No;
+    }
+    const bool multiMode = multiJobs > 0;
+    if (multiMode) {
+        if (hasCommand) {
+            fatal("error: --multi reads its commands from stdin\n");
+        }
+        if (benchMode || useDaemon || useCompress || useStats || !tracePath.empty() ||
+                !recordPath.empty()) {
+            fatal("error: --multi cannot be combined with --bench, --daemon, "
+                  "--compress, --stats, --trace-startup, or --record\n");
+        }
+        if (ttyRequest == TtyRequest::Yes || ttyRequest == TtyRequest::Force) {
+            fatal("error: --multi sessions cannot use a pty\n");
+        }
+        // The sessions share one connection, and run with pipes.
+        ttyRequest = TtyRequest::No;
+        loginMode = LoginMode::No;
+        useMux = 1;
+    }
+    if (useBulk) {
+        if (ttyRequest == TtyRequest::Yes || ttyRequest == TtyRequest::Force) {
+            fatal("error: --bulk cannot be used with a pty\n");
+        }
+        ttyRequest = TtyRequest::No;
+    }
     if (loginMode == LoginMode::Auto) {
         loginMode = hasCommand ? LoginMode::No : LoginMode::Yes;
     }
@@ -1091,8 +4053,42 @@ int main(int argc, char *argv[]) {
         ttyRequest = TtyRequest::No;
     }
     const bool usePty = ttyRequest != TtyRequest::No;
+    if ((daemonPool != 0 || daemonPoolIdle != 0) && !useDaemon) {
+        fatal("error: --daemon-pool and --daemon-pool-idle require --daemon\n");
+    }
+    if (useDaemon) {
+        if (debugFork) {
+            fatal("error: --debug-fork cannot be used with --daemon\n");
+        }
+        // A daemon session has only the one connection.
+        useMux = 1;
+    }
+
+    if (windowSize == 0) {
+        windowSize = useBulk ? kBulkWindowSize : kDefaultWindowSize;
+    }
+    if (bufferParams.input == 0) {
+        bufferParams.input = useBulk ? kBulkBufferSize : kDefaultInputBufferSize;
+    }
+    if (bufferParams.output == 0) {
+        bufferParams.output = useBulk ? kBulkBufferSize : kDefaultOutputBufferSize;
+    }
+    if (windowThreshold == -1) {
+        windowThreshold = std::max(windowSize / 4, 1);
+    } else if (windowThreshold > windowSize) {
+        fatal("error: --window-threshold cannot exceed --window-size\n");
+    }
+    if (windowMax == -1) {
+        windowMax = windowSize;
+    } else if (windowMax < windowSize) {
+        fatal("error: --window-max cannot be less than --window-size\n");
+    }
+    const WindowParams windowParams = { windowSize, windowThreshold, windowMax };
+    if (pingIntervalUs > 0 && !useStats) {
+        fatal("error: --ping-interval requires --stats\n");
+    }
 
-    if (!env.hasVar(L"TERM")) {
+    if (!env.hasVar("TERM")) {
         // This seems to be what OpenSSH is doing.
         if (usePty) {
             const char *termVal = getenv("TERM");
@@ -1105,92 +4101,205 @@ int main(int argc, char *argv[]) {
     // We must register this handler *before* determining the initial terminal
     // size.
     struct sigaction sa = {};
-    sa.sa_handler = [](int signo) { g_wakeupFd->set(); };
+    sa.sa_handler = [](int signo) { g_wakeupFd->set(kWakeupResize); };
     sa.sa_flags = SA_RESTART;
     ::sigaction(SIGWINCH, &sa, nullptr);
     sa = {};
+    if (useStats) {
+        sa.sa_handler = [](int signo) { g_wakeupFd->set(kWakeupStatsRequested); };
+        sa.sa_flags = SA_RESTART;
+        ::sigaction(SIGUSR1, &sa, nullptr);
+        sa = {};
+    }
     // We want to handle EPIPE rather than receiving SIGPIPE.
     signal(SIGPIPE, SIG_IGN);
 
-    Socket controlSocket;
-    Socket inputSocket;
-    Socket outputSocket;
-    std::unique_ptr<Socket> errorSocket;
-    if (!usePty) {
-        errorSocket = std::unique_ptr<Socket>(new Socket);
+    if (replayMode) {
+        runReplay(replayPath, replayMaxSpeed, windowParams, bufferParams,
+                  ackIntervalUs, resizeIntervalUs, coalesce, skipRedraws, useStats,
+                  socketBufferSize);
+    }
+    std::unique_ptr<SessionRecorder> recorder;
+    if (!recordPath.empty()) {
+        recorder = std::unique_ptr<SessionRecorder>(new SessionRecorder(recordPath, usePty));
+        g_recorder = recorder.get();
     }
 
+    const int64_t findStart = traceClockMicros();
     const auto bashPath = findSystemProgram(L"bash.exe");
     const auto backendPathInfo = normalizePath(findBackendProgram(customBackendPath));
     const auto backendPathWin = backendPathInfo.first;
     const auto fsname = backendPathInfo.second;
     const auto backendPathWsl = convertPathToWsl(backendPathWin);
+    BackendPathCache backendPathCache(distroGuid, backendPathWin);
+    const auto cachedPathWsl = backendPathCache.lookup();
+    const auto launcher = backendLauncher(backendPathWin, backendPathWsl, cachedPathWsl);
+    tracePhase("find backend", findStart);
     const auto initialSize = terminalSize();
-    const auto key = randomString();
 
-    // Prepare the backend command line.
-    std::wstring bashCmdLine;
-    bashCmdLine.append(L"\"$(if [ \"$(command -v wslpath)\" ]; then wslpath");
-    appendBashArg(bashCmdLine, backendPathWin);
-    bashCmdLine.append(L" || echo false; else echo");
-    appendBashArg(bashCmdLine, backendPathWsl);
-    bashCmdLine.append(L"; fi)\"");
-
-    if (debugFork) {
-        appendBashArg(bashCmdLine, L"--debug-fork");
+    if (useDaemon && spawnCwd.empty()) {
+        spawnCwd = daemonSessionCwd();
     }
 
-    appendBashArg(bashCmdLine, L"--check-version=" STRINGIFY(WSLBRIDGE_VERSION));
-
-    std::array<wchar_t, 1024> buffer;
-    int iRet = swprintf(buffer.data(), buffer.size(),
-                        L" -3%d -0%d -1%d -k%s -w%d -t%d",
-                        controlSocket.port(),
-                        inputSocket.port(),
-                        outputSocket.port(),
-                        key.c_str(),
-                        kOutputWindowSize,
-                        kOutputWindowSize / 4);
-    assert(iRet > 0);
-    bashCmdLine.append(buffer.data());
-
+    // Prepare the backend arguments, apart from how it connects to us.
+    std::vector<std::wstring> backendArgs;
+    if (useEpoll) {
+        backendArgs.push_back(L"--epoll");
+    }
+    if (useCompress) {
+        backendArgs.push_back(L"--compress");
+    }
+    backendArgs.push_back(L"-w" + std::to_wstring(windowParams.size));
+    backendArgs.push_back(L"-t" + std::to_wstring(windowParams.threshold));
+    backendArgs.push_back(L"-m" + std::to_wstring(windowParams.max));
+    backendArgs.push_back(L"-b" + std::to_wstring(bufferParams.input));
+    backendArgs.push_back(L"-B" + std::to_wstring(bufferParams.output));
+    if (socketBufferSize != 0) {
+        backendArgs.push_back(L"-S" + std::to_wstring(socketBufferSize));
+    }
+    if (timeline) {
+        backendArgs.push_back(L"--trace-startup");
+    }
+    if (useMux) {
+        backendArgs.push_back(L"--mux");
+    }
+    if (multiMode) {
+        backendArgs.push_back(L"--multi");
+    }
+    // A daemon's SpawnRequest already holds whole command lines, and
+    // --multi has none; otherwise the child's parameters are sent after the
+    // control connection, off the bash.exe command line.
+    const bool useSpawnParams = !useDaemon && !multiMode;
+    if (useSpawnParams) {
+        backendArgs.push_back(L"--spawn-params");
+    }
     if (usePty) {
-        iRet = swprintf(buffer.data(), buffer.size(),
-                        L" --pty -c%d -r%d",
-                        initialSize.cols,
-                        initialSize.rows);
+        backendArgs.push_back(L"--pty");
+        if (!useSpawnParams) {
+            backendArgs.push_back(L"-c" + std::to_wstring(initialSize.cols));
+            backendArgs.push_back(L"-r" + std::to_wstring(initialSize.rows));
+        }
     } else {
-        iRet = swprintf(buffer.data(), buffer.size(),
-                        L" --pipes -2%d",
-                        errorSocket->port());
+        backendArgs.push_back(L"--pipes");
     }
-    assert(iRet > 0);
-    bashCmdLine.append(buffer.data());
-
     if (loginMode == LoginMode::Yes) {
-        appendBashArg(bashCmdLine, L"-l");
+        backendArgs.push_back(L"-l");
     }
-    for (const auto &envPair : env.pairs()) {
-        appendBashArg(bashCmdLine, L"-e" + envPair.first + L"=" + envPair.second);
+    if (benchParams.test == BenchTest::Throughput) {
+        backendArgs.push_back(L"--bench-child=output:" + std::to_wstring(benchParams.bytes));
+    } else if (benchParams.test == BenchTest::Latency) {
+        backendArgs.push_back(L"--bench-child=echo");
     }
-    if (!spawnCwd.empty()) {
-        appendBashArg(bashCmdLine, L"-C" + mbsToWcs(spawnCwd));
+    if (!useSpawnParams) {
+        for (const auto &envPair : env.pairs()) {
+            backendArgs.push_back(L"-e" + mbsToWcs(envPair));
+        }
+        if (!spawnCwd.empty()) {
+            backendArgs.push_back(L"-C" + mbsToWcs(spawnCwd));
+        }
+        backendArgs.push_back(L"--");
+        for (int i = optind; i < argc; ++i) {
+            backendArgs.push_back(mbsToWcs(argv[i]));
+        }
     }
-    appendBashArg(bashCmdLine, L"--");
-    for (int i = optind; i < argc; ++i) {
-        appendBashArg(bashCmdLine, mbsToWcs(argv[i]));
+    if (transferMode) {
+        // There's no child, so none of the above applies.
+        backendArgs = transferBackendArgs(transfer, socketBufferSize);
     }
 
-    std::wstring cmdLine;
-    cmdLine.append(L"\"");
-    cmdLine.append(bashPath);
-    cmdLine.append(L"\"");
-    if (!distroGuid.empty()) {
-        cmdLine.append(L" ");
-        cmdLine.append(mbsToWcs(distroGuid));
+    std::unique_ptr<Benchmark> bench;
+    if (benchMode) {
+        std::stringstream desc;
+        desc << (benchParams.test == BenchTest::Throughput ? "throughput" : "latency")
+             << ", " << (usePty ? "pty" : "pipes")
+             << (useMux ? ", mux" : "") << (useEpoll ? ", epoll" : "")
+             << (useDaemon ? ", daemon" : "")
+             << ", window " << windowParams.size << "/" << windowParams.threshold
+             << "/" << windowParams.max
+             << ", buffers " << bufferParams.input << "/" << bufferParams.output;
+        if (socketBufferSize != 0) {
+            desc << ", socket buffers " << socketBufferSize;
+        }
+        bench = std::unique_ptr<Benchmark>(new Benchmark(benchParams, desc.str()));
     }
-    cmdLine.append(L" -c ");
-    appendBashArg(cmdLine, bashCmdLine);
+
+    if (useDaemon) {
+        // These only matter if a daemon has to be started.
+        std::vector<std::wstring> daemonArgs;
+        if (daemonPool != 0) {
+            daemonArgs.push_back(L"--pool=" + std::to_wstring(daemonPool));
+        }
+        if (daemonPoolIdle != 0) {
+            daemonArgs.push_back(L"--pool-idle=" + std::to_wstring(daemonPoolIdle));
+        }
+        const int64_t connectStart = traceClockMicros();
+        const int sessionSocket =
+            connectDaemonSession(bashPath, distroGuid, launcher, backendPathCache, daemonArgs,
+                                 socketBufferSize);
+        tracePhase("connect to daemon", connectStart);
+        backendArgs.insert(backendArgs.begin(),
+                           versionCheckArg());
+        sendSpawnRequest(sessionSocket, backendArgs);
+        if (!benchMode && usePty) {
+            const int64_t rawStart = traceClockMicros();
+            g_terminalState.enterRawMode();
+            tracePhase("enterRawMode", rawStart);
+        }
+        mainLoop(spawnCwd,
+                 usePty, useMux, sessionSocket, -1, -1, -1,
+                 initialSize, windowParams, bufferParams, ackIntervalUs,
+                 resizeIntervalUs, pingIntervalUs, useCompress, coalesce,
+                 skipRedraws, useStats, bench.get());
+        return 0;
+    }
+
+    Socket controlSocket(socketBufferSize);
+    std::unique_ptr<Socket> inputSocket;
+    std::unique_ptr<Socket> outputSocket;
+    std::unique_ptr<Socket> errorSocket;
+    if (transferMode) {
+        // Every data connection of the transfer comes to the -0 port.
+        inputSocket = std::unique_ptr<Socket>(new Socket(socketBufferSize, transfer.streams));
+    } else if (!useMux) {
+        inputSocket = std::unique_ptr<Socket>(new Socket(socketBufferSize));
+        outputSocket = std::unique_ptr<Socket>(new Socket(socketBufferSize));
+        if (!usePty) {
+            errorSocket = std::unique_ptr<Socket>(new Socket(socketBufferSize));
+        }
+    }
+    const auto key = randomString();
+
+    // Prepare the backend command line.
+    std::wstring bashCmdLine = launcher;
+    size_t argsLength = 0;
+    for (const auto &arg : backendArgs) {
+        argsLength += 1 + arg.size() + 2;
+    }
+    bashCmdLine.reserve(bashCmdLine.size() + kBackendArgsReserve + argsLength);
+    if (debugFork) {
+        appendBashArg(bashCmdLine, L"--debug-fork");
+    }
+    appendBashArg(bashCmdLine, versionCheckArg());
+    if (cachedPathWsl.empty()) {
+        appendBashArg(bashCmdLine, L"--report-path");
+        g_backendPathCache = &backendPathCache;
+    }
+    appendBashArg(bashCmdLine, L"-3" + std::to_wstring(controlSocket.port()));
+    appendBashArg(bashCmdLine, L"-k" + mbsToWcs(key));
+    if (inputSocket) {
+        appendBashArg(bashCmdLine, L"-0" + std::to_wstring(inputSocket->port()));
+    }
+    if (outputSocket) {
+        appendBashArg(bashCmdLine, L"-1" + std::to_wstring(outputSocket->port()));
+    }
+    if (errorSocket) {
+        appendBashArg(bashCmdLine, L"-2" + std::to_wstring(errorSocket->port()));
+    }
+    for (const auto &arg : backendArgs) {
+        appendBashArg(bashCmdLine, arg);
+    }
+
+    auto cmdLine = bashCommandLine(bashPath, distroGuid, bashCmdLine);
 
     const auto outputPipe = createPipe();
     const auto errorPipe = createPipe();
@@ -1212,6 +4321,7 @@ int main(int argc, char *argv[]) {
     }
 
     PROCESS_INFORMATION pi = {};
+    const int64_t createStart = traceClockMicros();
     BOOL success = CreateProcessW(bashPath.c_str(), &cmdLine[0], nullptr, nullptr,
         true,
         debugFork ? CREATE_NEW_CONSOLE : CREATE_NO_WINDOW,
@@ -1220,6 +4330,7 @@ int main(int argc, char *argv[]) {
         fatal("error starting bash.exe adapter: %s\n",
             formatErrorMessage(GetLastError()).c_str());
     }
+    tracePhase("CreateProcessW", createStart);
 
     CloseHandle(outputPipe.wh);
     CloseHandle(errorPipe.wh);
@@ -1251,6 +4362,8 @@ int main(int argc, char *argv[]) {
         if (backendStarted) {
             msg = "\nwslbridge error: backend process died\n";
         } else {
+            // The cached path may be stale, so look it up again next time.
+            backendPathCache.clear();
             msg = "wslbridge error: failed to start backend process\n";
             if (fsname != L"NTFS") {
                 msg.append("note: backend program is at '");
@@ -1275,24 +4388,65 @@ int main(int argc, char *argv[]) {
         g_terminalState.fatal("%s", msg.c_str());
     });
 
+    // The backend connects every socket at once, so accept them concurrently.
+    int inputSocketC = -1;
+    int outputSocketC = -1;
+    int errorSocketC = -1;
+    std::vector<std::thread> acceptThreads;
+    const auto acceptInBackground = [&](Socket *socket, int *socketC, const char *name) {
+        if (socket != nullptr) {
+            const uint32_t thread = acceptThreads.size() + 1;
+            acceptThreads.emplace_back([=, &key, &timeline]() {
+                const int64_t start = traceClockMicros();
+                *socketC = acceptClientAndAuthenticate(*socket, key);
+                if (timeline) {
+                    timeline->frontend.add(name, start, traceClockMicros(), thread);
+                }
+            });
+        }
+    };
+    if (!transferMode) {
+        acceptInBackground(inputSocket.get(), &inputSocketC, "accept input");
+    }
+    acceptInBackground(outputSocket.get(), &outputSocketC, "accept output");
+    acceptInBackground(errorSocket.get(), &errorSocketC, "accept error");
+    const int64_t acceptStart = traceClockMicros();
     const int controlSocketC = acceptClientAndAuthenticate(controlSocket, key);
-    const int inputSocketC = acceptClientAndAuthenticate(inputSocket, key);
-    const int outputSocketC = acceptClientAndAuthenticate(outputSocket, key);
-    const int errorSocketC = !errorSocket ? -1 : acceptClientAndAuthenticate(*errorSocket, key);
+    tracePhase("accept control", acceptStart);
+    if (transferMode) {
+        backendStarted = true;
+        FileTransfer(transfer, controlSocketC).run(*inputSocket, key);
+    }
+    if (useSpawnParams) {
+        sendSpawnParams(controlSocketC, spawnCwd, env.pairs(), initialSize,
+                        std::vector<std::string>(argv + optind, argv + argc));
+    }
+    for (auto &t : acceptThreads) {
+        t.join();
+    }
     controlSocket.close();
-    inputSocket.close();
-    outputSocket.close();
+    if (inputSocket) { inputSocket->close(); }
+    if (outputSocket) { outputSocket->close(); }
     if (errorSocket) { errorSocket->close(); }
 
-    if (usePty) {
+    if (!benchMode && usePty) {
+        const int64_t rawStart = traceClockMicros();
         g_terminalState.enterRawMode();
+        tracePhase("enterRawMode", rawStart);
     }
 
     backendStarted = true;
 
+    if (multiMode) {
+        MultiRunner runner(controlSocketC, windowParams, multiJobs);
+        runner.run();
+    }
+
     mainLoop(spawnCwd,
-             usePty, controlSocketC,
+             usePty, useMux, controlSocketC,
              inputSocketC, outputSocketC, errorSocketC,
-             initialSize);
+             initialSize, windowParams, bufferParams, ackIntervalUs,
+             resizeIntervalUs, pingIntervalUs, useCompress, coalesce,
+             skipRedraws, useStats, bench.get());
     return 0;
 }